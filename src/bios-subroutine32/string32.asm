@@ -0,0 +1,15 @@
+BITS 32
+  org 0x7c00
+; subroutine32.asmと同じ文字列を、1文字ずつではなくBIOSの文字列表示機能で一度に表示する
+start:                          ; プログラムの開始
+  mov ebp, msg                  ; 文字列の番地(セグメントがないのでES:BPではなくEBPに入れる)
+  mov ecx, msglen               ; 文字数
+  mov ebx, 10                   ; 文字色の指定
+  mov edx, 0                    ; 表示を始める行(dh)と列(dl)
+  mov eax, 0x1301               ; ah=0x13で文字列表示機能、al=1で表示後にカーソルを進める
+  int 0x10                      ; BIOSを呼び出す
+  jmp 0                         ; プログラムの終了
+
+msg:
+  db "hello, world", 0x0d, 0x0a
+msglen equ $ - msg
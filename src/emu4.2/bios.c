@@ -2,16 +2,32 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include "emulator_function.h"
 #include "io.h"
+#include "disk.h"
+#include "vga.h"
 
 /* BIOSの色コードを端末の色コードに変換するテーブル */
 static int bios_to_terminal[8] = {30, 34, 32, 36, 31, 35, 33, 37};
 
-static void put_string(const char* s, size_t n) {
-  size_t i;
-  for(i = 0; i < n; i++) {
-    io_out8(0x03f8, s[i]); // 0x03f8番のポートに１バイト出力すると、それがそのまま画面に出力される
+/* 端末の文字色をBIOSの色番号colorにする */
+/* 文字ごとに色を付けて戻すのではなく、色が変わったときだけエスケープシーケンスを出力する */
+static void set_terminal_color(OutputBuffer* out, uint8_t color) {
+  if(!out->colorless && out->color != color) {
+    char buf[32];
+    /* blレジスタでBIOSに指定できる色は4ビットで、そのうち最上位ビットは輝度を表す */
+    /* 下位3ビットを取り出してBIOSの色番号からANSIエスケープシーケンスの色番号へ変換した値をterminal_colorに書き込む*/
+    int terminal_color = bios_to_terminal[color & 0x07];
+    int bright         = (color & 0x08) ? 1 : 0;
+    /* ANSIエスケープシーケンスによる色付け */
+    /* \x1b[1;32m 明るい緑色にする*/
+    /* \x1b[0m 文字色のリセット(output_reset_colorで出力する)*/
+    /* C言語の機能で\xYYと書くと文字コードがYYである一文字を表すことができる。
+       画面に表示できないような特殊な文字を文字列の一部として埋め込むために使える機能*/
+    int len            = sprintf(buf, "\x1b[%d;%dm", bright, terminal_color);
+    output_write(out, buf, len);
+    out->color = color;
   }
 }
 
@@ -21,20 +37,69 @@ static void bios_video_teletype(Emulator* emu){
   /* BIOSの一文字表示機能ではblレジスタに文字色を指定する*/
   uint8_t color = get_register8(emu, BL) & 0x0f;
   uint8_t ch    = get_register8(emu, AL);
+  OutputBuffer* out = &emu->output;
 
-  char buf[32];
-  /* blレジスタでBIOSに指定できる色は4ビットで、そのうち最上位ビットは輝度を表す */
-  /* 下位3ビットを取り出してBIOSの色番号からANSIエスケープシーケンスの色番号へ変換した値をterminal_colorに書き込む*/
-  int terminal_color = bios_to_terminal[color & 0x07];
-  int bright         = (color & 0x08) ? 1 : 0;
-  /* ANSIエスケープシーケンスによる色付け */
-  /* \x1b[1;32m 明るい緑色にする*/
-  /* \x1b[0m 文字色のリセット*/
-  /* \x1b[輝度;色番号m文字コード\x1b[0m */
-  /* C言語の機能で\xYYと書くと文字コードがYYである一文字を表すことができる。
-     画面に表示できないような特殊な文字を文字列の一部として埋め込むために使える機能*/
-  int len            = sprintf(buf, "\x1b[%d;%dm%c\x1b[0m", bright, terminal_color, ch);
-  put_string(buf, len);
+  /* テキスト画面があれば、端末ではなく画面のカーソル位置に書く(背景は黒) */
+  if(emu->vga != NULL) {
+    vga_teletype(emu->vga, ch, color);
+    return;
+  }
+
+  set_terminal_color(out, color);
+  output_put8(out, ch);
+}
+
+/* 文字列の表示(AH=13h)
+ *
+ * AL=書き込みモード(0ビット目: カーソルを文字列の後ろへ進める、
+ * 1ビット目: 文字列が文字とアトリビュートの組の並び)、BL=アトリビュート、
+ * CX=文字数、DH,DL=表示を始める行と列。
+ * セグメントがないので、文字列はES:BPではなくEBPの番地から読む。
+ * ゲストのメモリから直接読み、1文字ずつBIOSを呼ぶ代わりにまとめて出力する
+ */
+static void bios_video_write_string(Emulator* emu) {
+  uint8_t mode      = get_register8(emu, AL);
+  uint8_t attribute = get_register8(emu, BL);
+  uint32_t count    = get_register16(emu, ECX);
+  uint32_t address  = get_register32(emu, EBP);
+  uint32_t size     = (mode & 0x02) ? count * 2 : count;
+  const uint8_t* p  = emu->memory + address;
+  OutputBuffer* out = &emu->output;
+  uint32_t i;
+
+  /* ゲストのメモリからはみ出す文字列は表示しない */
+  if(address >= emu->memory_size || size > emu->memory_size - address) {
+    return;
+  }
+
+  if(emu->vga != NULL) {
+    Vga* vga       = emu->vga;
+    uint16_t saved = vga_get_cursor(vga);
+
+    vga_set_cursor(vga, get_register8(emu, DH) * VGA_COLUMNS + get_register8(emu, DL));
+    for(i = 0; i < count; i++) {
+      if(mode & 0x02) {
+        vga_teletype(vga, p[i * 2], p[i * 2 + 1]);
+      } else {
+        vga_teletype(vga, p[i], attribute);
+      }
+    }
+    if(!(mode & 0x01)) {
+      vga_set_cursor(vga, saved);
+    }
+    return;
+  }
+
+  /* 端末は1本の文字の流れなので、表示位置は使わない */
+  if(mode & 0x02) {
+    for(i = 0; i < count; i++) {
+      set_terminal_color(out, p[i * 2 + 1] & 0x0f);
+      output_put8(out, p[i * 2]);
+    }
+  } else {
+    set_terminal_color(out, attribute & 0x0f);
+    output_write(out, p, count);
+  }
 }
 
 
@@ -47,7 +112,139 @@ void bios_video(Emulator* emu) {
   case 0x0e: // 一文字表示機能(テレタイプ出力)
     bios_video_teletype(emu);
     break;
+  case 0x13: // 文字列表示機能
+    bios_video_write_string(emu);
+    break;
   default:
+    output_flush(&emu->output);
     printf("not implemented BIOS video function: 0x%02x\n", func);      
   }
 }
+
+/* INT 13hのステータス(AHに返す値) */
+#define DISK_OK              0x00
+#define DISK_BAD_COMMAND     0x01
+#define DISK_WRITE_PROTECTED 0x03
+#define DISK_NOT_FOUND       0x04
+#define DISK_BAD_ADDRESS     0x09 /* 転送先がゲストのメモリに収まらない */
+#define DISK_NOT_READY       0x80
+
+/* lbaからcount個のセクタをゲストのaddressとの間でコピーする */
+/* 間にバッファを挟まず、mmapしたイメージとゲストのメモリとの間で直接memcpyする */
+static int disk_transfer(Emulator* emu, Disk* disk, uint64_t lba, uint32_t count, uint32_t address, int write) {
+  size_t offset = lba * DISK_SECTOR_SIZE;
+  size_t length = (size_t)count * DISK_SECTOR_SIZE;
+
+  if(lba > disk->sectors || count > disk->sectors - lba) {
+    return DISK_NOT_FOUND;
+  }
+  if(address > emu->memory_size || length > emu->memory_size - address) {
+    return DISK_BAD_ADDRESS;
+  }
+
+  if(write) {
+    if(disk->read_only) {
+      return DISK_WRITE_PROTECTED;
+    }
+    memcpy(disk->data + offset, emu->memory + address, length);
+  } else {
+    memcpy(emu->memory + address, disk->data + offset, length);
+    mark_memory_dirty(emu, address, length);
+    emu->memory_writes++;
+  }
+  return DISK_OK;
+}
+
+/* AH=02h/03h: CHSで指定したセクタを読み書きする
+ *
+ * AL=セクタ数、CH=シリンダの下位8ビット、CLの0〜5ビット=セクタ(1から)、
+ * CLの6,7ビット=シリンダの上位2ビット、DH=ヘッド。
+ * セグメントがないので、転送先はES:BXではなくEBXの番地とする
+ */
+static int bios_disk_chs(Emulator* emu, Disk* disk, int write) {
+  uint32_t count    = get_register8(emu, AL);
+  uint8_t cl        = get_register8(emu, CL);
+  uint32_t cylinder = get_register8(emu, CH) | ((cl & 0xc0) << 2);
+  uint32_t sector   = cl & 0x3f;
+  uint32_t head     = get_register8(emu, DH);
+  uint64_t lba;
+  int status;
+
+  if(count == 0 || sector == 0 || sector > disk->sectors_per_track || head >= disk->heads) {
+    set_register8(emu, AL, 0);
+    return DISK_NOT_FOUND;
+  }
+  lba    = ((uint64_t)cylinder * disk->heads + head) * disk->sectors_per_track + sector - 1;
+  status = disk_transfer(emu, disk, lba, count, get_register32(emu, EBX), write);
+  /* ALには転送できたセクタ数を返す */
+  set_register8(emu, AL, status == DISK_OK ? count : 0);
+  return status;
+}
+
+/* AH=42h/43h: LBAで指定したセクタを読み書きする
+ *
+ * ESIの番地にあるディスクアドレスパケットで転送を指定する。
+ * 転送先はセグメント:オフセットを実アドレスに直した番地とし、
+ * 0xffff:0xffffのときは16バイト目からの64ビットの番地を使う(EDD 3.0)
+ */
+static int bios_disk_lba(Emulator* emu, Disk* disk, int write) {
+  uint32_t packet  = get_register32(emu, ESI);
+  uint8_t size     = get_memory8(emu, packet);
+  uint32_t count   = get_memory8(emu, packet + 2) | (get_memory8(emu, packet + 3) << 8);
+  uint32_t buffer  = get_memory32(emu, packet + 4);
+  uint64_t lba     = get_memory32(emu, packet + 8) | ((uint64_t)get_memory32(emu, packet + 12) << 32);
+  uint32_t address = (buffer >> 16) * 16 + (buffer & 0xffff);
+  int status;
+
+  if(size < 16) {
+    return DISK_BAD_COMMAND;
+  }
+  if(buffer == 0xffffffff) {
+    if(size < 24 || get_memory32(emu, packet + 20) != 0) {
+      return DISK_BAD_ADDRESS;
+    }
+    address = get_memory32(emu, packet + 16);
+  }
+
+  status = disk_transfer(emu, disk, lba, count, address, write);
+  /* 転送できなかったときは、パケットのセクタ数を0にして返す */
+  if(status != DISK_OK) {
+    set_memory8(emu, packet + 2, 0);
+    set_memory8(emu, packet + 3, 0);
+  }
+  return status;
+}
+
+void bios_disk(Emulator* emu) {
+  uint8_t func  = get_register8(emu, AH);
+  Disk* disk    = emu->disk;
+  int status;
+
+  if(disk == NULL || get_register8(emu, DL) != disk->drive) {
+    status = DISK_NOT_READY;
+  } else {
+    switch(func) {
+    case 0x00: // ディスクのリセット(何もすることはない)
+      status = DISK_OK;
+      break;
+    case 0x02: // セクタの読み込み(CHS)
+      status = bios_disk_chs(emu, disk, 0);
+      break;
+    case 0x03: // セクタの書き込み(CHS)
+      status = bios_disk_chs(emu, disk, 1);
+      break;
+    case 0x42: // セクタの読み込み(LBA)
+      status = bios_disk_lba(emu, disk, 0);
+      break;
+    case 0x43: // セクタの書き込み(LBA)
+      status = bios_disk_lba(emu, disk, 1);
+      break;
+    default:
+      status = DISK_BAD_COMMAND;
+    }
+  }
+
+  /* 結果はAHとキャリーフラグで返す */
+  set_register8(emu, AH, status);
+  set_carry(emu, status != DISK_OK);
+}
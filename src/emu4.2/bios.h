@@ -5,4 +5,11 @@
 
 void bios_video(Emulator* emu);
 
+/* INT 13h: emu->diskのディスクイメージを読み書きする
+ *
+ * AH=00h(リセット)、02h/03h(CHSでの読み書き)、42h/43h(LBAでの読み書き)に対応する。
+ * 成功すればキャリーフラグを0に、失敗すれば1にし、AHにステータスを返す
+ */
+void bios_disk(Emulator* emu);
+
 #endif
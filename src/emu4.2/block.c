@@ -0,0 +1,627 @@
+#include "block.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "decode.h"
+#include "emulator_function.h"
+#include "trace.h"
+
+/* ブロック表のエントリ数(2のべき乗) */
+#define BLOCK_TABLE_SIZE 4096
+
+/* 作成できるブロックの最大数 */
+/* ブロックは表のエントリからだけ指されるので、エントリと同じ数あれば足りなくなることはない */
+#define BLOCK_ARENA_SIZE BLOCK_TABLE_SIZE
+
+/* コンパイル依頼キューの長さ(2のべき乗) */
+#define COMPILE_QUEUE_SIZE 256
+
+/* コンパイルの依頼
+ *
+ * コンパイルスレッドはゲストのメモリを直接読まず、
+ * メインスレッドが依頼するときに写し取った機械語と書き換えの世代を使う。
+ * コンパイルしたブロックも依頼の中に書いて返し、表に入れるのはメインスレッドが行う
+ */
+typedef struct {
+  uint32_t eip;
+  /* codeに写し取ったバイト数 */
+  uint32_t size;
+  uint32_t line;
+  uint32_t line_count;
+  uint32_t versions[BLOCK_CODE_LINES];
+  uint8_t code[BLOCK_SNAPSHOT_SIZE];
+  /* コンパイルできたら1にしてblockに結果を置く */
+  int compiled;
+  Block block;
+} CompileRequest;
+
+/* ブロック表のエントリ
+ *
+ * eipの下位ビットで引くダイレクトマップ方式。メインスレッドだけが触る
+ */
+typedef struct {
+  uint32_t eip;
+  uint32_t counter;
+  int queued;
+  Block* block;
+} BlockEntry;
+
+struct BlockCache {
+  Emulator* emu;
+
+  BlockEntry table[BLOCK_TABLE_SIZE];
+
+  /* ブロックの置き場所と、空いている場所の番号のスタック。メインスレッドだけが触る */
+  Block* arena;
+  uint32_t free_blocks[BLOCK_ARENA_SIZE];
+  uint32_t free_count;
+
+  /* メインスレッドが書き込み、コンパイルスレッドが読み出す単一生産者・単一消費者のキュー */
+  /* doneからqueue_headまでは、コンパイルが終わってメインスレッドが結果を受け取っていない依頼 */
+  CompileRequest queue[COMPILE_QUEUE_SIZE];
+  _Atomic uint32_t queue_head;  /* 次にコンパイルする位置(コンパイルスレッドが更新) */
+  _Atomic uint32_t queue_tail;  /* 次に書き込む位置(メインスレッドが更新) */
+  uint32_t done;                /* 次に結果を受け取る位置(メインスレッドが更新) */
+  sem_t queue_sem;
+
+  atomic_int stop;
+  pthread_t thread;
+
+  /* emu->code_linesとemu->code_versionsの実体。メインスレッドだけが触る */
+  uint32_t* code_lines;
+  uint32_t* code_versions;
+};
+
+static BlockEntry* entry_of(BlockCache* cache, uint32_t eip) {
+  return &cache->table[eip & (BLOCK_TABLE_SIZE - 1)];
+}
+
+/* 1命令をデコードしてopに変換する
+ *
+ * レジスタだけを操作する命令はオペランドをデコードしておき、
+ * それ以外の命令は実行関数の呼び出しにする
+ */
+static void compile_op(const uint8_t* code, uint32_t address, int length, BlockOp* op) {
+  uint8_t opcode = code[0];
+  uint8_t mod    = code[1] >> 6;
+  uint8_t reg    = (code[1] >> 3) & 7;
+  uint8_t rm     = code[1] & 7;
+  uint32_t imm32 = code[1] | (code[2] << 8) | (code[3] << 16) | ((uint32_t)code[4] << 24);
+
+  op->kind   = BLOCK_OP_HELPER;
+  op->length = length;
+  op->func   = instructions[opcode];
+
+  switch(opcode) {
+  case 0x01: /* add rm32, r32 */
+    if(mod == 3) {
+      op->kind = BLOCK_OP_ADD_REG;
+      op->dst  = rm;
+      op->src  = reg;
+    }
+    break;
+  case 0x3B: /* cmp r32, rm32 */
+    if(mod == 3) {
+      op->kind = BLOCK_OP_CMP_REG;
+      op->dst  = reg;
+      op->src  = rm;
+    }
+    break;
+  case 0x3C: /* cmp al, imm8 */
+    op->kind = BLOCK_OP_CMP_AL_IMM;
+    op->imm  = code[1];
+    break;
+  case 0x3D: /* cmp eax, imm32 */
+    op->kind = BLOCK_OP_CMP_IMM;
+    op->dst  = EAX;
+    op->imm  = imm32;
+    break;
+  case 0x40 ... 0x47: /* inc r32 */
+    op->kind = BLOCK_OP_INC;
+    op->dst  = opcode - 0x40;
+    break;
+  case 0x50 ... 0x57: /* push r32 */
+    op->kind = BLOCK_OP_PUSH_REG;
+    op->src  = opcode - 0x50;
+    break;
+  case 0x58 ... 0x5F: /* pop r32 */
+    op->kind = BLOCK_OP_POP;
+    op->dst  = opcode - 0x58;
+    break;
+  case 0x68: /* push imm32 */
+    op->kind = BLOCK_OP_PUSH_IMM;
+    op->imm  = imm32;
+    break;
+  case 0x6A: /* push imm8 */
+    op->kind = BLOCK_OP_PUSH_IMM;
+    op->imm  = code[1];
+    break;
+  case 0x70 ... 0x7F: /* jcc rel8 */
+    op->kind = BLOCK_OP_JCC;
+    op->src  = opcode & 0x0f;
+    op->imm  = address + length + (int8_t)code[1];
+    break;
+  case 0x83: /* add/sub/cmp rm32, imm8 */
+    if(mod == 3 && (reg == 0 || reg == 5 || reg == 7)) {
+      op->kind = reg == 0 ? BLOCK_OP_ADD_IMM : reg == 5 ? BLOCK_OP_SUB_IMM : BLOCK_OP_CMP_IMM;
+      op->dst  = rm;
+      op->imm  = (int32_t)(int8_t)code[2];
+    }
+    break;
+  case 0x89: /* mov rm32, r32 */
+    if(mod == 3) {
+      op->kind = BLOCK_OP_MOV_REG;
+      op->dst  = rm;
+      op->src  = reg;
+    }
+    break;
+  case 0x8B: /* mov r32, rm32 */
+    if(mod == 3) {
+      op->kind = BLOCK_OP_MOV_REG;
+      op->dst  = reg;
+      op->src  = rm;
+    }
+    break;
+  case 0xB8 ... 0xBF: /* mov r32, imm32 */
+    op->kind = BLOCK_OP_MOV_IMM;
+    op->dst  = opcode - 0xB8;
+    op->imm  = imm32;
+    break;
+  case 0xC7: /* mov rm32, imm32 */
+    if(mod == 3) {
+      op->kind = BLOCK_OP_MOV_IMM;
+      op->dst  = rm;
+      op->imm  = code[2] | (code[3] << 8) | (code[4] << 16) | ((uint32_t)code[5] << 24);
+    }
+    break;
+  case 0xC9: /* leave */
+    op->kind = BLOCK_OP_LEAVE;
+    break;
+  case 0xE9: /* jmp rel32 */
+    op->kind = BLOCK_OP_JUMP;
+    op->imm  = address + length + imm32;
+    break;
+  case 0xEB: /* jmp rel8 */
+    op->kind = BLOCK_OP_JUMP;
+    op->imm  = address + length + (int8_t)code[1];
+    break;
+  }
+}
+
+/* 写し取った機械語の先頭から分岐命令までをデコードし、request->blockにブロックを作る */
+/* 先頭の命令からデコードできなければ0を返す */
+static int compile_block(CompileRequest* request) {
+  Block* block    = &request->block;
+  uint32_t offset = 0;
+
+  block->start      = request->eip;
+  block->count      = 0;
+
+  /* 即値を読むときに写し取った範囲の末尾を超えないよう、最長の命令分の余裕を残す */
+  while(block->count < BLOCK_MAX_INSNS && offset + 16 < request->size) {
+    uint8_t code = request->code[offset];
+    int length   = instruction_length(request->code + offset, request->size - offset);
+
+    /* 未実装の命令はブロックに含めず、インタプリタにエラーを出させる */
+    if(length == 0 || instructions[code] == NULL) {
+      break;
+    }
+    compile_op(request->code + offset, request->eip + offset, length, &block->ops[block->count++]);
+    offset += length;
+    if(opcode_flags[code] & OP_BRANCH) {
+      break;
+    }
+  }
+
+  if(block->count == 0) {
+    return 0;
+  }
+  /* 書き換えを調べるのは、実際に命令を読んだ範囲だけにする */
+  block->line       = request->line;
+  block->line_count = ((request->eip + offset - 1) >> CODE_LINE_SHIFT) - block->line + 1;
+  memcpy(block->versions, request->versions, sizeof(uint32_t) * block->line_count);
+  return 1;
+}
+
+/* バックグラウンドのコンパイルスレッド */
+static void* compile_thread(void* arg) {
+  BlockCache* cache = arg;
+
+  for(;;) {
+    uint32_t head;
+    CompileRequest* request;
+
+    sem_wait(&cache->queue_sem);
+    if(atomic_load(&cache->stop)) {
+      break;
+    }
+
+    head    = atomic_load_explicit(&cache->queue_head, memory_order_relaxed);
+    request = &cache->queue[head & (COMPILE_QUEUE_SIZE - 1)];
+    request->compiled = compile_block(request);
+    /* 結果を書き終えてから、その依頼をメインスレッドに返す */
+    atomic_store_explicit(&cache->queue_head, head + 1, memory_order_release);
+  }
+  return NULL;
+}
+
+/* コンパイルを依頼する。キューが一杯なら0を返す
+ *
+ * eipからの機械語を写し取り、その範囲にコンパイル済みの印を付けて世代を覚えておく。
+ * 以降にその範囲へ書き込むと世代が進むので、古い機械語から作ったブロックは使われない
+ */
+static int request_compile(BlockCache* cache, uint32_t eip) {
+  Emulator* emu = cache->emu;
+  uint32_t tail = atomic_load_explicit(&cache->queue_tail, memory_order_relaxed);
+  CompileRequest* request;
+  uint32_t i;
+
+  /* 結果を受け取るまでは依頼の場所を使い回さない */
+  if(tail - cache->done == COMPILE_QUEUE_SIZE || eip >= emu->memory_size) {
+    return 0;
+  }
+  request = &cache->queue[tail & (COMPILE_QUEUE_SIZE - 1)];
+  request->eip  = eip;
+  request->size = emu->memory_size - eip < BLOCK_SNAPSHOT_SIZE ? emu->memory_size - eip : BLOCK_SNAPSHOT_SIZE;
+  memcpy(request->code, emu->memory + eip, request->size);
+  request->line       = eip >> CODE_LINE_SHIFT;
+  request->line_count = ((eip + request->size - 1) >> CODE_LINE_SHIFT) - request->line + 1;
+  for(i = 0; i < request->line_count; i++) {
+    uint32_t line = request->line + i;
+    cache->code_lines[line >> 5] |= 1u << (line & 31);
+    request->versions[i] = cache->code_versions[line];
+  }
+  atomic_store_explicit(&cache->queue_tail, tail + 1, memory_order_release);
+  sem_post(&cache->queue_sem);
+  return 1;
+}
+
+BlockCache* create_block_cache(Emulator* emu) {
+  BlockCache* cache = calloc(1, sizeof(BlockCache));
+  uint32_t i;
+
+  cache->emu   = emu;
+  cache->arena = malloc(sizeof(Block) * BLOCK_ARENA_SIZE);
+  for(i = 0; i < BLOCK_ARENA_SIZE; i++) {
+    cache->free_blocks[i] = BLOCK_ARENA_SIZE - 1 - i;
+  }
+  cache->free_count = BLOCK_ARENA_SIZE;
+  cache->code_lines    = calloc(((emu->memory_size >> CODE_LINE_SHIFT) + 31) / 32, sizeof(uint32_t));
+  cache->code_versions = calloc(emu->memory_size >> CODE_LINE_SHIFT, sizeof(uint32_t));
+  emu->code_lines    = cache->code_lines;
+  emu->code_versions = cache->code_versions;
+  emu->hooks        |= HOOK_CODE;
+  sem_init(&cache->queue_sem, 0, 0);
+  pthread_create(&cache->thread, NULL, compile_thread, cache);
+  return cache;
+}
+
+void destroy_block_cache(BlockCache* cache) {
+  atomic_store(&cache->stop, 1);
+  sem_post(&cache->queue_sem);
+  pthread_join(cache->thread, NULL);
+  sem_destroy(&cache->queue_sem);
+  cache->emu->hooks        &= ~HOOK_CODE;
+  cache->emu->code_lines    = NULL;
+  cache->emu->code_versions = NULL;
+  free(cache->code_lines);
+  free(cache->code_versions);
+  free(cache->arena);
+  free(cache);
+}
+
+/* ブロックの機械語が、コンパイルを依頼してから書き換えられていなければ1を返す */
+static int block_current(Emulator* emu, Block* block) {
+  uint32_t i;
+
+  for(i = 0; i < block->line_count; i++) {
+    if(emu->code_versions[block->line + i] != block->versions[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* エントリのブロックを捨てて置き場所を空ける */
+/* 実行中のブロックはないメインスレッドのfind_blockからだけ呼ぶ */
+static void drop_block(BlockCache* cache, BlockEntry* entry) {
+  if(entry->block != NULL) {
+    cache->free_blocks[cache->free_count++] = entry->block - cache->arena;
+    entry->block = NULL;
+  }
+}
+
+/* コンパイルの終わった依頼の結果を受け取り、依頼したときのエントリに入れる */
+static void collect_compiled(BlockCache* cache) {
+  uint32_t head = atomic_load_explicit(&cache->queue_head, memory_order_acquire);
+
+  while(cache->done != head) {
+    CompileRequest* request = &cache->queue[cache->done & (COMPILE_QUEUE_SIZE - 1)];
+    BlockEntry* entry       = entry_of(cache, request->eip);
+
+    cache->done++;
+    /* 待っている間にエントリを別の番地が使い始めていたら、結果は捨てる */
+    if(entry->eip != request->eip || !entry->queued) {
+      continue;
+    }
+    entry->queued = 0;
+    drop_block(cache, entry);
+    if(!request->compiled || cache->free_count == 0) {
+      /* コンパイルできなければ、もう一度しきい値まで数えてから依頼し直す */
+      entry->counter = 0;
+      continue;
+    }
+    entry->block  = &cache->arena[cache->free_blocks[--cache->free_count]];
+    *entry->block = request->block;
+  }
+}
+
+Block* find_block(BlockCache* cache, uint32_t eip) {
+  BlockEntry* entry = entry_of(cache, eip);
+  Block* block;
+
+  if(cache->done != atomic_load_explicit(&cache->queue_head, memory_order_relaxed)) {
+    collect_compiled(cache);
+  }
+
+  block = entry->block;
+  if(block != NULL && block->start == eip) {
+    if(block_current(cache->emu, block)) {
+      return block;
+    }
+    /* 書き換えられた機械語のブロックは捨て、インタプリタで数え直してからコンパイルし直す */
+    drop_block(cache, entry);
+    entry->counter = 0;
+    entry->queued  = 0;
+  }
+
+  /* 別の番地がエントリを使っていたら、そのブロックを捨てて数え直す */
+  if(entry->eip != eip) {
+    drop_block(cache, entry);
+    entry->eip     = eip;
+    entry->counter = 0;
+    entry->queued  = 0;
+  }
+
+  if(!entry->queued && ++entry->counter >= BLOCK_HOT_THRESHOLD) {
+    entry->queued = request_compile(cache, eip);
+  }
+  return NULL;
+}
+
+/* 直接分岐の飛び先を返す。飛び先が決まらない命令なら0を返す */
+static uint32_t branch_target(const uint8_t* code, uint32_t address, int length) {
+  switch(code[0]) {
+  case 0x70 ... 0x7F: /* jcc rel8 */
+  case 0xEB:          /* jmp rel8 */
+    return address + length + (int8_t)code[1];
+  case 0xE8:          /* call rel32 */
+  case 0xE9:          /* jmp rel32 */
+    return address + length + (code[1] | (code[2] << 8) | (code[3] << 16) | ((uint32_t)code[4] << 24));
+  }
+  return 0;
+}
+
+/* addressをブロックの先頭として、実行回数を数えずにコンパイルを依頼する */
+/* キューが一杯なら0を返す */
+static int prescan_leader(BlockCache* cache, uint32_t address) {
+  BlockEntry* entry = entry_of(cache, address);
+
+  if(entry->eip == address && (entry->queued || entry->block != NULL)) {
+    return 1;
+  }
+  drop_block(cache, entry);
+  entry->eip     = address;
+  entry->counter = 0;
+  entry->queued  = request_compile(cache, address);
+  return entry->queued;
+}
+
+void block_prescan(BlockCache* cache, uint32_t address, uint32_t size) {
+  Emulator* emu = cache->emu;
+  const uint8_t* code;
+  uint32_t* boundaries;
+  uint32_t* leaders;
+  uint32_t words, offset, i;
+  int full = 0;
+
+  if(address >= emu->memory_size || size == 0) {
+    return;
+  }
+  if(size > emu->memory_size - address) {
+    size = emu->memory_size - address;
+  }
+  code       = emu->memory + address;
+  words      = (size + 31) / 32;
+  boundaries = calloc(words, sizeof(uint32_t));
+  leaders    = calloc(words, sizeof(uint32_t));
+  decode_boundaries(code, size, boundaries);
+
+  /* 先頭、分岐の次の命令、範囲内の命令の境界に飛ぶ直接分岐の飛び先をブロックの先頭とする */
+  leaders[0] |= 1;
+  for(i = 0; i < words; i++) {
+    uint32_t bits = boundaries[i];
+    while(bits != 0) {
+      uint8_t opcode;
+      int length;
+      uint32_t target;
+
+      offset = i * 32 + __builtin_ctz(bits);
+      bits  &= bits - 1;
+      opcode = code[offset];
+      if(!(opcode_flags[opcode] & OP_BRANCH)) {
+        continue;
+      }
+      length = instruction_length(code + offset, size - offset);
+      if(offset + length < size) {
+        leaders[(offset + length) >> 5] |= 1u << ((offset + length) & 31);
+      }
+      target = branch_target(code + offset, address + offset, length) - address;
+      if(target < size && (boundaries[target >> 5] & (1u << (target & 31)))) {
+        leaders[target >> 5] |= 1u << (target & 31);
+      }
+    }
+  }
+
+  /* キューが一杯になったら、残りはこれまでどおり実行回数を数えてから依頼する */
+  for(i = 0; i < words && !full; i++) {
+    uint32_t bits = leaders[i] & boundaries[i];
+    while(bits != 0 && !full) {
+      offset = i * 32 + __builtin_ctz(bits);
+      bits  &= bits - 1;
+      full   = !prescan_leader(cache, address + offset);
+    }
+  }
+  free(boundaries);
+  free(leaders);
+}
+
+/* update_eflags_subと同じ規則で、減算結果からEFLAGSを計算する */
+static uint32_t eflags_sub(uint32_t eflags, uint32_t v1, uint32_t v2, uint64_t result) {
+  int sign1 = v1 >> 31;
+  int sign2 = v2 >> 31;
+  int signr = (result >> 31) & 1;
+
+  eflags &= ~(CARRY_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG);
+  if(result >> 32) {
+    eflags |= CARRY_FLAG;
+  }
+  if(result == 0) {
+    eflags |= ZERO_FLAG;
+  }
+  if(signr) {
+    eflags |= SIGN_FLAG;
+  }
+  if(sign1 != sign2 && sign1 != signr) {
+    eflags |= OVERFLOW_FLAG;
+  }
+  return eflags;
+}
+
+/* jccのオペコードの下位4ビットが示す条件を判定する */
+static int condition_holds(uint32_t eflags, uint8_t cond) {
+  int cf = (eflags & CARRY_FLAG) != 0;
+  int zf = (eflags & ZERO_FLAG) != 0;
+  int sf = (eflags & SIGN_FLAG) != 0;
+  int of = (eflags & OVERFLOW_FLAG) != 0;
+  int holds;
+
+  switch(cond >> 1) {
+  case 0: holds = of; break;               /* jo */
+  case 1: holds = cf; break;               /* jc */
+  case 2: holds = zf; break;               /* jz */
+  case 3: holds = cf || zf; break;         /* jbe */
+  case 4: holds = sf; break;               /* js */
+  case 6: holds = sf != of; break;         /* jl */
+  case 7: holds = zf || (sf != of); break; /* jle */
+  default: holds = 0; break;
+  }
+  /* 奇数番は否定形(jno, jnc, jnz, ...) */
+  return (cond & 1) ? !holds : holds;
+}
+
+void execute_block(Emulator* emu, Block* block) {
+  uint32_t r[REGISTERS_COUNT];
+  uint32_t eflags = emu->eflags;
+  uint32_t eip    = block->start;
+  uint64_t vtime  = emu->vtime;
+  Trace* trace    = emu->trace;
+  int stale       = 0;
+  uint32_t i;
+
+  memcpy(r, emu->registers, sizeof(r));
+
+  for(i = 0; i < block->count && !stale; i++) {
+    BlockOp* op = &block->ops[i];
+    uint32_t value;
+
+    /* インタプリタと同じく、実行する直前のレジスタで1命令ずつ記録する */
+    if(trace != NULL) {
+      trace_record(trace, eip, emu->memory[eip], r, eflags);
+    }
+
+    switch(op->kind) {
+    case BLOCK_OP_HELPER:
+      /* 実行関数はEmulator構造体を読み書きするので、前後で同期する */
+      memcpy(emu->registers, r, sizeof(r));
+      emu->eflags = eflags;
+      emu->eip    = eip;
+      /* デバイスが仮想時間を読むので、インタプリタで実行したときと同じ値にしておく */
+      emu->vtime  = vtime + i;
+      op->func(emu);
+      memcpy(r, emu->registers, sizeof(r));
+      eflags = emu->eflags;
+      eip    = emu->eip;
+      /* このブロックの機械語を書き換えたら、残りの命令は古い即値を持っているので抜ける */
+      stale = !block_current(emu, block);
+      continue;
+    case BLOCK_OP_MOV_IMM:
+      r[op->dst] = op->imm;
+      break;
+    case BLOCK_OP_MOV_REG:
+      r[op->dst] = r[op->src];
+      break;
+    case BLOCK_OP_ADD_REG:
+      r[op->dst] += r[op->src];
+      break;
+    case BLOCK_OP_ADD_IMM:
+      r[op->dst] += op->imm;
+      break;
+    case BLOCK_OP_SUB_IMM:
+      value      = r[op->dst];
+      r[op->dst] = value - op->imm;
+      eflags     = eflags_sub(eflags, value, op->imm, (uint64_t)value - (uint64_t)op->imm);
+      break;
+    case BLOCK_OP_CMP_REG:
+      eflags = eflags_sub(eflags, r[op->dst], r[op->src], (uint64_t)r[op->dst] - (uint64_t)r[op->src]);
+      break;
+    case BLOCK_OP_CMP_IMM:
+      eflags = eflags_sub(eflags, r[op->dst], op->imm, (uint64_t)r[op->dst] - (uint64_t)op->imm);
+      break;
+    case BLOCK_OP_CMP_AL_IMM:
+      value  = r[EAX] & 0xff;
+      eflags = eflags_sub(eflags, value, op->imm, (uint64_t)value - (uint64_t)op->imm);
+      break;
+    case BLOCK_OP_INC:
+      r[op->dst] += 1;
+      break;
+    case BLOCK_OP_PUSH_REG:
+      value   = r[op->src];
+      r[ESP] -= 4;
+      set_memory32(emu, r[ESP], value);
+      stale = !block_current(emu, block);
+      break;
+    case BLOCK_OP_PUSH_IMM:
+      r[ESP] -= 4;
+      set_memory32(emu, r[ESP], op->imm);
+      stale = !block_current(emu, block);
+      break;
+    case BLOCK_OP_POP:
+      value      = get_memory32(emu, r[ESP]);
+      r[ESP]    += 4;
+      r[op->dst] = value;
+      break;
+    case BLOCK_OP_LEAVE:
+      r[ESP]  = r[EBP];
+      r[EBP]  = get_memory32(emu, r[ESP]);
+      r[ESP] += 4;
+      break;
+    case BLOCK_OP_JUMP:
+      eip = op->imm;
+      continue;
+    case BLOCK_OP_JCC:
+      eip = condition_holds(eflags, op->src) ? op->imm : eip + op->length;
+      continue;
+    }
+    eip += op->length;
+  }
+
+  memcpy(emu->registers, r, sizeof(r));
+  emu->eflags = eflags;
+  emu->eip    = eip;
+  emu->vtime  = vtime + i;
+}
@@ -0,0 +1,109 @@
+#ifndef BLOCK_H_
+#define BLOCK_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "instruction.h"
+
+/* 1ブロックに含める命令の最大数 */
+#define BLOCK_MAX_INSNS 64
+
+/* 何回実行されたらブロックをコンパイルするか */
+#define BLOCK_HOT_THRESHOLD 50
+
+/* コンパイルを依頼するときに写し取る機械語のバイト数
+ *
+ * 最長の命令(11バイト)をBLOCK_MAX_INSNS個並べ、即値を読むための余裕を足しても収まる
+ */
+#define BLOCK_SNAPSHOT_SIZE 1024
+
+/* 写し取った範囲がまたがる、書き換えを調べる単位(64バイト)の最大数 */
+#define BLOCK_CODE_LINES ((BLOCK_SNAPSHOT_SIZE >> CODE_LINE_SHIFT) + 1)
+
+/* コンパイル済みの命令の種類 */
+enum BlockOpKind {
+  BLOCK_OP_HELPER,     /* funcで指定した命令の実行関数を呼び出す */
+  BLOCK_OP_MOV_IMM,    /* r[dst] = imm */
+  BLOCK_OP_MOV_REG,    /* r[dst] = r[src] */
+  BLOCK_OP_ADD_REG,    /* r[dst] += r[src] */
+  BLOCK_OP_ADD_IMM,    /* r[dst] += imm */
+  BLOCK_OP_SUB_IMM,    /* r[dst] -= imm (フラグ更新あり) */
+  BLOCK_OP_CMP_REG,    /* r[dst] - r[src]でフラグ更新 */
+  BLOCK_OP_CMP_IMM,    /* r[dst] - immでフラグ更新 */
+  BLOCK_OP_CMP_AL_IMM, /* al - immでフラグ更新 */
+  BLOCK_OP_INC,        /* r[dst] += 1 */
+  BLOCK_OP_PUSH_REG,   /* push r[src] */
+  BLOCK_OP_PUSH_IMM,   /* push imm */
+  BLOCK_OP_POP,        /* pop r[dst] */
+  BLOCK_OP_LEAVE,      /* esp = ebp; pop ebp */
+  BLOCK_OP_JUMP,       /* eip = imm */
+  BLOCK_OP_JCC,        /* 条件srcが成り立てばeip = imm */
+};
+
+/* コンパイル済みブロックの1命令分
+ *
+ * オペランドはコンパイル時にデコード済み。
+ * BLOCK_OP_HELPER以外はEmulator構造体を経由せずにレジスタを読み書きする
+ */
+typedef struct {
+  uint8_t kind;
+  /* 命令のバイト数 */
+  uint8_t length;
+  uint8_t dst;
+  uint8_t src;
+  uint32_t imm;
+  instruction_func_t* func;
+} BlockOp;
+
+/* コンパイル済みブロック
+ *
+ * 分岐命令で終わる命令列を、命令ごとの実行関数の配列に変換したもの。
+ * 実行時にはオペコードの取得やinstructions配列の検索を行わずに順に呼び出す
+ */
+typedef struct {
+  /* ブロック先頭の番地 */
+  uint32_t start;
+  /* opsに入っている命令数 */
+  uint32_t count;
+  /* 命令のある範囲の先頭の64バイトの番号と数、コンパイルを依頼したときのそれぞれの書き換えの世代 */
+  uint32_t line;
+  uint32_t line_count;
+  uint32_t versions[BLOCK_CODE_LINES];
+  BlockOp ops[BLOCK_MAX_INSNS];
+} Block;
+
+typedef struct BlockCache BlockCache;
+
+/* ブロックキャッシュを作成し、バックグラウンドのコンパイルスレッドを起動する */
+BlockCache* create_block_cache(Emulator* emu);
+
+/* コンパイルスレッドを止めてブロックキャッシュを破棄する */
+void destroy_block_cache(BlockCache* cache);
+
+/* addressからsizeバイトの機械語をまとめてデコードし、ブロックの先頭になる命令のコンパイルを依頼する
+ *
+ * 読み込んだプログラムに対して実行前に呼び、最初の実行回数を数える間を待たずにブロックを用意する。
+ * 先頭、分岐の次の命令、直接分岐の飛び先をブロックの先頭とし、依頼のキューに入る分だけ依頼する
+ */
+void block_prescan(BlockCache* cache, uint32_t address, uint32_t size);
+
+/* eipから始まるコンパイル済みブロックを探す
+ *
+ * ブロックの先頭(分岐の直後)でメインループから呼び出す。
+ * まだコンパイルされていなければ実行回数を数え、しきい値を超えたら
+ * コンパイルスレッドに依頼してNULLを返す。その間はインタプリタで実行を続ける。
+ * コンパイルを依頼した後に機械語が書き換えられたブロックは捨てて数え直す
+ */
+Block* find_block(BlockCache* cache, uint32_t eip);
+
+/* コンパイル済みブロックを実行する
+ *
+ * 汎用レジスタとEFLAGSはブロックの実行中ローカル変数に置き、
+ * ブロックの出口と実行関数の呼び出しの前にだけEmulator構造体へ書き戻す。
+ * 仮想時間も実行した命令数だけ進める。
+ * メモリに書き込む命令がこのブロックの機械語を書き換えたら、その命令の直後で抜ける
+ */
+void execute_block(Emulator* emu, Block* block);
+
+#endif
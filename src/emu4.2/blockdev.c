@@ -0,0 +1,616 @@
+#include "blockdev.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "emulator_function.h"
+#include "hostio.h"
+#include "interrupt.h"
+#include "io.h"
+#include "sched.h"
+
+#define SECTOR_SIZE 512
+
+/* キャッシュの1ブロックのバイト数と、キャッシュするブロック数(4MB) */
+#define CACHE_BLOCK_SHIFT 12
+#define CACHE_BLOCK_SIZE  (1 << CACHE_BLOCK_SHIFT)
+#define CACHE_BLOCKS      1024
+#define CACHE_HASH_SIZE   2048
+
+/* 1つの記述子が触るブロックの最大数 */
+#define REQUEST_MAX_BLOCKS (BLOCKDEV_MAX_SECTORS * SECTOR_SIZE / CACHE_BLOCK_SIZE + 1)
+
+/* 同時に処理する記述子の数と、ホストで同時に処理する読み書きの数 */
+#define MAX_REQUESTS 64
+#define HOSTIO_ENTRIES 256
+
+/* 処理中の記述子があるとき、完了を調べる間隔(仮想時間) */
+#define BLOCKDEV_POLL_INTERVAL 2000
+
+/* HostIoのtagの最上位ビットで、キャッシュのブロックの読み込みか記述子の読み書きかを区別する */
+#define TAG_REQUEST (1ull << 63)
+
+enum CacheState {
+  CACHE_EMPTY,
+  CACHE_LOADING,
+  CACHE_VALID,
+  CACHE_ERROR,
+};
+
+typedef struct {
+  uint64_t block;
+  uint8_t* data;
+  uint8_t state;
+  /* 読み込み中に書き込まれたので、使い終わったら捨てる */
+  uint8_t stale;
+  /* このブロックを使っている処理中の記述子の数。0でなければ追い出さない */
+  uint32_t refs;
+  /* ハッシュの次の要素とLRUの前後(添字、なければ-1) */
+  int hash_next;
+  int lru_prev;
+  int lru_next;
+} CacheEntry;
+
+typedef struct {
+  int active;
+  uint32_t desc;
+  uint8_t op;
+  uint8_t status;
+  uint32_t count;
+  uint32_t buffer;
+  uint64_t lba;
+  /* 完了を待っているホストの読み書きの数 */
+  uint32_t pending;
+  /* 読み込みで使うキャッシュのブロック */
+  int blocks[REQUEST_MAX_BLOCKS];
+  int block_count;
+  /* キャッシュを通さずに読み書きするときのバッファ */
+  uint8_t* bounce;
+} Request;
+
+struct BlockDev {
+  Emulator* emu;
+  int fd;
+  int read_only;
+  uint64_t sectors;
+
+  uint32_t ring_addr;
+  uint32_t ring_size;
+  /* ゲストが書いた記述子の数と、受け付けた記述子の数(どちらも通し番号) */
+  uint32_t produced;
+  uint32_t consumed;
+  uint32_t completed;
+  uint32_t status;
+  uint32_t control;
+
+  HostIo* io;
+  Request requests[MAX_REQUESTS];
+  uint32_t active_requests;
+  /* 処理中の書き込みの数。0でなければ、キャッシュにない読み込みは書き込みの後に回す */
+  uint32_t writes_inflight;
+
+  CacheEntry entries[CACHE_BLOCKS];
+  uint8_t* cache_data;
+  int hash[CACHE_HASH_SIZE];
+  /* LRUリストの先頭(最も古い)と末尾。refsが0の有効なブロックだけをつなぐ */
+  int lru_head;
+  int lru_tail;
+
+  TimerEvent poll_event;
+  int poll_scheduled;
+};
+
+static uint32_t hash_of(uint64_t block) {
+  return (block * 0x9e3779b97f4a7c15ull) >> (64 - 11);
+}
+
+static void lru_remove(BlockDev* dev, int index) {
+  CacheEntry* entry = &dev->entries[index];
+
+  if(entry->lru_prev >= 0) {
+    dev->entries[entry->lru_prev].lru_next = entry->lru_next;
+  } else if(dev->lru_head == index) {
+    dev->lru_head = entry->lru_next;
+  } else {
+    /* リストにつながっていない */
+    return;
+  }
+  if(entry->lru_next >= 0) {
+    dev->entries[entry->lru_next].lru_prev = entry->lru_prev;
+  } else {
+    dev->lru_tail = entry->lru_prev;
+  }
+  entry->lru_prev = -1;
+  entry->lru_next = -1;
+}
+
+static void lru_append(BlockDev* dev, int index) {
+  CacheEntry* entry = &dev->entries[index];
+
+  entry->lru_prev = dev->lru_tail;
+  entry->lru_next = -1;
+  if(dev->lru_tail >= 0) {
+    dev->entries[dev->lru_tail].lru_next = index;
+  } else {
+    dev->lru_head = index;
+  }
+  dev->lru_tail = index;
+}
+
+static int cache_lookup(BlockDev* dev, uint64_t block) {
+  int index;
+
+  for(index = dev->hash[hash_of(block)]; index >= 0; index = dev->entries[index].hash_next) {
+    /* 書き込みより前の内容を読み込んでいるブロックは使わない */
+    if(dev->entries[index].block == block && dev->entries[index].state != CACHE_EMPTY
+       && !dev->entries[index].stale) {
+      return index;
+    }
+  }
+  return -1;
+}
+
+static void hash_remove(BlockDev* dev, int index) {
+  int* link = &dev->hash[hash_of(dev->entries[index].block)];
+
+  while(*link >= 0) {
+    if(*link == index) {
+      *link = dev->entries[index].hash_next;
+      break;
+    }
+    link = &dev->entries[*link].hash_next;
+  }
+  dev->entries[index].hash_next = -1;
+  dev->entries[index].state     = CACHE_EMPTY;
+}
+
+/* 最も古いブロックを追い出してblockに割り当てる。全て使用中なら-1を返す */
+static int cache_allocate(BlockDev* dev, uint64_t block) {
+  int index = dev->lru_head;
+  CacheEntry* entry;
+  uint32_t h;
+
+  if(index < 0) {
+    return -1;
+  }
+  lru_remove(dev, index);
+  entry = &dev->entries[index];
+  if(entry->state != CACHE_EMPTY) {
+    hash_remove(dev, index);
+  }
+
+  h = hash_of(block);
+  entry->block     = block;
+  entry->stale     = 0;
+  entry->hash_next = dev->hash[h];
+  dev->hash[h]     = index;
+  return index;
+}
+
+/* 使われなくなったブロックをLRUに戻す */
+static void cache_unused(BlockDev* dev, int index) {
+  CacheEntry* entry = &dev->entries[index];
+
+  /* 読み込み中のブロックは、追い出されてバッファを使い回されないよう完了までLRUに入れない */
+  if(entry->state == CACHE_LOADING) {
+    return;
+  }
+  /* 読み込みに失敗したブロックと、読み込み中に書き込まれたブロックは残さない */
+  if(entry->state == CACHE_ERROR || entry->stale) {
+    hash_remove(dev, index);
+  }
+  lru_append(dev, index);
+}
+
+/* 記述子がブロックを使い終わった */
+static void cache_release(BlockDev* dev, int index) {
+  if(--dev->entries[index].refs == 0) {
+    cache_unused(dev, index);
+  }
+}
+
+/* ブロックを処理中の記述子が使う */
+static void cache_pin(BlockDev* dev, int index) {
+  if(dev->entries[index].refs++ == 0) {
+    lru_remove(dev, index);
+  }
+}
+
+/* 記述子のstatusを書いて完了を知らせる */
+static void finish_request(BlockDev* dev, Request* request) {
+  Emulator* emu = dev->emu;
+  int i;
+
+  if(request->op == BLOCKDEV_OP_READ && request->status == BLOCKDEV_OK) {
+    uint8_t* dst = emu->memory + request->buffer;
+    uint32_t length = request->count * SECTOR_SIZE;
+
+    if(request->bounce != NULL) {
+      memcpy(dst, request->bounce, length);
+    } else {
+      /* キャッシュのブロックからゲストのメモリへ直接コピーする */
+      uint64_t offset = request->lba * SECTOR_SIZE;
+      uint32_t done   = 0;
+      for(i = 0; i < request->block_count; i++) {
+        CacheEntry* entry = &dev->entries[request->blocks[i]];
+        uint32_t start    = (offset + done) & (CACHE_BLOCK_SIZE - 1);
+        uint32_t chunk    = CACHE_BLOCK_SIZE - start;
+        if(chunk > length - done) {
+          chunk = length - done;
+        }
+        memcpy(dst + done, entry->data + start, chunk);
+        done += chunk;
+      }
+    }
+    mark_memory_dirty(emu, request->buffer, length);
+    emu->memory_writes++;
+  }
+
+  for(i = 0; i < request->block_count; i++) {
+    cache_release(dev, request->blocks[i]);
+  }
+  free(request->bounce);
+  request->bounce      = NULL;
+  request->block_count = 0;
+  request->active      = 0;
+  dev->active_requests--;
+
+  set_memory8(emu, request->desc + 1, request->status);
+  dev->completed++;
+  dev->status |= BLOCKDEV_STATUS_COMPLETE;
+  if(dev->control & BLOCKDEV_CONTROL_IRQ) {
+    raise_irq(emu, BLOCKDEV_IRQ);
+  }
+}
+
+/* 待っているものがなくなった記述子を完了させる */
+static void finish_ready(BlockDev* dev) {
+  int i, j;
+
+  for(i = 0; i < MAX_REQUESTS && dev->active_requests > 0; i++) {
+    Request* request = &dev->requests[i];
+    int ready;
+
+    if(!request->active || request->pending > 0) {
+      continue;
+    }
+    ready = 1;
+    for(j = 0; j < request->block_count; j++) {
+      CacheEntry* entry = &dev->entries[request->blocks[j]];
+      if(entry->state == CACHE_LOADING) {
+        ready = 0;
+        break;
+      }
+      if(entry->state == CACHE_ERROR) {
+        request->status = BLOCKDEV_IOERR;
+      }
+    }
+    if(ready) {
+      finish_request(dev, request);
+    }
+  }
+}
+
+/* 読み込みの記述子を、キャッシュのブロックを使って処理する */
+/* 全てキャッシュに当たれば、ホストの読み書きなしに完了する */
+static void start_read(BlockDev* dev, Request* request) {
+  uint64_t first = (request->lba * SECTOR_SIZE) >> CACHE_BLOCK_SHIFT;
+  uint64_t last  = ((request->lba + request->count) * SECTOR_SIZE - 1) >> CACHE_BLOCK_SHIFT;
+  uint64_t block;
+
+  for(block = first; block <= last; block++) {
+    int index = cache_lookup(dev, block);
+
+    if(index < 0) {
+      index = cache_allocate(dev, block);
+      if(index < 0) {
+        break;
+      }
+      dev->entries[index].state = CACHE_LOADING;
+      hostio_queue(dev->io, HOSTIO_READ, dev->fd, dev->entries[index].data, CACHE_BLOCK_SIZE,
+                   block << CACHE_BLOCK_SHIFT, dev->writes_inflight > 0, index);
+    }
+    cache_pin(dev, index);
+    request->blocks[request->block_count++] = index;
+  }
+  if(block > last) {
+    return;
+  }
+
+  /* キャッシュが全て使用中なら、キャッシュを通さずに読む */
+  while(request->block_count > 0) {
+    cache_release(dev, request->blocks[--request->block_count]);
+  }
+  request->bounce = malloc(request->count * SECTOR_SIZE);
+  request->pending++;
+  hostio_queue(dev->io, HOSTIO_READ, dev->fd, request->bounce, request->count * SECTOR_SIZE,
+               request->lba * SECTOR_SIZE, dev->writes_inflight > 0, TAG_REQUEST | (request - dev->requests));
+}
+
+/* 書き込みの記述子を処理する(ライトスルー) */
+static void start_write(BlockDev* dev, Request* request) {
+  uint64_t offset = request->lba * SECTOR_SIZE;
+  uint32_t length = request->count * SECTOR_SIZE;
+  uint64_t block;
+
+  /* 完了までにゲストがバッファを書き換えてもよいよう、受け付けた時点の内容をコピーしておく */
+  request->bounce = malloc(length);
+  memcpy(request->bounce, dev->emu->memory + request->buffer, length);
+
+  /* キャッシュにあるブロックは書き込む内容に合わせる */
+  for(block = offset >> CACHE_BLOCK_SHIFT; block <= (offset + length - 1) >> CACHE_BLOCK_SHIFT; block++) {
+    int index = cache_lookup(dev, block);
+    uint64_t start, end;
+
+    if(index < 0) {
+      continue;
+    }
+    if(dev->entries[index].state != CACHE_VALID) {
+      /* 読み込み中のブロックは、読み終わっても古い内容なので捨てる */
+      /* (使われていなくても、読み込みが完了したときに捨ててLRUに戻す) */
+      dev->entries[index].stale = 1;
+      continue;
+    }
+    start = offset > (block << CACHE_BLOCK_SHIFT) ? offset : block << CACHE_BLOCK_SHIFT;
+    end   = offset + length < ((block + 1) << CACHE_BLOCK_SHIFT) ? offset + length : (block + 1) << CACHE_BLOCK_SHIFT;
+    memcpy(dev->entries[index].data + (start & (CACHE_BLOCK_SIZE - 1)), request->bounce + (start - offset), end - start);
+  }
+
+  request->pending++;
+  dev->writes_inflight++;
+  hostio_queue(dev->io, HOSTIO_WRITE, dev->fd, request->bounce, length, offset,
+               hostio_inflight(dev->io) > 0, TAG_REQUEST | (request - dev->requests));
+}
+
+static void schedule_poll(BlockDev* dev);
+
+/* ゲストが書いた記述子を受け付ける */
+static void consume_descriptors(BlockDev* dev) {
+  Emulator* emu = dev->emu;
+
+  while(dev->consumed != dev->produced) {
+    uint32_t desc = dev->ring_addr + (dev->consumed & (dev->ring_size - 1)) * BLOCKDEV_DESC_SIZE;
+    Request* request = NULL;
+    int i;
+
+    /* 処理中の記述子やホストの読み書きが一杯なら、完了してから受け付ける */
+    if(dev->active_requests == MAX_REQUESTS
+       || HOSTIO_ENTRIES - hostio_inflight(dev->io) < REQUEST_MAX_BLOCKS + 1) {
+      break;
+    }
+    for(i = 0; i < MAX_REQUESTS; i++) {
+      if(!dev->requests[i].active) {
+        request = &dev->requests[i];
+        break;
+      }
+    }
+
+    request->active  = 1;
+    request->desc    = desc;
+    request->op      = get_memory8(emu, desc);
+    request->count   = get_memory8(emu, desc + 2) | (get_memory8(emu, desc + 3) << 8);
+    request->buffer  = get_memory32(emu, desc + 4);
+    request->lba     = get_memory32(emu, desc + 8) | ((uint64_t)get_memory32(emu, desc + 12) << 32);
+    request->status  = BLOCKDEV_OK;
+    request->pending = 0;
+    dev->active_requests++;
+    dev->consumed++;
+
+    if(request->op == BLOCKDEV_OP_FLUSH) {
+      request->pending++;
+      hostio_queue(dev->io, HOSTIO_FSYNC, dev->fd, NULL, 0, 0, 1, TAG_REQUEST | i);
+      continue;
+    }
+    if((request->op != BLOCKDEV_OP_READ && request->op != BLOCKDEV_OP_WRITE)
+       || request->count == 0 || request->count > BLOCKDEV_MAX_SECTORS
+       || request->lba > dev->sectors || request->count > dev->sectors - request->lba
+       || request->buffer > emu->memory_size
+       || request->count * SECTOR_SIZE > emu->memory_size - request->buffer) {
+      request->status = BLOCKDEV_BADREQ;
+    } else if(request->op == BLOCKDEV_OP_WRITE && dev->read_only) {
+      request->status = BLOCKDEV_IOERR;
+    } else if(request->op == BLOCKDEV_OP_READ) {
+      start_read(dev, request);
+    } else {
+      start_write(dev, request);
+    }
+  }
+
+  hostio_submit(dev->io);
+  finish_ready(dev);
+  schedule_poll(dev);
+}
+
+/* 終わったホストの読み書きを回収して、完了した記述子を知らせる */
+static void poll_completions(BlockDev* dev, int wait) {
+  HostIoCompletion completions[32];
+  int count, i;
+
+  while((count = hostio_reap(dev->io, completions, 32, wait)) > 0) {
+    wait = 0;
+    for(i = 0; i < count; i++) {
+      uint64_t tag   = completions[i].tag;
+      int32_t result = completions[i].result;
+
+      if(tag & TAG_REQUEST) {
+        Request* request = &dev->requests[tag & ~TAG_REQUEST];
+        uint32_t length  = request->count * SECTOR_SIZE;
+        request->pending--;
+        if(request->op == BLOCKDEV_OP_WRITE) {
+          dev->writes_inflight--;
+        }
+        if(result < 0 || (request->op != BLOCKDEV_OP_FLUSH && (uint32_t)result != length)) {
+          request->status = BLOCKDEV_IOERR;
+        }
+      } else {
+        CacheEntry* entry = &dev->entries[tag];
+        if(result < 0) {
+          entry->state = CACHE_ERROR;
+        } else {
+          /* イメージの末尾のブロックは短く読めるので、残りを0にする */
+          memset(entry->data + result, 0, CACHE_BLOCK_SIZE - result);
+          entry->state = CACHE_VALID;
+        }
+        /* 読み込み中に記述子がすべて使い終わっていたブロックは、ここでLRUに戻す */
+        if(entry->refs == 0) {
+          cache_unused(dev, tag);
+        }
+      }
+    }
+  }
+  finish_ready(dev);
+  /* 空きができたので、待たせていた記述子を受け付ける */
+  if(dev->consumed != dev->produced) {
+    consume_descriptors(dev);
+  }
+}
+
+static void blockdev_poll(void* context) {
+  BlockDev* dev = context;
+
+  dev->poll_scheduled = 0;
+  /* hltで止まっているゲストは完了の割り込みを待っているだけなので、ここでは待ってよい */
+  /* ほかのイベントが予定されていれば、先にその割り込みを届けるため待たない */
+  poll_completions(dev, dev->emu->halted && sched_next_time(dev->emu->sched) == SCHED_NEVER);
+  schedule_poll(dev);
+}
+
+/* 処理中の記述子があれば、しばらく後に完了を調べる */
+static void schedule_poll(BlockDev* dev) {
+  if(dev->active_requests > 0 && !dev->poll_scheduled) {
+    dev->poll_scheduled = 1;
+    sched_add(dev->emu->sched, &dev->poll_event, dev->emu->vtime + BLOCKDEV_POLL_INTERVAL, blockdev_poll, dev);
+  }
+}
+
+static uint32_t blockdev_read(void* context, uint16_t address) {
+  BlockDev* dev = context;
+
+  switch(address) {
+  case BLOCKDEV_RING_ADDR:
+    return dev->ring_addr;
+  case BLOCKDEV_RING_SIZE:
+    return dev->ring_size;
+  case BLOCKDEV_DOORBELL:
+    return dev->consumed;
+  case BLOCKDEV_STATUS:
+    poll_completions(dev, 0);
+    return dev->status;
+  case BLOCKDEV_CONTROL:
+    return dev->control;
+  case BLOCKDEV_COMPLETED:
+    poll_completions(dev, 0);
+    return dev->completed;
+  case BLOCKDEV_CAPACITY:
+    return dev->sectors > 0xffffffff ? 0xffffffff : dev->sectors;
+  default:
+    return 0;
+  }
+}
+
+static void blockdev_write(void* context, uint16_t address, uint32_t value) {
+  BlockDev* dev = context;
+
+  switch(address) {
+  case BLOCKDEV_RING_ADDR:
+    dev->ring_addr = value;
+    break;
+  case BLOCKDEV_RING_SIZE:
+    /* 2のべき乗に切り下げる */
+    dev->ring_size = value == 0 ? 0 : 1u << (31 - __builtin_clz(value));
+    break;
+  case BLOCKDEV_DOORBELL:
+    if(dev->ring_size == 0) {
+      break;
+    }
+    dev->produced = value;
+    consume_descriptors(dev);
+    break;
+  case BLOCKDEV_STATUS:
+    dev->status &= ~value;
+    break;
+  case BLOCKDEV_CONTROL:
+    dev->control = value;
+    break;
+  }
+}
+
+/* ゲストが完了をポーリングしているときは、ホストの読み書きが終わるまで眠る */
+static void blockdev_wait(void* context, uint16_t address) {
+  BlockDev* dev = context;
+
+  if((address == BLOCKDEV_STATUS || address == BLOCKDEV_COMPLETED) && dev->active_requests > 0) {
+    poll_completions(dev, 1);
+  }
+}
+
+BlockDev* create_blockdev(Emulator* emu, const char* filename) {
+  struct stat st;
+  BlockDev* dev;
+  int read_only = 0;
+  int fd = open(filename, O_RDWR | O_CLOEXEC);
+  int i;
+  IoDevice device = {
+    .read32  = blockdev_read,
+    .write32 = blockdev_write,
+    .wait    = blockdev_wait,
+  };
+
+  if(fd < 0) {
+    fd        = open(filename, O_RDONLY | O_CLOEXEC);
+    read_only = 1;
+  }
+  if(fd < 0) {
+    return NULL;
+  }
+  if(fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  dev = calloc(1, sizeof(BlockDev));
+  dev->emu       = emu;
+  dev->fd        = fd;
+  dev->read_only = read_only;
+  dev->sectors   = st.st_size / SECTOR_SIZE;
+  dev->io        = create_hostio(HOSTIO_ENTRIES);
+
+  /* キャッシュは全て空いている状態でLRUにつないでおく */
+  dev->cache_data = aligned_alloc(CACHE_BLOCK_SIZE, (size_t)CACHE_BLOCKS * CACHE_BLOCK_SIZE);
+  dev->lru_head = -1;
+  dev->lru_tail = -1;
+  for(i = 0; i < CACHE_HASH_SIZE; i++) {
+    dev->hash[i] = -1;
+  }
+  for(i = 0; i < CACHE_BLOCKS; i++) {
+    dev->entries[i].data      = dev->cache_data + (size_t)i * CACHE_BLOCK_SIZE;
+    dev->entries[i].state     = CACHE_EMPTY;
+    dev->entries[i].hash_next = -1;
+    dev->entries[i].lru_prev  = -1;
+    dev->entries[i].lru_next  = -1;
+    lru_append(dev, i);
+  }
+
+  device.context = dev;
+  io_register(emu, BLOCKDEV_PORT, 28, &device);
+  return dev;
+}
+
+void destroy_blockdev(BlockDev* dev) {
+  int i;
+
+  /* 読み書き中のバッファを解放しないよう、ホストの読み書きが全て終わるのを待つ */
+  destroy_hostio(dev->io);
+  if(dev->poll_scheduled) {
+    sched_cancel(dev->emu->sched, &dev->poll_event);
+  }
+  for(i = 0; i < MAX_REQUESTS; i++) {
+    free(dev->requests[i].bounce);
+  }
+  free(dev->cache_data);
+  close(dev->fd);
+  free(dev);
+}
@@ -0,0 +1,72 @@
+#ifndef BLOCKDEV_H_
+#define BLOCKDEV_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* 非同期のブロックデバイス
+ *
+ * ゲストはメモリ上に記述子のリングを置き、記述子を書いたらドアベルのポートに
+ * 書き込んだ記述子の数(通し番号)を書く。ホストはio_uring(使えなければ読み書き用のスレッド)で
+ * 読み書きを行い、終わった記述子のstatusを書き換えて完了を知らせる。
+ * ホスト側には4KB単位のLRUのブロックキャッシュがあり、キャッシュに当たった読み込みは
+ * ドアベルの書き込みの中でそのまま完了する。エミュレータのスレッドはディスクを待たない。
+ * 完了する仮想時刻はホストのI/Oの速さで変わるので、-R/-Pの記録や再生とは併用できない
+ */
+
+/* I/Oポート(どれも32bitで読み書きする) */
+#define BLOCKDEV_PORT      0x0600
+#define BLOCKDEV_RING_ADDR (BLOCKDEV_PORT + 0)  /* 記述子のリングの番地 */
+#define BLOCKDEV_RING_SIZE (BLOCKDEV_PORT + 4)  /* リングの記述子の数(2のべき乗) */
+#define BLOCKDEV_DOORBELL  (BLOCKDEV_PORT + 8)  /* 書き込んだ記述子の通し番号。読むと受け付けた数 */
+#define BLOCKDEV_STATUS    (BLOCKDEV_PORT + 12) /* 読むと状態ビット。1を書いたビットをクリアする */
+#define BLOCKDEV_CONTROL   (BLOCKDEV_PORT + 16) /* 制御ビット */
+#define BLOCKDEV_COMPLETED (BLOCKDEV_PORT + 20) /* 完了した記述子の数(通し番号) */
+#define BLOCKDEV_CAPACITY  (BLOCKDEV_PORT + 24) /* セクタ数 */
+
+/* BLOCKDEV_STATUSのビット */
+#define BLOCKDEV_STATUS_COMPLETE 1 /* 前回クリアしてから完了した記述子がある */
+
+/* BLOCKDEV_CONTROLのビット */
+#define BLOCKDEV_CONTROL_IRQ 1 /* 完了したらBLOCKDEV_IRQの割り込みを出す */
+
+/* 完了を知らせる割り込み要求 */
+#define BLOCKDEV_IRQ 5
+
+/* 記述子(16バイト)
+ *
+ * +0  op      BLOCKDEV_OP_*
+ * +1  status  ゲストがBLOCKDEV_PENDINGにしておき、完了するとホストが結果を書く
+ * +2  count   セクタ数(16bit、BLOCKDEV_MAX_SECTORSまで)
+ * +4  buffer  ゲストのメモリの番地(32bit)
+ * +8  lba     先頭のセクタ番号(64bit)
+ */
+#define BLOCKDEV_DESC_SIZE 16
+
+enum {
+  BLOCKDEV_OP_READ  = 0,
+  BLOCKDEV_OP_WRITE = 1,
+  BLOCKDEV_OP_FLUSH = 2,
+};
+
+enum {
+  BLOCKDEV_OK      = 0x00,
+  BLOCKDEV_IOERR   = 0x01,
+  BLOCKDEV_BADREQ  = 0x02,
+  BLOCKDEV_PENDING = 0xff,
+};
+
+/* 1つの記述子で読み書きできる最大のセクタ数(128KB) */
+#define BLOCKDEV_MAX_SECTORS 256
+
+typedef struct BlockDev BlockDev;
+
+/* filenameのイメージをブロックデバイスとして開き、BLOCKDEV_PORTから登録する */
+/* 開けなければNULLを返す */
+BlockDev* create_blockdev(Emulator* emu, const char* filename);
+
+/* 処理中の読み書きが終わるのを待って破棄する */
+void destroy_blockdev(BlockDev* dev);
+
+#endif
@@ -0,0 +1,204 @@
+#include "callstack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* 呼び出し文脈の木の節 */
+typedef struct {
+  /* 呼び出された関数の番地 */
+  uint32_t address;
+  /* 呼び出し元の節(根は-1) */
+  int32_t parent;
+  /* この文脈の関数自身が実行した命令数 */
+  uint64_t self;
+} CallNode;
+
+/* シャドウスタックの1段 */
+typedef struct {
+  /* 呼び出し元の節 */
+  int32_t node;
+  uint32_t return_address;
+} CallFrame;
+
+struct CallStack {
+  CallNode* nodes;
+  int32_t node_count;
+  int32_t node_capacity;
+
+  /* (呼び出し元の節, 呼び出された番地)から子の節を引くハッシュ表(空きは-1) */
+  int32_t* children;
+  uint32_t children_size;
+
+  CallFrame frames[CALLSTACK_MAX_DEPTH];
+  int depth;
+  /* CALLSTACK_MAX_DEPTHを超えて積めなかった呼び出しの数 */
+  uint32_t overflow;
+
+  /* 今実行している文脈の節と、そこへ命令数を足した最後の仮想時間 */
+  int32_t current;
+  uint64_t last_vtime;
+};
+
+static uint32_t hash_of(int32_t parent, uint32_t address) {
+  return (((uint64_t)(uint32_t)parent << 32 | address) * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+static int32_t add_node(CallStack* stack, int32_t parent, uint32_t address) {
+  CallNode* node;
+
+  if(stack->node_count == stack->node_capacity) {
+    stack->node_capacity *= 2;
+    stack->nodes = realloc(stack->nodes, sizeof(CallNode) * stack->node_capacity);
+  }
+  node = &stack->nodes[stack->node_count];
+  node->address = address;
+  node->parent  = parent;
+  node->self    = 0;
+  return stack->node_count++;
+}
+
+/* ハッシュ表を倍の大きさにして入れ直す */
+static void grow_children(CallStack* stack) {
+  uint32_t size = stack->children_size * 2;
+  int32_t* children = malloc(sizeof(int32_t) * size);
+  int32_t i;
+
+  memset(children, 0xff, sizeof(int32_t) * size);
+  for(i = 0; i < stack->node_count; i++) {
+    uint32_t slot;
+    if(stack->nodes[i].parent < 0) {
+      continue;
+    }
+    slot = hash_of(stack->nodes[i].parent, stack->nodes[i].address) & (size - 1);
+    while(children[slot] >= 0) {
+      slot = (slot + 1) & (size - 1);
+    }
+    children[slot] = i;
+  }
+  free(stack->children);
+  stack->children      = children;
+  stack->children_size = size;
+}
+
+/* parentからaddressを呼び出した文脈の節を返す。初めてなら作る */
+static int32_t child_of(CallStack* stack, int32_t parent, uint32_t address) {
+  uint32_t slot = hash_of(parent, address) & (stack->children_size - 1);
+  int32_t index;
+
+  while((index = stack->children[slot]) >= 0) {
+    if(stack->nodes[index].parent == parent && stack->nodes[index].address == address) {
+      return index;
+    }
+    slot = (slot + 1) & (stack->children_size - 1);
+  }
+
+  index = add_node(stack, parent, address);
+  stack->children[slot] = index;
+  /* 半分を超えて埋まったら広げる */
+  if((uint32_t)stack->node_count * 2 > stack->children_size) {
+    grow_children(stack);
+  }
+  return index;
+}
+
+/* 前回からvtimeまでに実行した命令を、今の文脈に足す */
+static void charge(CallStack* stack, uint64_t vtime) {
+  stack->nodes[stack->current].self += vtime - stack->last_vtime;
+  stack->last_vtime = vtime;
+}
+
+CallStack* create_callstack(uint32_t entry, uint64_t vtime) {
+  CallStack* stack = calloc(1, sizeof(CallStack));
+
+  stack->node_capacity = 256;
+  stack->nodes         = malloc(sizeof(CallNode) * stack->node_capacity);
+  stack->children_size = 512;
+  stack->children      = malloc(sizeof(int32_t) * stack->children_size);
+  memset(stack->children, 0xff, sizeof(int32_t) * stack->children_size);
+
+  stack->current    = add_node(stack, -1, entry);
+  stack->last_vtime = vtime;
+  return stack;
+}
+
+void destroy_callstack(CallStack* stack) {
+  free(stack->nodes);
+  free(stack->children);
+  free(stack);
+}
+
+void callstack_call(CallStack* stack, uint64_t vtime, uint32_t target, uint32_t return_address) {
+  charge(stack, vtime);
+  if(stack->depth == CALLSTACK_MAX_DEPTH) {
+    stack->overflow++;
+    return;
+  }
+  stack->frames[stack->depth].node           = stack->current;
+  stack->frames[stack->depth].return_address = return_address;
+  stack->depth++;
+  stack->current = child_of(stack, stack->current, target);
+}
+
+void callstack_return(CallStack* stack, uint64_t vtime, uint32_t target) {
+  int i;
+
+  charge(stack, vtime);
+  if(stack->overflow > 0) {
+    stack->overflow--;
+    return;
+  }
+  /* 普通は一番上の段に戻るが、longjmpのように何段か飛ばして戻ることもある */
+  for(i = stack->depth - 1; i >= 0; i--) {
+    if(stack->frames[i].return_address == target) {
+      stack->current = stack->frames[i].node;
+      stack->depth   = i;
+      return;
+    }
+  }
+}
+
+/* 関数の表示名 */
+static void write_name(FILE* file, const Symbols* symbols, uint32_t address) {
+  const Symbol* symbol = symbols != NULL ? symbol_lookup(symbols, address) : NULL;
+
+  if(symbol == NULL) {
+    fprintf(file, "0x%x", address);
+  } else if(symbol->address == address) {
+    fputs(symbol->name, file);
+  } else {
+    fprintf(file, "%s+0x%x", symbol->name, address - symbol->address);
+  }
+}
+
+int callstack_write_folded(CallStack* stack, uint64_t vtime, const Symbols* symbols, const char* filename) {
+  FILE* file = fopen(filename, "w");
+  int32_t* path;
+  int32_t i;
+
+  if(file == NULL) {
+    return -1;
+  }
+  charge(stack, vtime);
+
+  path = malloc(sizeof(int32_t) * stack->node_count);
+  for(i = 0; i < stack->node_count; i++) {
+    int32_t node;
+    int length = 0;
+
+    if(stack->nodes[i].self == 0) {
+      continue;
+    }
+    /* 根から順に書くため、親をたどって逆順に集める */
+    for(node = i; node >= 0; node = stack->nodes[node].parent) {
+      path[length++] = node;
+    }
+    while(length > 0) {
+      write_name(file, symbols, stack->nodes[path[--length]].address);
+      fputc(length > 0 ? ';' : ' ', file);
+    }
+    fprintf(file, "%llu\n", (unsigned long long)stack->nodes[i].self);
+  }
+  free(path);
+  return fclose(file) == 0 ? 0 : -1;
+}
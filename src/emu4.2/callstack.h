@@ -0,0 +1,39 @@
+#ifndef CALLSTACK_H_
+#define CALLSTACK_H_
+
+#include <stdint.h>
+
+#include "symbols.h"
+
+/* 呼び出しのスタックの最大の深さ。これより深い呼び出しは最も深い関数の中にあるとみなす */
+#define CALLSTACK_MAX_DEPTH 1024
+
+/* ゲストの呼び出し文脈ごとの実行命令数
+ *
+ * call命令と割り込みで積み、ret命令とiret命令で降ろすシャドウスタックを持ち、
+ * 呼び出し文脈の木(どの関数からどの関数を経て呼ばれたか)の節ごとに、
+ * その関数自身が実行した命令数を仮想時間の差で正確に数える。
+ * サンプリングではないので、短い関数も漏れなく現れる
+ */
+typedef struct CallStack CallStack;
+
+/* entryの番地から仮想時間vtimeに実行を始めるゲストの呼び出しを数える */
+CallStack* create_callstack(uint32_t entry, uint64_t vtime);
+
+void destroy_callstack(CallStack* stack);
+
+/* 仮想時間vtimeにtargetを呼び出した。戻り先はreturn_address */
+void callstack_call(CallStack* stack, uint64_t vtime, uint32_t target, uint32_t return_address);
+
+/* 仮想時間vtimeにtargetへ戻った */
+/* スタックに積んだ戻り先のどれとも一致しなければ、ただのジャンプとみなす */
+void callstack_return(CallStack* stack, uint64_t vtime, uint32_t target);
+
+/* 仮想時間vtimeまでの命令数を、flamegraphのツールが読むfolded形式
+ * (「呼び出し元;...;関数 命令数」の行)でfilenameに書く
+ *
+ * symbolsがNULLなら関数を番地で表す。書けなければ-1を返す
+ */
+int callstack_write_folded(CallStack* stack, uint64_t vtime, const Symbols* symbols, const char* filename);
+
+#endif
@@ -0,0 +1,109 @@
+#include "decode.h"
+
+/* 命令の長さを求めるためのテーブル
+ * 
+ * 命令を実行する前にまとめて命令の境界を求められるよう、
+ * instructions配列に登録されている命令の形式を表にしておく。
+ * 命令を追加したときはここにも追加すること
+ */
+const uint8_t opcode_flags[256] = {
+  [0x01]          = OP_VALID | OP_MODRM,              /* add rm32, r32 */
+  [0x3B]          = OP_VALID | OP_MODRM,              /* cmp r32, rm32 */
+  [0x3C]          = OP_VALID | OP_IMM8,               /* cmp al, imm8 */
+  [0x3D]          = OP_VALID | OP_IMM32,              /* cmp eax, imm32 */
+  [0x40 ... 0x47] = OP_VALID,                         /* inc r32 */
+  [0x50 ... 0x57] = OP_VALID,                         /* push r32 */
+  [0x58 ... 0x5F] = OP_VALID,                         /* pop r32 */
+  [0x68]          = OP_VALID | OP_IMM32,              /* push imm32 */
+  [0x6A]          = OP_VALID | OP_IMM8,               /* push imm8 */
+  [0x70 ... 0x75] = OP_VALID | OP_IMM8 | OP_BRANCH,   /* jo, jno, jc, jnc, jz, jnz */
+  [0x78 ... 0x79] = OP_VALID | OP_IMM8 | OP_BRANCH,   /* js, jns */
+  [0x7C]          = OP_VALID | OP_IMM8 | OP_BRANCH,   /* jl */
+  [0x7E]          = OP_VALID | OP_IMM8 | OP_BRANCH,   /* jle */
+  [0x83]          = OP_VALID | OP_MODRM | OP_IMM8,    /* add/sub/cmp rm32, imm8 */
+  [0x88 ... 0x8B] = OP_VALID | OP_MODRM,              /* mov */
+  [0xB0 ... 0xB7] = OP_VALID | OP_IMM8,               /* mov r8, imm8 */
+  [0xB8 ... 0xBF] = OP_VALID | OP_IMM32,              /* mov r32, imm32 */
+  [0xC3]          = OP_VALID | OP_BRANCH,             /* ret */
+  [0xC7]          = OP_VALID | OP_MODRM | OP_IMM32,   /* mov rm32, imm32 */
+  [0xC9]          = OP_VALID,                         /* leave */
+  [0xCF]          = OP_VALID | OP_BRANCH,             /* iret */
+  [0xCD]          = OP_VALID | OP_IMM8 | OP_BRANCH,   /* int imm8 */
+  [0xE8]          = OP_VALID | OP_IMM32 | OP_BRANCH,  /* call rel32 */
+  [0xE9]          = OP_VALID | OP_IMM32 | OP_BRANCH,  /* jmp rel32 */
+  [0xEB]          = OP_VALID | OP_IMM8 | OP_BRANCH,   /* jmp rel8 */
+  [0xEC]          = OP_VALID,                         /* in al, dx */
+  [0xED]          = OP_VALID,                         /* in eax, dx */
+  [0xEE]          = OP_VALID,                         /* out dx, al */
+  [0xEF]          = OP_VALID,                         /* out dx, eax */
+  [0xF4]          = OP_VALID | OP_BRANCH,             /* hlt */
+  [0xFA]          = OP_VALID,                         /* cli */
+  [0xFB]          = OP_VALID | OP_BRANCH,             /* sti(直後に割り込みを受け付ける) */
+  [0xFF]          = OP_VALID | OP_MODRM,              /* inc rm32 */
+};
+
+/* modごとのrm 0〜7に対応する8要素 */
+#define MODRM_MOD0 0, 0, 0, 0, MODRM_SIB, MODRM_DISP32, 0, 0
+#define MODRM_MOD1 MODRM_DISP8, MODRM_DISP8, MODRM_DISP8, MODRM_DISP8, \
+                   MODRM_SIB | MODRM_DISP8, MODRM_DISP8, MODRM_DISP8, MODRM_DISP8
+#define MODRM_MOD2 MODRM_DISP32, MODRM_DISP32, MODRM_DISP32, MODRM_DISP32, \
+                   MODRM_SIB | MODRM_DISP32, MODRM_DISP32, MODRM_DISP32, MODRM_DISP32
+#define MODRM_MOD3 0, 0, 0, 0, 0, 0, 0, 0
+/* REG(3〜5ビット目)は後続バイトに影響しないので同じ並びを8回繰り返す */
+#define MODRM_REPEAT8(x) x, x, x, x, x, x, x, x
+
+const uint8_t modrm_flags[256] = {
+  MODRM_REPEAT8(MODRM_MOD0),
+  MODRM_REPEAT8(MODRM_MOD1),
+  MODRM_REPEAT8(MODRM_MOD2),
+  MODRM_REPEAT8(MODRM_MOD3),
+};
+
+#undef MODRM_MOD0
+#undef MODRM_MOD1
+#undef MODRM_MOD2
+#undef MODRM_MOD3
+#undef MODRM_REPEAT8
+
+/* フラグから後続バイト数を引くための表 */
+/* opcode_flagsのOP_IMM8とOP_IMM32の2ビットで引く */
+static const uint8_t imm_length[4]   = {0, 1, 4, 5};
+/* modrm_flagsの3ビットで引く(ModR/Mバイト自身の1バイトを含む) */
+static const uint8_t modrm_length[8] = {1, 2, 2, 3, 5, 6, 5, 6};
+
+int instruction_length(const uint8_t* code, size_t size) {
+  uint8_t flags = opcode_flags[code[0]];
+  int length;
+
+  if(!(flags & OP_VALID)) {
+    return 0;
+  }
+
+  length = 1 + imm_length[(flags >> 2) & 3];
+  if(flags & OP_MODRM) {
+    if(size < 2) {
+      return 0;
+    }
+    length += modrm_length[modrm_flags[code[1]]];
+  }
+
+  return (size_t)length <= size ? length : 0;
+}
+
+size_t decode_boundaries(const uint8_t* code, size_t size, uint32_t* boundaries) {
+  size_t offset = 0;
+  size_t count  = 0;
+
+  while(offset < size) {
+    int length = instruction_length(code + offset, size - offset);
+    if(length == 0) {
+      /* 命令として解釈できないバイトは読み飛ばす */
+      offset += 1;
+      continue;
+    }
+    boundaries[offset >> 5] |= 1u << (offset & 31);
+    offset += length;
+    count++;
+  }
+  return count;
+}
@@ -0,0 +1,41 @@
+#ifndef DECODE_H_
+#define DECODE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* opcode_flagsの各ビット */
+#define OP_VALID  (1)      /* 実装済みの命令 */
+#define OP_MODRM  (1 << 1) /* ModR/Mバイトを持つ */
+#define OP_IMM8   (1 << 2) /* 8bitの即値(またはrel8)を持つ */
+#define OP_IMM32  (1 << 3) /* 32bitの即値(またはrel32)を持つ */
+#define OP_BRANCH (1 << 4) /* 実行後のeipが次の命令とは限らない(基本ブロックの終端) */
+
+/* modrm_flagsの各ビット */
+#define MODRM_SIB    (1)      /* SIBバイトが続く */
+#define MODRM_DISP8  (1 << 1) /* 8bitのディスプレースメントが続く */
+#define MODRM_DISP32 (1 << 2) /* 32bitのディスプレースメントが続く */
+
+/* オペコードごとの命令の形式 */
+extern const uint8_t opcode_flags[256];
+
+/* ModR/Mバイトごとの後続バイトの形式(parse_modrmと共用) */
+extern const uint8_t modrm_flags[256];
+
+/* codeから始まる命令の長さを返す
+ *
+ * 未実装の命令や、sizeバイトに収まらない命令のときは0を返す
+ */
+int instruction_length(const uint8_t* code, size_t size);
+
+/* 機械語の領域を先頭から順にデコードし、命令の境界を求める
+ *
+ * 命令の先頭になるオフセットのビットをboundariesに立てる。
+ * boundariesは(size + 31) / 32個以上のuint32_tで、0クリアされている必要がある。
+ * 未実装の命令(文字列などのデータを含む)に出会ったときは1バイト進めて同期し直す。
+ *
+ * 戻り値は見つかった命令の数
+ */
+size_t decode_boundaries(const uint8_t* code, size_t size, uint32_t* boundaries);
+
+#endif
@@ -0,0 +1,62 @@
+#include "disk.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* 1.44MBフロッピーのバイト数 */
+#define FLOPPY_SIZE (1440 * 1024)
+
+Disk* open_disk(const char* filename) {
+  struct stat st;
+  Disk* disk;
+  int read_only = 0;
+  void* data;
+  int fd = open(filename, O_RDWR | O_CLOEXEC);
+
+  if(fd < 0) {
+    fd        = open(filename, O_RDONLY | O_CLOEXEC);
+    read_only = 1;
+  }
+  if(fd < 0) {
+    return NULL;
+  }
+  if(fstat(fd, &st) < 0 || st.st_size < DISK_SECTOR_SIZE) {
+    close(fd);
+    return NULL;
+  }
+
+  data = mmap(NULL, st.st_size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  /* mmapした後はファイルディスクリプタがなくても対応付けは残る */
+  close(fd);
+  if(data == MAP_FAILED) {
+    return NULL;
+  }
+
+  disk = calloc(1, sizeof(Disk));
+  disk->data      = data;
+  disk->size      = st.st_size;
+  disk->sectors   = st.st_size / DISK_SECTOR_SIZE;
+  disk->read_only = read_only;
+
+  if(st.st_size <= FLOPPY_SIZE) {
+    disk->drive             = 0x00;
+    disk->heads             = 2;
+    disk->sectors_per_track = 18;
+  } else {
+    disk->drive             = 0x80;
+    disk->heads             = 16;
+    disk->sectors_per_track = 63;
+  }
+  disk->cylinders = (disk->sectors + disk->heads * disk->sectors_per_track - 1)
+                    / (disk->heads * disk->sectors_per_track);
+  return disk;
+}
+
+void close_disk(Disk* disk) {
+  /* MAP_SHAREDなので、書き込んだ内容はmunmapの後もページキャッシュ経由でファイルに残る */
+  munmap(disk->data, disk->size);
+  free(disk);
+}
@@ -0,0 +1,40 @@
+#ifndef DISK_H_
+#define DISK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* セクタのバイト数 */
+#define DISK_SECTOR_SIZE 512
+
+/* ホストのディスクイメージ
+ *
+ * ファイル全体をmmapしておき、セクタの読み書きはゲストのメモリとの間の
+ * memcpyだけで済ませる。書き込みはイメージファイルへ反映される
+ */
+typedef struct Disk {
+  uint8_t* data;
+  size_t size;
+  /* 読み書きできるセクタ数(イメージの末尾の半端なバイトは使わない) */
+  uint64_t sectors;
+  /* 書き込み禁止で開いたか */
+  int read_only;
+
+  /* BIOSに見せるドライブ番号とCHSの形状 */
+  uint8_t drive;
+  uint32_t cylinders;
+  uint32_t heads;
+  uint32_t sectors_per_track;
+} Disk;
+
+/* filenameのイメージを開いてmmapする。開けなければNULLを返す
+ *
+ * 書き込みできなければ読み込み専用で開く。
+ * 1.44MB以下のイメージはフロッピー(ドライブ0x00)、それより大きければハードディスク(0x80)として扱う
+ */
+Disk* open_disk(const char* filename);
+
+/* mmapを解除してイメージを閉じる */
+void close_disk(Disk* disk);
+
+#endif
@@ -9,23 +9,146 @@
 
 #include <stdint.h>
 
+#include "output.h"
+#include "sched.h"
+
 enum Register { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI, REGISTERS_COUNT,
                 AL = EAX, CL = ECX, DL = EDX, BL = EBX,
                 AH = AL + 4, CH = CL + 4, DH = DL + 4, BH = BL + 4 };
 
+/* I/Oポートの表(io.hで定義) */
+struct IoPorts;
+/* シリアルポート(uart.cで定義) */
+struct Uart;
+/* タイマー(pit.cで定義) */
+struct Pit;
+/* 準仮想化コンソール(pvconsole.cで定義) */
+struct PvConsole;
+/* 入力の記録と再生(replay.cで定義) */
+struct Replay;
+/* ディスクイメージ(disk.hで定義) */
+struct Disk;
+/* テキスト画面(vga.cで定義) */
+struct Vga;
+/* 呼び出し文脈ごとの命令数(callstack.cで定義) */
+struct CallStack;
+/* メモリの読み書きの分布(heatmap.cで定義) */
+struct Heatmap;
+/* 実行した命令のトレース(trace.hで定義) */
+struct Trace;
+
+/* キャッシュラインのサイズ */
+#define CACHE_LINE_SIZE 64
+
+/* コンパイル済みのブロックの機械語の書き換えを調べる単位(キャッシュラインと同じ64バイト)
+ * ページ単位だと、コードと同じページにあるスタックへの書き込みでもブロックが無効になってしまう
+ */
+#define CODE_LINE_SHIFT 6
+
+/* Emulatorのhooksのビット */
+/* メモリの読み書きのたびに調べるので、コールドなフィールドのポインタではなくこのビットを見る */
+#define HOOK_HEATMAP 1 /* heatmapに読み書きを数える */
+#define HOOK_CODE    2 /* code_linesの範囲への書き込みでコンパイル済みのブロックを無効にする */
+
+/* ダーティページ管理の単位(4KB) */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+
+/* 命令を1つ実行するたびに触るフィールドを先頭の1キャッシュラインにまとめる。
+   めったに使わないフィールドを追加するときは、memoryより後ろに置くこと */
 typedef struct {
   /* 汎用レジスタ　*/
-  uint32_t registers[REGISTERS_COUNT];
+  /* ホストもx86(リトルエンディアン)であることを前提に、
+     同じ領域を32bit/16bit/8bit単位で直接読み書きできるようにしている。
+     registers8[n][0]がAL,CL,DL,BL、registers8[n][1]がAH,CH,DH,BHに対応する */
+  union {
+    uint32_t registers[REGISTERS_COUNT];
+    uint16_t registers16[REGISTERS_COUNT][2];
+    uint8_t  registers8[REGISTERS_COUNT][4];
+  };
 
   /* EFLAGSレジスタ */
   uint32_t eflags;
-  
-  /* メモリ(バイト列) */
-  uint8_t* memory;
 
   /* プログラムカウンタ */
   /* 実行中の機械語が置いてあるメモリ番地を記憶するレジスタ */
   uint32_t eip;
-} Emulator;
+
+  /* メモリ(バイト列) */
+  uint8_t* memory;
+
+  /* 書き込みのあったページを記録するビットマップ(1ビットが1ページ) */
+  /* プールに返却するときに、このビットが立っているページだけを0クリアする */
+  uint32_t* dirty_pages;
+
+  /* メモリへの書き込み回数 */
+  /* ポーリングのループが何も書き換えていないことを確かめるのに使う */
+  uint32_t memory_writes;
+
+  /* メモリの読み書きで呼ぶ計測などのフック(HOOK_*のビット) */
+  uint32_t hooks;
+
+  /* ---- ここから下はコールドなフィールド ---- */
+
+  /* メモリのバイト数 */
+  uint32_t memory_size;
+
+  /* シリアルポートへの出力をためておくバッファ */
+  OutputBuffer output;
+
+  /* I/Oポートとデバイスの対応表 */
+  struct IoPorts* io;
+
+  /* COM1のシリアルポート */
+  struct Uart* uart;
+
+  /* タイマー */
+  struct Pit* pit;
+
+  /* 文字列をまとめて出力する準仮想化コンソール */
+  struct PvConsole* console;
+
+  /* 仮想時間(これまでに実行した命令数) */
+  /* メインループがブロックの境界でまとめて進める */
+  uint64_t vtime;
+
+  /* 仮想時間で動くイベントのスケジューラ */
+  Scheduler* sched;
+
+  /* 受け付けを待っている割り込み要求(ビットnがIRQn) */
+  uint32_t irq_pending;
+
+  /* hlt命令で停止中 */
+  int halted;
+
+  /* NULLでなければ、非決定的なデバイスからの入力を記録または再生する */
+  struct Replay* replay;
+
+  /* INT 13hで読み書きするディスクイメージ(NULLならディスクなし) */
+  struct Disk* disk;
+
+  /* 0xB8000番地からのテキスト画面を描画する(NULLなら描画しない) */
+  struct Vga* vga;
+
+  /* NULLでなければ、call/retと割り込みで呼び出し文脈を追って命令数を数える */
+  struct CallStack* callstack;
+
+  /* NULLでなければ、メモリの読み書きをページとキャッシュラインごとに数える(hooksのHOOK_HEATMAPも立てる) */
+  struct Heatmap* heatmap;
+
+  /* NULLでなければ、実行した命令をトレースに書く(コンパイル済みのブロックの中でも1命令ずつ書く) */
+  struct Trace* trace;
+
+  /* コンパイル済みのブロックがある64バイトごとのビットマップ(ブロックキャッシュがなければNULL) */
+  /* ブロックキャッシュがある間はhooksのHOOK_CODEも立てる */
+  /* ビットの立った範囲に書き込むと、code_versionsを進めてそこを含むブロックを無効にする */
+  uint32_t* code_lines;
+
+  /* 64バイトごとの書き換えの世代。ブロックはコンパイルを依頼したときの世代と比べて使う */
+  uint32_t* code_versions;
+} __attribute__((aligned(CACHE_LINE_SIZE))) Emulator;
+
+_Static_assert(sizeof(uint32_t) * REGISTERS_COUNT + sizeof(uint32_t) * 2
+               + sizeof(uint8_t*) + sizeof(uint32_t*) + sizeof(uint32_t) * 2 <= CACHE_LINE_SIZE, "hot fields of Emulator must fit in one cache line");
 
 #endif
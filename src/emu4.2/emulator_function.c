@@ -1,5 +1,8 @@
 #include "emulator_function.h"
 
+#include "vga.h"
+#include "heatmap.h"
+
 void push32(Emulator* emu, uint32_t value) {
   
   uint32_t address = get_register32(emu, ESP) - 4;
@@ -51,12 +54,14 @@ int32_t get_sign_code32(Emulator* emu, int index) {
 }
 
 
+/* AL〜BLは0〜3、AH〜BHは4〜7なので、
+   下位2ビットがレジスタ番号、3ビット目が上位バイトかどうかを表している */
 uint8_t get_register8(Emulator* emu, int index) {
-  if (index < 4) {
-    return emu->registers[index] & 0xff;
-  } else {
-    return (emu->registers[index - 4] >> 8) & 0xff;
-  }
+  return emu->registers8[index & 3][index >> 2];
+}
+
+uint16_t get_register16(Emulator* emu, int index) {
+  return emu->registers16[index][0];
 }
 
 uint32_t get_register32(Emulator* emu, int index) {
@@ -64,13 +69,11 @@ uint32_t get_register32(Emulator* emu, int index) {
 }
 
 void set_register8(Emulator* emu, int index, uint8_t value) {
-  if(index < 4) {
-    uint32_t r = emu->registers[index] & 0xffffff00;
-    emu->registers[index] = r | (uint32_t)value;
-  } else {
-    uint32_t r = emu->registers[index - 4] & 0xffff00ff;
-    emu->registers[index - 4] = r | ((uint32_t)value << 8);
-  }
+  emu->registers8[index & 3][index >> 2] = value;
+}
+
+void set_register16(Emulator* emu, int index, uint16_t value) {
+  emu->registers16[index][0] = value;
 }
 
 void set_register32(Emulator* emu, int index, uint32_t value) {
@@ -78,30 +81,87 @@ void set_register32(Emulator* emu, int index, uint32_t value) {
 }
 
 uint32_t get_memory8(Emulator* emu, uint32_t address) {
+  if(emu->hooks & HOOK_HEATMAP) {
+    heatmap_access(emu->heatmap, address, 0);
+  }
   return emu->memory[address];
 }
 
 uint32_t get_memory32(Emulator* emu, uint32_t address) {
   int i;
   uint32_t ret = 0;
+  /* 32bitの読み込みは1回の読み込みとして数える */
+  if(emu->hooks & HOOK_HEATMAP) {
+    heatmap_access(emu->heatmap, address, 0);
+  }
   /* リトルエンディアンで書かれた32ビット値をuint32_t型に変換するために、
      for文で１バイトずつ読み取って左にずらし、 
      前回のretの値にビットORをしている*/
   for(i = 0; i < 4; i++) {
-    ret |= get_memory8(emu, address + i) << (8 * i);
+    ret |= emu->memory[address + i] << (8 * i);
   }
   return ret;
 }
 
-void set_memory8(Emulator* emu, uint32_t address, uint32_t value) {
+/* addressを含む64バイトにコンパイル済みのブロックがあれば、そのブロックを無効にする */
+static void invalidate_code(Emulator* emu, uint32_t address) {
+  uint32_t line = address >> CODE_LINE_SHIFT;
+  uint32_t bit  = 1u << (line & 31);
+
+  if((emu->hooks & HOOK_CODE) && (emu->code_lines[line >> 5] & bit)) {
+    emu->code_lines[line >> 5] &= ~bit;
+    emu->code_versions[line]++;
+  }
+}
+
+/* 1バイト書き込み、ダーティページとテキスト画面の描画するセルを記録する */
+static void store8(Emulator* emu, uint32_t address, uint32_t value) {
   emu->memory[address] = value & 0xFF;
+  emu->dirty_pages[address >> (PAGE_SHIFT + 5)] |= 1u << ((address >> PAGE_SHIFT) & 31);
+  emu->memory_writes++;
+  invalidate_code(emu, address);
+  /* テキスト画面への書き込みなら、描画するセルとして記録する */
+  if(address - VGA_TEXT_BASE < VGA_TEXT_SIZE && emu->vga != NULL) {
+    vga_mark(emu->vga, address);
+  }
+}
+
+void set_memory8(Emulator* emu, uint32_t address, uint32_t value) {
+  if(emu->hooks & HOOK_HEATMAP) {
+    heatmap_access(emu->heatmap, address, 1);
+  }
+  store8(emu, address, value);
+}
+
+/* ホストからメモリに直接書き込んだ範囲をダーティページとして記録し、コンパイル済みのブロックを無効にする */
+void mark_memory_dirty(Emulator* emu, uint32_t address, uint32_t size) {
+  uint32_t page;
+
+  if(size == 0) {
+    return;
+  }
+  for(page = address >> PAGE_SHIFT; page <= (address + size - 1) >> PAGE_SHIFT; page++) {
+    emu->dirty_pages[page >> 5] |= 1u << (page & 31);
+  }
+  if(emu->hooks & HOOK_CODE) {
+    uint32_t line;
+    for(line = address >> CODE_LINE_SHIFT; line <= (address + size - 1) >> CODE_LINE_SHIFT; line++) {
+      invalidate_code(emu, line << CODE_LINE_SHIFT);
+    }
+  }
+  if(emu->vga != NULL) {
+    vga_mark_range(emu->vga, address, size);
+  }
 }
 
 /* 32ビット値をリトルエンディアンでメモリに書き込む */
 void set_memory32(Emulator* emu, uint32_t address, uint32_t value) {
   int i;
+  if(emu->hooks & HOOK_HEATMAP) {
+    heatmap_access(emu->heatmap, address, 1);
+  }
   for(i = 0; i < 4; i++) {
-    set_memory8(emu, address + i, value >> (i * 8));
+    store8(emu, address + i, value >> (i * 8));
   }
 }
 
@@ -9,6 +9,7 @@
 #define CARRY_FLAG (1)
 #define ZERO_FLAG (1 << 6)
 #define SIGN_FLAG (1 << 7)
+#define INTERRUPT_FLAG (1 << 9)
 #define OVERFLOW_FLAG (1 << 11)
 
 /* プログラムカウンタから相対位置にある符号無し8bit値を取得 */
@@ -26,12 +27,18 @@ int32_t get_sign_code32(Emulator* emu, int index);
 /* index番目の8bit汎用レジスタの値を取得する */
 uint8_t get_register8(Emulator* emu, int index);
 
+/* index番目の16bit汎用レジスタの値を取得する */
+uint16_t get_register16(Emulator* emu, int index);
+
 /* index番目の32bit汎用レジスタの値を取得する */
 uint32_t get_register32(Emulator* emu, int index);
 
 /* index番目の8bitの汎用レジスタに値を設定する */
 void set_register8(Emulator* emu, int index, uint8_t value);
 
+/* index番目の16bit汎用レジスタに値を設定する */
+void set_register16(Emulator* emu, int index, uint16_t value);
+
 /* index番目の32bit汎用レジスタに値を設定する */
 void set_register32(Emulator* emu, int index, uint32_t value);
 
@@ -47,6 +54,9 @@ void set_memory8(Emulator* emu, uint32_t address, uint32_t value);
 /* メモリのindex番地に32bit値を設定する */
 void set_memory32(Emulator* emu, uint32_t address, uint32_t value);
 
+/* memoryをホストから直接書き換えたとき、その範囲をダーティページとして記録し、コンパイル済みのブロックを無効にする */
+void mark_memory_dirty(Emulator* emu, uint32_t address, uint32_t size);
+
 /* スタックに32bit値を積む */
 void push32(Emulator* emu, uint32_t value);
 
@@ -0,0 +1,290 @@
+#include "heatmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* 1つのキャッシュラインの読み書き */
+typedef struct {
+  uint64_t reads;
+  uint64_t writes;
+  /* 最後に触った区間の番号 */
+  uint32_t epoch;
+} HeatLine;
+
+/* 1つのページのスタックへの読み書き(ページ全体の数はキャッシュラインから足し合わせる) */
+typedef struct {
+  uint64_t stack_reads;
+  uint64_t stack_writes;
+  uint32_t epoch;
+} HeatPage;
+
+/* interval命令ごとの区間の記録 */
+typedef struct {
+  /* 区間の終わりの仮想時間 */
+  uint64_t vtime;
+  /* 区間の中で触ったページとキャッシュラインの数 */
+  uint32_t pages;
+  uint32_t lines;
+  uint64_t reads;
+  uint64_t writes;
+} HeatSample;
+
+struct Heatmap {
+  Emulator* emu;
+  HeatLine* lines;
+  HeatPage* pages;
+  uint32_t line_count;
+  uint32_t page_count;
+  /* 開始時のESP。これより下をスタックとみなす */
+  uint32_t stack_top;
+
+  /* 今の区間の番号(0は触っていない印なので1から) */
+  uint32_t epoch;
+  uint32_t ws_pages;
+  uint32_t ws_lines;
+  uint64_t reads;
+  uint64_t writes;
+
+  HeatSample* samples;
+  uint32_t sample_count;
+  uint32_t sample_capacity;
+  uint64_t last_vtime;
+
+  uint64_t interval;
+  TimerEvent event;
+};
+
+/* vtimeで今の区間を閉じて記録し、次の区間を始める */
+static void close_interval(Heatmap* map, uint64_t vtime) {
+  HeatSample* sample;
+
+  if(map->sample_count == map->sample_capacity) {
+    map->sample_capacity = map->sample_capacity ? map->sample_capacity * 2 : 1024;
+    map->samples = realloc(map->samples, sizeof(HeatSample) * map->sample_capacity);
+  }
+  sample = &map->samples[map->sample_count++];
+  sample->vtime  = vtime;
+  sample->pages  = map->ws_pages;
+  sample->lines  = map->ws_lines;
+  sample->reads  = map->reads;
+  sample->writes = map->writes;
+
+  map->epoch++;
+  map->ws_pages   = 0;
+  map->ws_lines   = 0;
+  map->reads      = 0;
+  map->writes     = 0;
+  map->last_vtime = vtime;
+}
+
+/* 終了時に、途中まで進んだ区間があれば記録する */
+static void finish_interval(Heatmap* map) {
+  if(map->emu->vtime > map->last_vtime) {
+    close_interval(map, map->emu->vtime);
+  }
+}
+
+static void heatmap_tick(void* context) {
+  Heatmap* map = context;
+
+  close_interval(map, map->emu->vtime);
+  sched_add(map->emu->sched, &map->event, map->event.when + map->interval, heatmap_tick, map);
+}
+
+Heatmap* create_heatmap(Emulator* emu, uint64_t interval) {
+  Heatmap* map = calloc(1, sizeof(Heatmap));
+
+  map->emu        = emu;
+  map->line_count = emu->memory_size / CACHE_LINE_SIZE;
+  map->page_count = emu->memory_size >> PAGE_SHIFT;
+  map->lines      = calloc(map->line_count, sizeof(HeatLine));
+  map->pages      = calloc(map->page_count, sizeof(HeatPage));
+  map->stack_top  = emu->registers[ESP];
+  map->epoch      = 1;
+  map->interval   = interval;
+  map->last_vtime = emu->vtime;
+  sched_add(emu->sched, &map->event, emu->vtime + interval, heatmap_tick, map);
+  return map;
+}
+
+void destroy_heatmap(Heatmap* map) {
+  sched_cancel(map->emu->sched, &map->event);
+  free(map->lines);
+  free(map->pages);
+  free(map->samples);
+  free(map);
+}
+
+void heatmap_access(Heatmap* map, uint32_t address, int write) {
+  uint32_t line = address / CACHE_LINE_SIZE;
+  uint32_t page = address >> PAGE_SHIFT;
+  int stack;
+
+  if(line >= map->line_count) {
+    return;
+  }
+  stack = address >= map->emu->registers[ESP] && address < map->stack_top;
+  if(write) {
+    map->lines[line].writes++;
+    map->writes++;
+    if(stack) {
+      map->pages[page].stack_writes++;
+    }
+  } else {
+    map->lines[line].reads++;
+    map->reads++;
+    if(stack) {
+      map->pages[page].stack_reads++;
+    }
+  }
+
+  /* この区間で初めて触ったキャッシュラインとページをワーキングセットに数える */
+  if(map->lines[line].epoch != map->epoch) {
+    map->lines[line].epoch = map->epoch;
+    map->ws_lines++;
+    if(map->pages[page].epoch != map->epoch) {
+      map->pages[page].epoch = map->epoch;
+      map->ws_pages++;
+    }
+  }
+}
+
+/* pageのキャッシュラインの読み書きを足し合わせる */
+static void page_total(Heatmap* map, uint32_t page, uint64_t* reads, uint64_t* writes) {
+  uint32_t first = (page << PAGE_SHIFT) / CACHE_LINE_SIZE;
+  uint32_t i;
+
+  *reads  = 0;
+  *writes = 0;
+  for(i = first; i < first + PAGE_SIZE / CACHE_LINE_SIZE; i++) {
+    *reads  += map->lines[i].reads;
+    *writes += map->lines[i].writes;
+  }
+}
+
+int heatmap_write(Heatmap* map, const char* filename) {
+  FILE* file = fopen(filename, "w");
+  uint32_t i;
+
+  if(file == NULL) {
+    return -1;
+  }
+  finish_interval(map);
+
+  fprintf(file, "# index 0: working set per %llu instructions\n", (unsigned long long)map->interval);
+  fprintf(file, "# vtime pages lines reads writes\n");
+  for(i = 0; i < map->sample_count; i++) {
+    HeatSample* sample = &map->samples[i];
+    fprintf(file, "%llu %u %u %llu %llu\n", (unsigned long long)sample->vtime,
+            sample->pages, sample->lines,
+            (unsigned long long)sample->reads, (unsigned long long)sample->writes);
+  }
+
+  fprintf(file, "\n\n# index 1: pages (%d bytes)\n", PAGE_SIZE);
+  fprintf(file, "# address reads writes stack_reads stack_writes\n");
+  for(i = 0; i < map->page_count; i++) {
+    uint64_t reads, writes;
+    page_total(map, i, &reads, &writes);
+    fprintf(file, "0x%05x %llu %llu %llu %llu\n", i << PAGE_SHIFT,
+            (unsigned long long)reads, (unsigned long long)writes,
+            (unsigned long long)map->pages[i].stack_reads,
+            (unsigned long long)map->pages[i].stack_writes);
+  }
+
+  /* 1MBで16384行になるので、触ったキャッシュラインだけを書く */
+  fprintf(file, "\n\n# index 2: touched cache lines (%d bytes)\n", CACHE_LINE_SIZE);
+  fprintf(file, "# address reads writes\n");
+  for(i = 0; i < map->line_count; i++) {
+    if(map->lines[i].epoch != 0) {
+      fprintf(file, "0x%05x %llu %llu\n", i * CACHE_LINE_SIZE,
+              (unsigned long long)map->lines[i].reads, (unsigned long long)map->lines[i].writes);
+    }
+  }
+
+  if(fclose(file) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/* 読み書きの多い順に並べるためのページ */
+typedef struct {
+  uint32_t page;
+  uint64_t reads;
+  uint64_t writes;
+} PageTotal;
+
+static int compare_total(const void* a, const void* b) {
+  const PageTotal* x = a;
+  const PageTotal* y = b;
+  uint64_t total_x = x->reads + x->writes;
+  uint64_t total_y = y->reads + y->writes;
+
+  if(total_x != total_y) {
+    return total_x < total_y ? 1 : -1;
+  }
+  return x->page < y->page ? -1 : 1;
+}
+
+void heatmap_dump(Heatmap* map) {
+  PageTotal* totals = malloc(sizeof(PageTotal) * map->page_count);
+  uint32_t touched_pages = 0;
+  uint32_t touched_lines = 0;
+  uint32_t peak_pages = 0;
+  uint32_t peak_lines = 0;
+  uint64_t reads = 0, writes = 0;
+  uint64_t stack_reads = 0, stack_writes = 0;
+  uint32_t i;
+
+  finish_interval(map);
+  for(i = 0; i < map->line_count; i++) {
+    if(map->lines[i].epoch != 0) {
+      touched_lines++;
+    }
+  }
+  for(i = 0; i < map->sample_count; i++) {
+    if(map->samples[i].pages > peak_pages) {
+      peak_pages = map->samples[i].pages;
+    }
+    if(map->samples[i].lines > peak_lines) {
+      peak_lines = map->samples[i].lines;
+    }
+  }
+  for(i = 0; i < map->page_count; i++) {
+    totals[i].page = i;
+    page_total(map, i, &totals[i].reads, &totals[i].writes);
+    if(map->pages[i].epoch != 0) {
+      touched_pages++;
+    }
+    reads        += totals[i].reads;
+    writes       += totals[i].writes;
+    stack_reads  += map->pages[i].stack_reads;
+    stack_writes += map->pages[i].stack_writes;
+  }
+
+  printf("\nmemory touched: %u pages (%u KB), %u cache lines (%u KB)\n",
+         touched_pages, touched_pages * (PAGE_SIZE / 1024),
+         touched_lines, touched_lines * CACHE_LINE_SIZE / 1024);
+  printf("peak working set per %llu instructions: %u pages, %u cache lines\n",
+         (unsigned long long)map->interval, peak_pages, peak_lines);
+  printf("reads %llu (stack %.1f%%), writes %llu (stack %.1f%%)\n",
+         (unsigned long long)reads, reads ? 100.0 * stack_reads / reads : 0.0,
+         (unsigned long long)writes, writes ? 100.0 * stack_writes / writes : 0.0);
+
+  qsort(totals, map->page_count, sizeof(PageTotal), compare_total);
+  printf("%-8s %14s %14s %6s %6s\n", "page", "reads", "writes", "acc%", "stack%");
+  for(i = 0; i < map->page_count && i < HEATMAP_HOT_PAGES; i++) {
+    PageTotal* total = &totals[i];
+    HeatPage* page = &map->pages[total->page];
+    uint64_t accesses = total->reads + total->writes;
+    if(accesses == 0) {
+      break;
+    }
+    printf("0x%05x  %14llu %14llu %5.1f%% %5.1f%%\n", total->page << PAGE_SHIFT,
+           (unsigned long long)total->reads, (unsigned long long)total->writes,
+           100.0 * accesses / (reads + writes),
+           100.0 * (page->stack_reads + page->stack_writes) / accesses);
+  }
+  free(totals);
+}
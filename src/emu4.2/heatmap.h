@@ -0,0 +1,41 @@
+#ifndef HEATMAP_H_
+#define HEATMAP_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* 終了時の表に出す、読み書きの多いページの数 */
+#define HEATMAP_HOT_PAGES 16
+
+/* ゲストのメモリの読み書きの分布とワーキングセット
+ *
+ * get_memory8/32とset_memory8/32から呼ばれ、キャッシュラインごと、ページごとに読み書きの回数を数える。
+ * 32bitの読み書きも1回と数え、先頭のバイトの番地に数える
+ * (命令の読み込みとホストからの直接の書き込みは数えない)。
+ * 一定の命令数ごとに、その間に触ったページとキャッシュラインの数をワーキングセットとして記録する。
+ * 開始時のESPより下でその時点のESP以上の番地への読み書きは、スタックへの読み書きとして分けて数える
+ */
+typedef struct Heatmap Heatmap;
+
+/* emuのメモリの読み書きを数え始める。interval命令ごとにワーキングセットを記録する */
+Heatmap* create_heatmap(Emulator* emu, uint64_t interval);
+
+void destroy_heatmap(Heatmap* map);
+
+/* addressから読んだ(writeが1なら書いた) */
+void heatmap_access(Heatmap* map, uint32_t address, int write);
+
+/* ワーキングセットの推移、ページごととキャッシュラインごとの読み書きの数を、
+ * gnuplotなどで描ける空白区切りの表にしてfilenameに書く
+ *
+ * 表は2行の空行で区切り、gnuplotのindexで0から順に選べる。書けなければ-1を返す
+ */
+int heatmap_write(Heatmap* map, const char* filename);
+
+/* 触ったメモリの量、ワーキングセットの最大、スタックとそれ以外の割合、
+ * 読み書きの多いページを標準出力に出す
+ */
+void heatmap_dump(Heatmap* map);
+
+#endif
@@ -0,0 +1,363 @@
+#include "hostio.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* io_uringの共有リング */
+typedef struct {
+  int fd;
+  void* sq_ring;
+  void* cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+
+  atomic_uint* sq_head;
+  atomic_uint* sq_tail;
+  uint32_t* sq_array;
+  uint32_t sq_mask;
+  atomic_uint* cq_head;
+  atomic_uint* cq_tail;
+  struct io_uring_cqe* cqes;
+  uint32_t cq_mask;
+
+  /* 登録したが、まだio_uring_enterで渡していないSQEの数 */
+  uint32_t to_submit;
+} Uring;
+
+/* io_uringが使えないときの要求 */
+typedef struct {
+  enum HostIoOp op;
+  int fd;
+  void* buffer;
+  size_t length;
+  uint64_t offset;
+  uint64_t tag;
+} ThreadRequest;
+
+/* io_uringが使えないときに読み書きを行うスレッド */
+/* 要求を1つずつ順に処理するので、drainの指定は何もしなくても守られる */
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t request_cond;
+  pthread_cond_t completion_cond;
+  int stop;
+
+  ThreadRequest* requests;
+  uint32_t request_head;
+  uint32_t request_tail;
+  HostIoCompletion* completions;
+  uint32_t completion_head;
+  uint32_t completion_tail;
+} IoThread;
+
+struct HostIo {
+  uint32_t entries;
+  uint32_t inflight;
+  int uses_uring;
+  Uring uring;
+  IoThread worker;
+};
+
+static int uring_setup(Uring* ring, uint32_t entries) {
+  struct io_uring_params params;
+  uint8_t* sq;
+  uint8_t* cq;
+
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if(ring->fd < 0) {
+    return -1;
+  }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  /* 古いカーネルではSQとCQのリングを別々にmmapする */
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    if(ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+  if(ring->sq_ring == MAP_FAILED) {
+    close(ring->fd);
+    return -1;
+  }
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_CQ_RING);
+    if(ring->cq_ring == MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      close(ring->fd);
+      return -1;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if(ring->sqes == MAP_FAILED) {
+    if(ring->cq_ring != ring->sq_ring) {
+      munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    return -1;
+  }
+
+  sq = ring->sq_ring;
+  cq = ring->cq_ring;
+  ring->sq_head  = (atomic_uint*)(sq + params.sq_off.head);
+  ring->sq_tail  = (atomic_uint*)(sq + params.sq_off.tail);
+  ring->sq_mask  = *(uint32_t*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (uint32_t*)(sq + params.sq_off.array);
+  ring->cq_head  = (atomic_uint*)(cq + params.cq_off.head);
+  ring->cq_tail  = (atomic_uint*)(cq + params.cq_off.tail);
+  ring->cq_mask  = *(uint32_t*)(cq + params.cq_off.ring_mask);
+  ring->cqes     = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  ring->to_submit = 0;
+  return 0;
+}
+
+static void uring_teardown(Uring* ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  if(ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+static int uring_enter(Uring* ring, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+  int ret;
+
+  do {
+    ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+  } while(ret < 0 && errno == EINTR);
+  return ret;
+}
+
+/* 要求を1つ処理する */
+static int32_t run_request(ThreadRequest* request) {
+  ssize_t done = 0;
+
+  if(request->op == HOSTIO_FSYNC) {
+    return fsync(request->fd) < 0 ? -errno : 0;
+  }
+  /* io_uringと同じく、ファイルの終わりでは短く読めた分だけを返す */
+  while((size_t)done < request->length) {
+    ssize_t n;
+    if(request->op == HOSTIO_READ) {
+      n = pread(request->fd, (uint8_t*)request->buffer + done, request->length - done, request->offset + done);
+    } else {
+      n = pwrite(request->fd, (uint8_t*)request->buffer + done, request->length - done, request->offset + done);
+    }
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    if(n == 0) {
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+static void* io_thread(void* arg) {
+  HostIo* io       = arg;
+  IoThread* worker = &io->worker;
+
+  pthread_mutex_lock(&worker->lock);
+  for(;;) {
+    ThreadRequest request;
+    HostIoCompletion completion;
+
+    while(worker->request_head == worker->request_tail && !worker->stop) {
+      pthread_cond_wait(&worker->request_cond, &worker->lock);
+    }
+    if(worker->request_head == worker->request_tail) {
+      break;
+    }
+    request = worker->requests[worker->request_head % io->entries];
+    worker->request_head++;
+
+    /* 読み書きの間はロックを外して、エミュレータのスレッドを待たせない */
+    pthread_mutex_unlock(&worker->lock);
+    completion.tag    = request.tag;
+    completion.result = run_request(&request);
+    pthread_mutex_lock(&worker->lock);
+
+    /* 処理中の要求はentries個までなので、completionsがあふれることはない */
+    worker->completions[worker->completion_tail % io->entries] = completion;
+    worker->completion_tail++;
+    pthread_cond_signal(&worker->completion_cond);
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return NULL;
+}
+
+HostIo* create_hostio(uint32_t entries) {
+  HostIo* io = calloc(1, sizeof(HostIo));
+
+  io->entries = entries;
+  if(uring_setup(&io->uring, entries) == 0) {
+    io->uses_uring = 1;
+    return io;
+  }
+
+  /* seccompなどでio_uringが使えないときは、読み書き用のスレッドを起こす */
+  io->worker.requests    = calloc(entries, sizeof(ThreadRequest));
+  io->worker.completions = calloc(entries, sizeof(HostIoCompletion));
+  pthread_mutex_init(&io->worker.lock, NULL);
+  pthread_cond_init(&io->worker.request_cond, NULL);
+  pthread_cond_init(&io->worker.completion_cond, NULL);
+  pthread_create(&io->worker.thread, NULL, io_thread, io);
+  return io;
+}
+
+void destroy_hostio(HostIo* io) {
+  HostIoCompletion completion;
+
+  /* 読み書き中のバッファを解放してしまわないよう、全ての完了を待つ */
+  hostio_submit(io);
+  while(io->inflight > 0) {
+    hostio_reap(io, &completion, 1, 1);
+  }
+
+  if(io->uses_uring) {
+    uring_teardown(&io->uring);
+  } else {
+    pthread_mutex_lock(&io->worker.lock);
+    io->worker.stop = 1;
+    pthread_cond_signal(&io->worker.request_cond);
+    pthread_mutex_unlock(&io->worker.lock);
+    pthread_join(io->worker.thread, NULL);
+    pthread_mutex_destroy(&io->worker.lock);
+    pthread_cond_destroy(&io->worker.request_cond);
+    pthread_cond_destroy(&io->worker.completion_cond);
+    free(io->worker.requests);
+    free(io->worker.completions);
+  }
+  free(io);
+}
+
+int hostio_uses_uring(HostIo* io) {
+  return io->uses_uring;
+}
+
+uint32_t hostio_inflight(HostIo* io) {
+  return io->inflight;
+}
+
+int hostio_queue(HostIo* io, enum HostIoOp op, int fd, void* buffer, size_t length,
+                 uint64_t offset, int drain, uint64_t tag) {
+  if(io->inflight == io->entries) {
+    return -1;
+  }
+  io->inflight++;
+
+  if(io->uses_uring) {
+    Uring* ring = &io->uring;
+    uint32_t tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    uint32_t index = tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    switch(op) {
+    case HOSTIO_READ:
+      sqe->opcode = IORING_OP_READ;
+      break;
+    case HOSTIO_WRITE:
+      sqe->opcode = IORING_OP_WRITE;
+      break;
+    case HOSTIO_FSYNC:
+      sqe->opcode = IORING_OP_FSYNC;
+      break;
+    }
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t)buffer;
+    sqe->len       = length;
+    sqe->off       = offset;
+    sqe->user_data = tag;
+    sqe->flags     = drain ? IOSQE_IO_DRAIN : 0;
+    ring->sq_array[index] = index;
+    /* SQEを書き終えてからカーネルに見せる */
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    ring->to_submit++;
+  } else {
+    IoThread* worker = &io->worker;
+    ThreadRequest request = {op, fd, buffer, length, offset, tag};
+
+    pthread_mutex_lock(&worker->lock);
+    worker->requests[worker->request_tail % io->entries] = request;
+    worker->request_tail++;
+    pthread_cond_signal(&worker->request_cond);
+    pthread_mutex_unlock(&worker->lock);
+  }
+  return 0;
+}
+
+void hostio_submit(HostIo* io) {
+  if(io->uses_uring && io->uring.to_submit > 0) {
+    /* 読み書きの完了は待たずに戻る */
+    int submitted = uring_enter(&io->uring, io->uring.to_submit, 0, 0);
+    if(submitted > 0) {
+      io->uring.to_submit -= submitted;
+    }
+  }
+}
+
+int hostio_reap(HostIo* io, HostIoCompletion* completions, int max, int wait) {
+  int count = 0;
+
+  if(io->uses_uring) {
+    Uring* ring = &io->uring;
+    uint32_t head, tail;
+
+    if(wait && io->inflight > 0 && atomic_load_explicit(ring->cq_head, memory_order_relaxed)
+                                   == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+      uring_enter(ring, ring->to_submit, 1, IORING_ENTER_GETEVENTS);
+      ring->to_submit = 0;
+    }
+    head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+    while(head != tail && count < max) {
+      struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+      completions[count].tag    = cqe->user_data;
+      completions[count].result = cqe->res;
+      count++;
+      head++;
+    }
+    atomic_store_explicit(ring->cq_head, head, memory_order_release);
+  } else {
+    IoThread* worker = &io->worker;
+
+    pthread_mutex_lock(&worker->lock);
+    while(wait && io->inflight > 0 && worker->completion_head == worker->completion_tail) {
+      pthread_cond_wait(&worker->completion_cond, &worker->lock);
+    }
+    while(worker->completion_head != worker->completion_tail && count < max) {
+      completions[count++] = worker->completions[worker->completion_head % io->entries];
+      worker->completion_head++;
+    }
+    pthread_mutex_unlock(&worker->lock);
+  }
+
+  io->inflight -= count;
+  return count;
+}
@@ -0,0 +1,58 @@
+#ifndef HOSTIO_H_
+#define HOSTIO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ホストのファイルへの非同期の読み書き
+ *
+ * io_uringが使えればio_uringで、使えなければ読み書き用のスレッドで処理する。
+ * どちらでも、要求の登録と完了の回収はエミュレータのスレッドをブロックしない
+ */
+
+enum HostIoOp {
+  HOSTIO_READ,
+  HOSTIO_WRITE,
+  HOSTIO_FSYNC,
+};
+
+typedef struct {
+  /* 登録時に渡した値 */
+  uint64_t tag;
+  /* 読み書きしたバイト数。失敗したら負のerrno */
+  int32_t result;
+} HostIoCompletion;
+
+typedef struct HostIo HostIo;
+
+/* 同時にentries個までの要求を処理できるHostIoを作成する */
+HostIo* create_hostio(uint32_t entries);
+
+/* 処理中の要求が全て終わるのを待って破棄する */
+void destroy_hostio(HostIo* io);
+
+/* io_uringを使っていれば1を返す */
+int hostio_uses_uring(HostIo* io);
+
+/* 要求を登録する
+ *
+ * drainが1なら、それより前に登録した要求が全て終わってから処理する。
+ * 処理中の要求がentries個に達していれば-1を返す。
+ * 登録した要求はhostio_submitを呼ぶまで処理が始まらないことがある
+ */
+int hostio_queue(HostIo* io, enum HostIoOp op, int fd, void* buffer, size_t length,
+                 uint64_t offset, int drain, uint64_t tag);
+
+/* 登録した要求の処理を始めさせる */
+void hostio_submit(HostIo* io);
+
+/* 完了した要求を最大max個取り出し、その個数を返す
+ *
+ * waitが1なら、処理中の要求があるときは1つ以上完了するまで待つ
+ */
+int hostio_reap(HostIo* io, HostIoCompletion* completions, int max, int wait);
+
+/* 処理中の要求の数 */
+uint32_t hostio_inflight(HostIo* io);
+
+#endif
@@ -8,6 +8,7 @@
 #include "emulator_function.h"
 #include "io.h"
 #include "bios.h"
+#include "callstack.h"
 
 #include "modrm.h"
 
@@ -55,6 +56,10 @@ static void call_rel32(Emulator* emu) {
   push32(emu, emu->eip + 5);
   /* 目的地にジャンプするためにeipを書き換える */
   emu->eip += (diff + 5);
+  if(emu->callstack != NULL) {
+    /* 戻り先はpushしたcall命令の直後の番地 */
+    callstack_call(emu->callstack, emu->vtime, emu->eip, emu->eip - diff);
+  }
 }
 
 /* mov esp, ebpとpop ebpをまとめて実行する命令　 */
@@ -67,6 +72,9 @@ static void leave(Emulator* emu) {
 
 static void ret(Emulator* emu) {
   emu->eip = pop32(emu);
+  if(emu->callstack != NULL) {
+    callstack_return(emu->callstack, emu->vtime, emu->eip);
+  }
 }
 
 static void add_rm32_imm8(Emulator* emu, ModRM* modrm) {
@@ -140,6 +148,7 @@ static void code_83(Emulator* emu) {
     cmp_rm32_imm8(emu, &modrm);
     break;
   default:
+    output_flush(&emu->output);
     printf("not implemented: 83 /%d\n", modrm.opecode);
     exit(1);
   }
@@ -163,6 +172,7 @@ static void code_off(Emulator* emu) {
     inc_rm32(emu, &modrm);
     break;
   default:
+    output_flush(&emu->output);
     printf("not imiplemented: FF /%d\n", modrm.opecode);
     exit(1);
   }
@@ -288,7 +298,11 @@ static void swi(Emulator* emu) {
   case 0x10:
     bios_video(emu); // 一文字表示機能
     break;
+  case 0x13:
+    bios_disk(emu); // ディスクの読み書き
+    break;
   default:
+    output_flush(&emu->output);
     printf("unknown interrupt: 0x%2x\n", int_index);
   }
 }
@@ -298,7 +312,7 @@ static void swi(Emulator* emu) {
 /* dxのポートから位置バイトを読み取りalに格納する */
 static void in_al_dx(Emulator* emu) {
   uint16_t address = get_register32(emu, EDX) & 0xffff;
-  uint8_t value = io_in8(address);
+  uint8_t value = io_in8(emu, address);
   set_register8(emu, AL, value);
   emu->eip += 1;
 }
@@ -308,7 +322,23 @@ static void in_al_dx(Emulator* emu) {
 static void out_dx_al(Emulator* emu) {
   uint16_t address = get_register32(emu, EDX) & 0xffff;
   uint8_t value = get_register8(emu, AL);
-  io_out8(address, value);
+  io_out8(emu, address, value);
+  emu->eip += 1;
+}
+
+/* in eax, dx命令 */
+/* dxのポートから4バイトを読み取りeaxに格納する */
+static void in_eax_dx(Emulator* emu) {
+  uint16_t address = get_register32(emu, EDX) & 0xffff;
+  set_register32(emu, EAX, io_in32(emu, address));
+  emu->eip += 1;
+}
+
+/* out dx, eax命令 */
+/* eaxの値をdxポートへ出力する */
+static void out_dx_eax(Emulator* emu) {
+  uint16_t address = get_register32(emu, EDX) & 0xffff;
+  io_out32(emu, address, get_register32(emu, EAX));
   emu->eip += 1;
 }
 
@@ -342,6 +372,35 @@ static void cmp_eax_imm32(Emulator* emu) {
   emu->eip += 5;  
 }
 
+/* 割り込みが来るまでCPUを停止する */
+/* 実際の停止と再開はメインループがブロックの境界で行う */
+static void hlt(Emulator* emu) {
+  emu->halted = 1;
+  emu->eip += 1;
+}
+
+/* 割り込みを禁止する */
+static void cli(Emulator* emu) {
+  emu->eflags &= ~INTERRUPT_FLAG;
+  emu->eip += 1;
+}
+
+/* 割り込みを許可する */
+static void sti(Emulator* emu) {
+  emu->eflags |= INTERRUPT_FLAG;
+  emu->eip += 1;
+}
+
+/* 割り込みハンドラから戻る */
+/* セグメントがないので、割り込み時に積んだ戻り先とEFLAGSだけを取り出す */
+static void iret(Emulator* emu) {
+  emu->eip    = pop32(emu);
+  emu->eflags = pop32(emu);
+  if(emu->callstack != NULL) {
+    callstack_return(emu->callstack, emu->vtime, emu->eip);
+  }
+}
+
 static void inc_r32(Emulator* emu){
   uint8_t reg = get_code8(emu, 0) - 0x40;
   set_register32(emu, reg, get_register32(emu, reg) + 1);
@@ -400,6 +459,7 @@ void init_instructions(void) {
   instructions[0xC3] = ret;
   instructions[0xC7] = mov_rm32_imm32;
   instructions[0xC9] = leave;
+  instructions[0xCF] = iret;
 
   instructions[0xCD] = swi;  
 
@@ -407,6 +467,11 @@ void init_instructions(void) {
   instructions[0xE9] = near_jump;
   instructions[0xEB] = short_jump;
   instructions[0xEC] = in_al_dx;
+  instructions[0xED] = in_eax_dx;
   instructions[0xEE] = out_dx_al;
+  instructions[0xEF] = out_dx_eax;
+  instructions[0xF4] = hlt;
+  instructions[0xFA] = cli;
+  instructions[0xFB] = sti;
   instructions[0xFF] = code_off;
 }
@@ -0,0 +1,60 @@
+#include "interrupt.h"
+
+#include "emulator_function.h"
+#include "callstack.h"
+
+void raise_irq(Emulator* emu, int irq) {
+  emu->irq_pending |= 1u << irq;
+}
+
+/* 番号の最も小さい割り込み要求を受け付ける
+ *
+ * このエミュレータにはセグメントがないので、割り込みベクタ表は0番地から
+ * 4バイトずつ並んだ32ビットの番地の表とする。ハンドラの番地が0の割り込みは捨てる
+ */
+static void deliver_interrupt(Emulator* emu) {
+  int irq         = __builtin_ctz(emu->irq_pending);
+  uint32_t vector = IRQ_VECTOR_BASE + irq;
+  uint32_t handler;
+
+  emu->irq_pending &= ~(1u << irq);
+  handler = get_memory32(emu, vector * 4);
+  if(handler == 0) {
+    return;
+  }
+
+  /* iret命令で戻れるよう、EFLAGSと戻り先をスタックに積んでハンドラへ飛ぶ */
+  push32(emu, emu->eflags);
+  push32(emu, emu->eip);
+  emu->eflags &= ~INTERRUPT_FLAG;
+  if(emu->callstack != NULL) {
+    callstack_call(emu->callstack, emu->vtime, handler, emu->eip);
+  }
+  emu->eip     = handler;
+  emu->halted  = 0;
+}
+
+int handle_events(Emulator* emu) {
+  for(;;) {
+    if(emu->vtime >= sched_next_time(emu->sched)) {
+      sched_run(emu->sched, emu->vtime);
+    }
+
+    if(emu->irq_pending != 0 && (emu->eflags & INTERRUPT_FLAG)) {
+      deliver_interrupt(emu);
+      continue;
+    }
+
+    if(!emu->halted) {
+      return 1;
+    }
+
+    /* 割り込みでしか起きられないので、起こしてくれるものがなければ終わり */
+    /* (受信を待つUART、NIC、ブロックデバイスは、待っている間ポーリングのイベントを予定しておく) */
+    if(!(emu->eflags & INTERRUPT_FLAG) || sched_next_time(emu->sched) == SCHED_NEVER) {
+      return 0;
+    }
+    /* 停止中は何も実行しないので、次のイベントの時刻まで飛ばす */
+    emu->vtime = sched_next_time(emu->sched);
+  }
+}
@@ -0,0 +1,28 @@
+#ifndef INTERRUPT_H_
+#define INTERRUPT_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "sched.h"
+
+/* IRQ0〜7に対応する割り込みベクタの先頭(PC互換機のBIOSと同じ) */
+#define IRQ_VECTOR_BASE 0x08
+
+/* 割り込み要求を出す */
+void raise_irq(Emulator* emu, int irq);
+
+/* ブロックの境界で処理すべきこと(タイマー、割り込み、hlt)があれば1を返す */
+static inline int events_pending(Emulator* emu) {
+  return emu->vtime >= sched_next_time(emu->sched) || emu->irq_pending != 0 || emu->halted;
+}
+
+/* ブロックの境界で、時刻の来たイベントを発火させて割り込みを受け付ける
+ *
+ * hlt命令で停止しているときは、次のイベントまで仮想時間を一気に進める。
+ * 割り込みが禁止されているか、待っているイベントが何もなく、
+ * 二度と実行を再開できないときは0を返す
+ */
+int handle_events(Emulator* emu);
+
+#endif
@@ -1,21 +1,194 @@
 #include "io.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "emulator.h"
+#include "emulator_function.h"
+#include "uart.h"
+#include "pit.h"
+#include "pvconsole.h"
 
-uint8_t io_in8(uint16_t address) {
-  switch (address) {
-  case 0x03f8:
-    return getchar();
-  default:
-    return 0;
+/* 未登録のポートは読むと0で、書き込みは無視される */
+static uint32_t unmapped_read(void* context, uint16_t address) {
+  return 0;
+}
+
+static void unmapped_write(void* context, uint16_t address, uint32_t value) {
+}
+
+void init_io(Emulator* emu) {
+  emu->io = calloc(1, sizeof(struct IoPorts));
+  emu->io->devices[0].read8  = unmapped_read;
+  emu->io->devices[0].write8 = unmapped_write;
+  emu->io->device_count = 1;
+
+  /* 0x03f8番からのシリアルポート(COM1)。ホストの標準入出力につなぐ */
+  emu->uart = create_uart(emu, UART_COM1_PORT, STDIN_FILENO);
+
+  /* 0x40番からのタイマー */
+  emu->pit = create_pit(emu);
+
+  /* 0x0500番からの準仮想化コンソール */
+  emu->console = create_pvconsole(emu);
+
+  emu->io->standard_count = emu->io->device_count;
+}
+
+void destroy_io(Emulator* emu) {
+  destroy_pvconsole(emu->console);
+  emu->console = NULL;
+  destroy_pit(emu->pit);
+  emu->pit = NULL;
+  destroy_uart(emu->uart);
+  emu->uart = NULL;
+  free(emu->io);
+  emu->io = NULL;
+}
+
+void reset_io(Emulator* emu) {
+  struct IoPorts* io = emu->io;
+  uint32_t port;
+  int i;
+
+  for(i = 1; i < io->standard_count; i++) {
+    if(io->devices[i].reset != NULL) {
+      io->devices[i].reset(io->devices[i].context);
+    }
+  }
+  /* ブロックデバイスやVGAなどは登録した側が破棄済みなので、表から外す */
+  if(io->device_count > io->standard_count) {
+    for(port = 0; port < 65536; port++) {
+      if(io->port_map[port] >= io->standard_count) {
+        io->port_map[port] = 0;
+      }
+    }
+    io->device_count = io->standard_count;
+  }
+  io->port_writes = 0;
+  memset(&io->poll, 0, sizeof(io->poll));
+}
+
+int io_register(Emulator* emu, uint16_t address, uint32_t count, const IoDevice* device) {
+  struct IoPorts* io = emu->io;
+  uint32_t i;
+
+  if(io->device_count == IO_MAX_DEVICES) {
+    return -1;
+  }
+  io->devices[io->device_count] = *device;
+  /* 8bitの関数は必ず呼べるようにしておく */
+  if(device->read8 == NULL) {
+    io->devices[io->device_count].read8 = unmapped_read;
+  }
+  if(device->write8 == NULL) {
+    io->devices[io->device_count].write8 = unmapped_write;
+  }
+  for(i = 0; i < count && address + i < 65536; i++) {
+    io->port_map[address + i] = io->device_count;
+  }
+  io->device_count++;
+  return 0;
+}
+
+static IoDevice* device_of(Emulator* emu, uint16_t address) {
+  return &emu->io->devices[emu->io->port_map[address]];
+}
+
+/* ゲストが何も変えずに同じポートを読み続けているかを調べる
+ *
+ * 同じ命令から同じポートを読み、前回から汎用レジスタ、EFLAGS、メモリ、
+ * ポートへの出力がどれも変わっておらず、読んだ値も同じであれば、
+ * ゲストはデバイスの状態が変わるまで同じループを回り続けるだけである。
+ * それがIO_IDLE_THRESHOLD回続いたら、デバイスのwait関数でホストのスレッドを眠らせる。
+ *
+ * ただし割り込みが許可されていてイベントが予定されていれば眠らない。
+ * 仮想時間は命令を実行しないと進まないので、眠るとタイマーなどの割り込みがいつまでも届かない
+ */
+static void detect_busy_poll(Emulator* emu, IoDevice* device, uint16_t address, uint32_t value) {
+  IoPollState* poll = &emu->io->poll;
+
+  if(poll->eip == emu->eip && poll->address == address && poll->value == value
+     && poll->eflags == emu->eflags
+     && poll->memory_writes == emu->memory_writes
+     && poll->port_writes == emu->io->port_writes
+     && memcmp(poll->registers, emu->registers, sizeof(poll->registers)) == 0) {
+    if(++poll->count >= IO_IDLE_THRESHOLD) {
+      poll->count = 0;
+      if(!(emu->eflags & INTERRUPT_FLAG) || sched_next_time(emu->sched) == SCHED_NEVER) {
+        device->wait(device->context, address);
+      }
+    }
+    return;
+  }
+
+  poll->eip           = emu->eip;
+  poll->address       = address;
+  poll->value         = value;
+  poll->eflags        = emu->eflags;
+  poll->memory_writes = emu->memory_writes;
+  poll->port_writes   = emu->io->port_writes;
+  poll->count         = 0;
+  memcpy(poll->registers, emu->registers, sizeof(poll->registers));
+}
+
+/* デバイスからreadで読む */
+static uint32_t read_device(Emulator* emu, IoDevice* device, io_read_func_t* read, uint16_t address) {
+  uint32_t value = read(device->context, address);
+
+  if(device->wait != NULL) {
+    detect_busy_poll(emu, device, address, value);
+  }
+  return value;
+}
+
+uint8_t io_in8(Emulator* emu, uint16_t address) {
+  IoDevice* device = device_of(emu, address);
+  return read_device(emu, device, device->read8, address);
+}
+
+uint16_t io_in16(Emulator* emu, uint16_t address) {
+  IoDevice* device = device_of(emu, address);
+  if(device->read16 != NULL) {
+    return read_device(emu, device, device->read16, address);
+  }
+  /* リトルエンディアンで2つのポートから読む */
+  return io_in8(emu, address) | (io_in8(emu, address + 1) << 8);
+}
+
+uint32_t io_in32(Emulator* emu, uint16_t address) {
+  IoDevice* device = device_of(emu, address);
+  if(device->read32 != NULL) {
+    return read_device(emu, device, device->read32, address);
+  }
+  return io_in16(emu, address) | ((uint32_t)io_in16(emu, address + 2) << 16);
+}
+
+void io_out8(Emulator* emu, uint16_t address, uint8_t value) {
+  IoDevice* device = device_of(emu, address);
+  emu->io->port_writes++;
+  device->write8(device->context, address, value);
+}
+
+void io_out16(Emulator* emu, uint16_t address, uint16_t value) {
+  IoDevice* device = device_of(emu, address);
+  emu->io->port_writes++;
+  if(device->write16 != NULL) {
+    device->write16(device->context, address, value);
+    return;
   }
+  io_out8(emu, address, value & 0xff);
+  io_out8(emu, address + 1, value >> 8);
 }
 
-void io_out8(uint16_t address, uint8_t value) {
-  switch(address) {
-  case 0x03f8:
-    putchar(value);
-    break;
+void io_out32(Emulator* emu, uint16_t address, uint32_t value) {
+  IoDevice* device = device_of(emu, address);
+  emu->io->port_writes++;
+  if(device->write32 != NULL) {
+    device->write32(device->context, address, value);
+    return;
   }
+  io_out16(emu, address, value & 0xffff);
+  io_out16(emu, address + 2, value >> 16);
 }
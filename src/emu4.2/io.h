@@ -3,7 +3,96 @@
 
 #include <stdint.h>
 
-uint8_t io_in8(uint16_t address);
-void io_out8(uint16_t address, uint8_t value);
+#include "emulator.h"
+
+/* 登録できるデバイスの最大数(未登録のポート用の0番を含む) */
+#define IO_MAX_DEVICES 256
+
+/* I/Oポートの読み書きを行う関数
+ *
+ * contextには登録時に渡したポインタ、addressには読み書きするポート番号が渡される
+ */
+typedef uint32_t io_read_func_t(void* context, uint16_t address);
+typedef void io_write_func_t(void* context, uint16_t address, uint32_t value);
+
+/* addressを読んだ値が変わりうる状態になるまでスレッドを眠らせる関数 */
+typedef void io_wait_func_t(void* context, uint16_t address);
+
+/* デバイスを作成直後の状態に戻す関数 */
+typedef void io_reset_func_t(void* context);
+
+/* I/Oポートにつながるデバイス
+ *
+ * 16bit, 32bitの読み書き関数がNULLのときは、
+ * 連続するポートに対する8bitの読み書きに分けて処理する
+ */
+typedef struct {
+  io_read_func_t* read8;
+  io_read_func_t* read16;
+  io_read_func_t* read32;
+  io_write_func_t* write8;
+  io_write_func_t* write16;
+  io_write_func_t* write32;
+  /* NULLでなければ、ゲストがこのデバイスをビジーループでポーリングしているときに呼ばれる */
+  io_wait_func_t* wait;
+  /* NULLでなければ、エミュレータをプールへ返すときに呼ばれ、レジスタやFIFOをその場で初期状態に戻す */
+  io_reset_func_t* reset;
+  void* context;
+} IoDevice;
+
+/* 同じ値を読み続けるポーリングが何回続いたらホストのスレッドを眠らせるか */
+#define IO_IDLE_THRESHOLD 64
+
+/* ビジーループの検出に使う、直前にポートを読んだときの状態 */
+typedef struct {
+  uint32_t eip;
+  uint32_t registers[REGISTERS_COUNT];
+  uint32_t eflags;
+  uint32_t memory_writes;
+  uint32_t port_writes;
+  uint32_t value;
+  uint16_t address;
+  uint32_t count;
+} IoPollState;
+
+/* ポート番号からデバイスを引く表 */
+struct IoPorts {
+  /* ポート番号ごとのdevicesの添字(0は未登録) */
+  uint8_t port_map[65536];
+  IoDevice devices[IO_MAX_DEVICES];
+  int device_count;
+  /* init_ioで登録した標準のデバイスの数。これより後のデバイスは登録した側が破棄する */
+  int standard_count;
+
+  /* ポートへの書き込み回数 */
+  uint32_t port_writes;
+  IoPollState poll;
+};
+
+/* エミュレータのI/Oポートの表を作り、標準のデバイスを登録する */
+void init_io(Emulator* emu);
+
+/* I/Oポートの表を破棄する */
+void destroy_io(Emulator* emu);
+
+/* 標準のデバイスをその場で初期状態に戻し、後から登録されたデバイスのポートを未登録に戻す
+ *
+ * エミュレータをプールへ返すときに使う。ポートの表もデバイスも確保したまま使い回す
+ */
+void reset_io(Emulator* emu);
+
+/* addressからcount個のポートにデバイスを登録する
+ *
+ * 同じポートに登録済みのデバイスがあれば置き換える。
+ * 登録できたら0、デバイスの数が上限に達していたら-1を返す
+ */
+int io_register(Emulator* emu, uint16_t address, uint32_t count, const IoDevice* device);
+
+uint8_t io_in8(Emulator* emu, uint16_t address);
+uint16_t io_in16(Emulator* emu, uint16_t address);
+uint32_t io_in32(Emulator* emu, uint16_t address);
+void io_out8(Emulator* emu, uint16_t address, uint8_t value);
+void io_out16(Emulator* emu, uint16_t address, uint16_t value);
+void io_out32(Emulator* emu, uint16_t address, uint32_t value);
 
 #endif
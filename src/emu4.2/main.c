@@ -6,6 +6,21 @@
 #include "emulator.h"
 #include "emulator_function.h"
 #include "instruction.h"
+#include "pool.h"
+#include "decode.h"
+#include "block.h"
+#include "interrupt.h"
+#include "replay.h"
+#include "disk.h"
+#include "vga.h"
+#include "blockdev.h"
+#include "nic.h"
+#include "stats.h"
+#include "symbols.h"
+#include "profile.h"
+#include "callstack.h"
+#include "trace.h"
+#include "heatmap.h"
 
 char* registers_name[] = {
   "EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI"};
@@ -13,10 +28,17 @@ char* registers_name[] = {
 /* メモリは1MB */
 #define MEMORY_SIZE (1024 * 1024)
 
+/* -pでEIPをサンプリングする間隔(エミュレータのスレッドのCPU時間、マイクロ秒) */
+#define PROFILE_INTERVAL_US 250
+
+/* -mでワーキングセットを記録する間隔(命令数) */
+#define HEATMAP_INTERVAL 100000
+
 /* Emulatorのメモリにバイナリファイルの内容を512バイトコピーする */
 /* 機械語ファイルを読み込む(最大512バイト) */
 /* memoryの先頭ではなく0x7c00番地から機械語を配置する */
-static void read_binary(Emulator* emu, const char* filename) {
+/* 読み込んだバイト数を返す */
+static size_t read_binary(Emulator* emu, const char* filename) {
   FILE* binary;
 
   binary = fopen(filename, "rb");
@@ -27,8 +49,20 @@ static void read_binary(Emulator* emu, const char* filename) {
   }
   
   /* Emulatorのメモリにバイナリファイルの内容を512バイトコピーする */
-  fread(emu->memory + 0x7c00, 1, 0x200, binary);
+  size_t size = fread(emu->memory + 0x7c00, 1, 0x200, binary);
+  mark_memory_dirty(emu, 0x7c00, size);
   fclose(binary);
+  return size;
+}
+
+/* ゲストの出力を書き出し終え、エミュレータのメッセージを出せる状態にする */
+/* テキスト画面を描画していれば、最後の変更を描画してカーソルを画面の下へ移す */
+static void finish_output(Emulator* emu) {
+  if(emu->vga != NULL) {
+    destroy_vga(emu->vga);
+    emu->vga = NULL;
+  }
+  output_flush(&emu->output);
 }
 
 /* 汎用時レスタとプログラムカウンタの値を標準出力に出力する */
@@ -44,30 +78,6 @@ static void dump_registers(Emulator* emu) {
   
 }
 
-/* エミュレータを作成する */
-Emulator* create_emu(size_t size, uint32_t eip, uint32_t esp) {
-
-  Emulator* emu = malloc(sizeof(Emulator));
-  emu->memory   = malloc(size);
-
-  /* 汎用レジスタの初期値をすべて0にする */
-  memset(emu->registers, 0, sizeof(emu->registers));
-
-  /* レジスタの初期値を指定されたものにする */
-  emu->eip            = eip;
-  emu->registers[ESP] = esp;
-
-  return emu;
-  
-}
-
-/* エミュレータを破棄する */
-void destroy_emu(Emulator* emu) {
-  free(emu->memory);
-  free(emu);
-}
-
-
 int opt_remove_at(int argc, char* argv[], int index) {
   if(index < 0 || argc <= index) {
     return argc;
@@ -88,8 +98,28 @@ int opt_remove_at(int argc, char* argv[], int index) {
 int main(int argc, char* argv[]) {
 
   Emulator* emu;
+  BlockCache* cache = NULL;
+  size_t binary_size;
   int i;
   int quiet = 0;
+  int headless = 0;
+  int video = 0;
+  int stats = 0;
+  int profile = 0;
+  Symbols* symbols = NULL;
+  const char* folded = NULL;
+  const char* trace_file = NULL;
+  uint32_t trace_flags = 0;
+  Trace* trace = NULL;
+  const char* heatmap_file = NULL;
+  int block_start = 1;
+  Replay* replay = NULL;
+  Disk* disk = NULL;
+  const char* blockdev_image = NULL;
+  BlockDev* blockdev = NULL;
+  const char* nic_spec = NULL;
+  Nic* nic = NULL;
+  const char* sink = NULL;
 
   /* コマンドライン引数のオプションを解析する */
   i = 1;
@@ -98,6 +128,90 @@ int main(int argc, char* argv[]) {
     if(strcmp(argv[i], "-q") == 0) {
       quiet = 1; /* quiet変数に1を設定 */
       argc = opt_remove_at(argc, argv, i); /* -qをargvから削除 */
+    } else if(strcmp(argv[i], "-n") == 0) {
+      /* -nのときは文字色のエスケープシーケンスを出力しない */
+      headless = 1;
+      argc = opt_remove_at(argc, argv, i);
+    } else if((strcmp(argv[i], "-R") == 0 || strcmp(argv[i], "-P") == 0) && i + 1 < argc) {
+      /* -R logfileで入力を記録し、-P logfileで記録した入力を再生する */
+      enum ReplayMode mode = argv[i][1] == 'R' ? REPLAY_RECORD : REPLAY_PLAY;
+      if(replay != NULL) {
+        close_replay(replay);
+      }
+      replay = open_replay(argv[i + 1], mode);
+      if(replay == NULL) {
+        printf("%s ファイルを開けません\n", argv[i + 1]);
+        return 1;
+      }
+      argc = opt_remove_at(argc, argv, i);
+      argc = opt_remove_at(argc, argv, i);
+    } else if(strcmp(argv[i], "-s") == 0) {
+      /* -sのときは命令ごとの実行回数と時間を数え、終了時に表にして出す */
+      stats = 1;
+      argc = opt_remove_at(argc, argv, i);
+    } else if(strcmp(argv[i], "-p") == 0) {
+      /* -pのときはゲストのEIPをサンプリングし、終了時に関数ごとのプロファイルを出す */
+      profile = 1;
+      argc = opt_remove_at(argc, argv, i);
+    } else if(strcmp(argv[i], "-F") == 0 && i + 1 < argc) {
+      /* -F fileで呼び出し文脈ごとの命令数をfolded形式でfileに書く */
+      folded = argv[i + 1];
+      argc = opt_remove_at(argc, argv, i);
+      argc = opt_remove_at(argc, argv, i);
+    } else if((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "-T") == 0) && i + 1 < argc) {
+      /* -t fileで実行した命令をバイナリのトレースに書く。-Tはレジスタの変化も書く(trace.hを参照) */
+      trace_file  = argv[i + 1];
+      trace_flags = argv[i][1] == 'T' ? TRACE_REGISTERS : 0;
+      argc = opt_remove_at(argc, argv, i);
+      argc = opt_remove_at(argc, argv, i);
+    } else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      /* -m fileでメモリの読み書きを数え、ページごとの分布とワーキングセットの推移をfileに書く */
+      heatmap_file = argv[i + 1];
+      argc = opt_remove_at(argc, argv, i);
+      argc = opt_remove_at(argc, argv, i);
+    } else if(strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+      /* -S fileでゲストのシンボルをELFかマップファイルから読む */
+      if(symbols != NULL) {
+        free_symbols(symbols);
+      }
+      symbols = load_symbols(argv[i + 1]);
+      if(symbols == NULL) {
+        printf("%s からシンボルを読めません\n", argv[i + 1]);
+        return 1;
+      }
+      argc = opt_remove_at(argc, argv, i);
+      argc = opt_remove_at(argc, argv, i);
+    } else if(strcmp(argv[i], "-v") == 0) {
+      /* -vのときは0xB8000番地からのテキスト画面を端末に描画する */
+      video = 1;
+      argc = opt_remove_at(argc, argv, i);
+    } else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      /* -o sinkでゲストのシリアル出力の出力先を指定する(output_openを参照) */
+      sink = argv[i + 1];
+      argc = opt_remove_at(argc, argv, i);
+      argc = opt_remove_at(argc, argv, i);
+    } else if(strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      /* -d imageでINT 13hのディスクイメージを指定する */
+      if(disk != NULL) {
+        close_disk(disk);
+      }
+      disk = open_disk(argv[i + 1]);
+      if(disk == NULL) {
+        printf("%s ファイルを開けません\n", argv[i + 1]);
+        return 1;
+      }
+      argc = opt_remove_at(argc, argv, i);
+      argc = opt_remove_at(argc, argv, i);
+    } else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      /* -b imageで非同期のブロックデバイスのイメージを指定する(blockdev.hを参照) */
+      blockdev_image = argv[i + 1];
+      argc = opt_remove_at(argc, argv, i);
+      argc = opt_remove_at(argc, argv, i);
+    } else if(strcmp(argv[i], "-N") == 0 && i + 1 < argc) {
+      /* -N linkでネットワークデバイスの相手を指定する(create_nicを参照) */
+      nic_spec = argv[i + 1];
+      argc = opt_remove_at(argc, argv, i);
+      argc = opt_remove_at(argc, argv, i);
     } else {
       i++;
     }
@@ -105,46 +219,223 @@ int main(int argc, char* argv[]) {
   
   /* コマンドライン引数が一つ指定されていることを確認 */
   if(argc != 2) {
-    printf("usage: x86 filename\n");
+    printf("usage: x86 [-q] [-n] [-s] [-p] [-F folded] [-t trace | -T trace] [-m heatmap] [-S symbols] [-v] [-R logfile | -P logfile] [-d image] [-b image] [-N link] [-o sink] filename\n");
     return 1;
   }
-  
+
+  /* ブロックデバイスの完了割り込みはI/Oスレッドの進み具合で届く時刻が変わり、ログに残せないので再現できない */
+  if(replay != NULL && blockdev_image != NULL) {
+    printf("-R/-Pと-bは同時に指定できません\n");
+    close_replay(replay);
+    return 1;
+  }
+  /* ネットワークデバイスも、受信するパケットの中身と届く時刻が相手次第なので同じ */
+  if(replay != NULL && nic_spec != NULL) {
+    printf("-R/-Pと-Nは同時に指定できません\n");
+    close_replay(replay);
+    return 1;
+  }
+
   /* 命令セットの初期化を行う */
   init_instructions();
+  if(stats) {
+    stats_enable();
+  }
+
+  /* エミュレータのプールを用意する */
+  init_emu_pool(1, MEMORY_SIZE);
 
-  /* EIPが0、ESPが0x7C00の状態のエミュレータを作る */
-  /* 左からメモリ容量、eipの初期値、espの初期値 */
-  emu = create_emu(MEMORY_SIZE, 0x7c00, 0x7c00);  
+  /* EIPが0x7C00、ESPが0x7C00の状態のエミュレータをプールから取り出す */
+  /* 左からeipの初期値、espの初期値 */
+  emu = acquire_emu(0x7c00, 0x7c00);
+  /* エミュレータのトレースやレジスタの表示は、出力先によらず標準出力に出す */
+  if(sink != NULL && output_open(&emu->output, sink) < 0) {
+    printf("%s を出力先にできません\n", sink);
+    release_emu(emu);
+    destroy_emu_pool();
+    return 1;
+  }
+  if(headless) {
+    emu->output.colorless = 1;
+  }
+  emu->replay = replay;
+  emu->disk   = disk;
+  /* ブートセクタと同じく、起動したドライブの番号をDLに渡す */
+  if(disk != NULL) {
+    set_register8(emu, DL, disk->drive);
+  }
+
+  if(blockdev_image != NULL) {
+    blockdev = create_blockdev(emu, blockdev_image);
+    if(blockdev == NULL) {
+      printf("%s ファイルを開けません\n", blockdev_image);
+      release_emu(emu);
+      destroy_emu_pool();
+      return 1;
+    }
+  }
+
+  if(nic_spec != NULL) {
+    nic = create_nic(emu, nic_spec);
+    if(nic == NULL) {
+      printf("%s につなげません\n", nic_spec);
+      if(blockdev != NULL) {
+        destroy_blockdev(blockdev);
+      }
+      release_emu(emu);
+      destroy_emu_pool();
+      return 1;
+    }
+  }
 
   /* 引数で与えられたバイナリを読み込む */
-  read_binary(emu, argv[1]);
+  binary_size = read_binary(emu, argv[1]);
+
+  if(video) {
+    emu->vga = create_vga(emu);
+  }
+
+  if(trace_file != NULL) {
+    trace = open_trace(trace_file, trace_flags, emu);
+    if(trace == NULL) {
+      printf("%s ファイルを開けません\n", trace_file);
+      finish_output(emu);
+      if(nic != NULL) {
+        destroy_nic(nic);
+      }
+      if(blockdev != NULL) {
+        destroy_blockdev(blockdev);
+      }
+      release_emu(emu);
+      destroy_emu_pool();
+      return 1;
+    }
+    emu->trace = trace;
+  }
+
+  /* 1命令ごとに実行したEIPを表示するときは、ブロック単位で実行するわけにはいかない */
+  /* (バイナリのトレースはブロックの中でも1命令ずつ書くので、ブロックで実行してよい) */
+  /* 統計を取るときも、ブロックではinstructions配列を通らない命令があるので1命令ずつ実行する */
+  /* メモリの読み書きを数えるときは、スタックかどうかをESPで分けるため、ブロックの外で実行する
+     (ブロックはレジスタを手元に写して実行するので、途中のemu->registersは古い) */
+  if((quiet || trace != NULL) && !stats && heatmap_file == NULL) {
+    cache = create_block_cache(emu);
+    /* 読み込んだプログラムのブロックを、実行を始める前にまとめてコンパイルさせておく */
+    block_prescan(cache, 0x7c00, binary_size);
+  }
+  if(heatmap_file != NULL) {
+    emu->heatmap = create_heatmap(emu, HEATMAP_INTERVAL);
+    emu->hooks  |= HOOK_HEATMAP;
+  }
+  if(folded != NULL) {
+    emu->callstack = create_callstack(emu->eip, emu->vtime);
+  }
+  if(profile && profile_start(emu, PROFILE_INTERVAL_US) < 0) {
+    printf("プロファイルを開始できません\n");
+  }
 
   while(emu->eip < MEMORY_SIZE) {
+    if(block_start && events_pending(emu)) {
+      /* タイマーの期限や割り込みはブロックの境界でだけ調べる */
+      if(!handle_events(emu)) {
+        finish_output(emu);
+        printf("\n\nhalted. \n\n");
+        break;
+      }
+    }
+
+    /* 分岐の直後はブロックの先頭なので、コンパイル済みのブロックがあればそれを実行する */
+    if(block_start && cache != NULL) {
+      Block* block = find_block(cache, emu->eip);
+      if(block != NULL) {
+        execute_block(emu, block);
+        if(emu->eip == 0) {
+          finish_output(emu);
+          printf("\n\nend of program. \n\n");
+          break;
+        }
+        continue;
+      }
+    }
+
     uint8_t code = get_code8(emu, 0);
     /* 現在のプログラムカウンタと実行されるバイナリを出力する */
-    if(!quiet) {
+    /* バイナリのトレースを取るときは、同じ内容をx86-tracedumpで出せるので出力しない */
+    if(!quiet && trace == NULL) {
       printf("EIP = %X, Code = %02X\n", emu->eip, code);      
     }
+    if(trace != NULL) {
+      trace_instruction(trace, emu, code);
+    }
 
     
     if(instructions[code] == NULL) {
       /* 実装されてない命令が来たらEmulatorを終了する */      
+      finish_output(emu);
       printf("\n\nNot Implemented: %x\n", code);
       break;
     }
     
     /* 命令の実行 */
     instructions[code](emu);
+    emu->vtime++;
+    block_start = opcode_flags[code] & OP_BRANCH;
     
     /* 一つの命令を実行するたびにeipをチェックし、0ならメインループを終了する */
     /* 普通のCPUには終了機能はないが、エミュレータではプログラムの修了時にレジスタの値を表示したいので、明示的に終了させる仕組みが必要 */
     if(emu->eip == 0) {
+      finish_output(emu);
       printf("\n\nend of program. \n\n");
       break;
     }
   }
 
+  profile_stop();
+  if(cache != NULL) {
+    destroy_block_cache(cache);
+  }
+
+  finish_output(emu);
   dump_registers(emu);
-  destroy_emu(emu);
+  stats_dump();
+  profile_dump(symbols);
+  emu->trace = NULL;
+  if(trace != NULL && close_trace(trace) < 0) {
+    printf("%s に書き込めません\n", trace_file);
+  }
+  if(emu->callstack != NULL) {
+    if(callstack_write_folded(emu->callstack, emu->vtime, symbols, folded) < 0) {
+      printf("%s に書き込めません\n", folded);
+    }
+    destroy_callstack(emu->callstack);
+    emu->callstack = NULL;
+  }
+  if(emu->heatmap != NULL) {
+    heatmap_dump(emu->heatmap);
+    if(heatmap_write(emu->heatmap, heatmap_file) < 0) {
+      printf("%s に書き込めません\n", heatmap_file);
+    }
+    emu->hooks  &= ~HOOK_HEATMAP;
+    destroy_heatmap(emu->heatmap);
+    emu->heatmap = NULL;
+  }
+  if(symbols != NULL) {
+    free_symbols(symbols);
+  }
+  if(replay != NULL) {
+    replay_finish(replay, emu->vtime);
+    close_replay(replay);
+  }
+  if(disk != NULL) {
+    close_disk(disk);
+  }
+  if(blockdev != NULL) {
+    destroy_blockdev(blockdev);
+  }
+  if(nic != NULL) {
+    destroy_nic(nic);
+  }
+  release_emu(emu);
+  destroy_emu_pool();
   return 0;  
 }
@@ -5,6 +5,7 @@
 
 #include "modrm.h"
 #include "emulator_function.h"
+#include "decode.h"
 
 /* 機械語からModR/Mを解析する関数 */
 /* エミュレータ内部の状態を格納しているEmulator構造体と、
@@ -14,6 +15,7 @@
  */
 void parse_modrm(Emulator* emu, ModRM* modrm) {
   uint8_t code;
+  uint8_t flags;
 
   memset(modrm, 0, sizeof(ModRM)); // ModRM構造体の全部を0に初期化
 
@@ -26,19 +28,22 @@ void parse_modrm(Emulator* emu, ModRM* modrm) {
   // emu->eipを１バイト進める
   emu->eip += 1;
 
-  // SIBの存在を判定
+  // SIBとディプレースメントの有無はmod,rmの組み合わせで決まるので、
+  // 命令長のデコーダと同じ表(modrm_flags)で判定する
   // ModR/Mの表を見ると、modが11以外であり、かつrmが100であるときにSIBが存在する
-  if(modrm->mod != 3 && modrm->rm == 4) {
+  flags = modrm_flags[code];
+  if(flags & MODRM_SIB) {
     // SIBが存在するなら、読み取ってsibに書き込み、emu->eipを進める
     modrm->sib = get_code8(emu, 0);
     emu->eip += 1;
   }
 
   // ディプレースメントの有無を判定し、ビット幅に応じてdisp8またはdisp32に書き込みeipを進める
-  if((modrm->mod == 0 && modrm->rm == 5) || modrm->mod == 2) {
+  // modが00でrmが101のとき、またはmodが10のときはdisp32
+  if(flags & MODRM_DISP32) {
     modrm->disp32 = get_sign_code32(emu, 0);
     emu->eip += 4;
-  } else if(modrm->mod == 1) {
+  } else if(flags & MODRM_DISP8) {
     modrm->disp8 = get_sign_code8(emu, 0);    
     emu->eip += 1;
   }
@@ -49,6 +54,7 @@ void parse_modrm(Emulator* emu, ModRM* modrm) {
 uint32_t calc_memory_address(Emulator* emu, ModRM* modrm) {
   if(modrm->mod == 0) {
     if(modrm->rm == 4) {
+      output_flush(&emu->output);
       printf("not implemented ModRM mod = 0, rm = 4\n");
       exit(0);
     } else if(modrm->rm == 5) {
@@ -58,6 +64,7 @@ uint32_t calc_memory_address(Emulator* emu, ModRM* modrm) {
     } 
   } else if(modrm->mod == 1) {
     if(modrm->rm == 4) {
+      output_flush(&emu->output);
       printf("ont implemented ModRM mod = 1, rm = 4\n");
       exit(0);
     } else {
@@ -68,12 +75,14 @@ uint32_t calc_memory_address(Emulator* emu, ModRM* modrm) {
     }
   } else if(modrm->mod == 2) {
     if(modrm->rm == 4) {
+      output_flush(&emu->output);
       printf("not implemented ModRM mod = 2, rm = 4\n");
       exit(0);
     } else {
       return get_register32(emu, modrm->rm) + modrm->disp32;
     }
   } else {
+    output_flush(&emu->output);
     printf("not implemented ModRM mod = 3\n");
     exit(0);
   }
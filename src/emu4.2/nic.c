@@ -0,0 +1,687 @@
+#define _GNU_SOURCE
+#include "nic.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "emulator_function.h"
+#include "interrupt.h"
+#include "io.h"
+#include "sched.h"
+
+/* 1回の送受信でまとめて扱う記述子の最大数 */
+#define NIC_BATCH 32
+
+/* 送受信を待っている記述子があるとき、相手を調べる間隔(仮想時間) */
+#define NIC_POLL_INTERVAL 10000
+
+/* ゲストが待っているとき、1回に眠る最大の時間(ミリ秒) */
+#define NIC_WAIT_MS 10
+
+/* 共有メモリのファイルのロックに使うバイト
+ *
+ * SHM_LOCK_ATTACHはつなぐ処理の間だけ排他で持ち、
+ * SHM_LOCK_ALIVEはつないでいる間ずっと共有で持つ(プロセスが終われば自然に外れる)
+ */
+#define SHM_LOCK_ATTACH 0
+#define SHM_LOCK_ALIVE  1
+
+/* 共有メモリの片方向のリングのパケット数 */
+#define SHM_SLOTS 256
+
+enum {
+  LINK_SHM,
+  LINK_SOCKET,
+};
+
+/* 共有メモリのリングの1パケット分 */
+typedef struct {
+  uint32_t length;
+  uint8_t data[NIC_MAX_PACKET];
+} ShmSlot;
+
+/* 片方向の単一生産者・単一消費者のリング
+ *
+ * 生産者はtailだけを、消費者はheadだけを書く。
+ * 互いの書き込みで同じキャッシュラインを奪い合わないよう、別のキャッシュラインに置く
+ */
+typedef struct {
+  _Atomic uint32_t head;
+  uint8_t pad0[CACHE_LINE_SIZE - 4];
+  /* 消費者はtailをfutexで待つ */
+  _Atomic uint32_t tail;
+  /* 消費者がtailを待っていれば1(生産者が起こす) */
+  _Atomic uint32_t waiting;
+  uint8_t pad1[CACHE_LINE_SIZE - 8];
+  ShmSlot slots[SHM_SLOTS];
+} ShmRing;
+
+/* 共有メモリのファイルの中身 */
+/* 先に開いた方がrings[0]へ送りrings[1]から受け取り、後に開いた方はその逆 */
+typedef struct {
+  _Atomic uint32_t attached;
+  uint8_t pad[CACHE_LINE_SIZE - 4];
+  ShmRing rings[2];
+} ShmRegion;
+
+/* 送受信する記述子1つ分 */
+typedef struct {
+  uint32_t desc;
+  uint8_t* data;
+  uint32_t length;
+  uint8_t status;
+} Packet;
+
+struct Nic {
+  Emulator* emu;
+
+  int link;
+  int connected;
+  /* LINK_SOCKETではソケット、LINK_SHMではロックを持っている共有メモリのファイル */
+  int fd;
+  /* LINK_SOCKET */
+  int owned;
+  /* LINK_SHM */
+  ShmRegion* region;
+  ShmRing* tx;
+  ShmRing* rx;
+  char* path;
+
+  uint32_t tx_ring_addr;
+  uint32_t tx_ring_size;
+  uint32_t tx_produced;
+  uint32_t tx_consumed;
+  uint32_t rx_ring_addr;
+  uint32_t rx_ring_size;
+  uint32_t rx_posted;
+  uint32_t rx_filled;
+  uint32_t status;
+  uint32_t control;
+
+  TimerEvent poll_event;
+  int poll_scheduled;
+};
+
+static long futex(_Atomic uint32_t* address, int op, uint32_t value, const struct timespec* timeout) {
+  return syscall(SYS_futex, (uint32_t*)address, op, value, timeout, NULL, 0);
+}
+
+/* 送受信の記述子の完了を知らせる */
+static void notify(Nic* nic, uint32_t bit) {
+  nic->status |= bit;
+  if(nic->control & NIC_CONTROL_IRQ) {
+    raise_irq(nic->emu, NIC_IRQ);
+  }
+}
+
+/* リングのindex番目の記述子を読む。バッファがゲストのメモリに収まらなければNIC_BADREQにする */
+static void read_descriptor(Nic* nic, uint32_t ring_addr, uint32_t ring_size, uint32_t index, Packet* packet) {
+  Emulator* emu = nic->emu;
+  uint32_t buffer;
+
+  packet->desc   = ring_addr + (index & (ring_size - 1)) * NIC_DESC_SIZE;
+  buffer         = get_memory32(emu, packet->desc);
+  packet->length = get_memory8(emu, packet->desc + 4) | (get_memory8(emu, packet->desc + 5) << 8);
+  packet->data   = emu->memory + buffer;
+  packet->status = NIC_OK;
+  if(buffer > emu->memory_size || packet->length > emu->memory_size - buffer) {
+    packet->status = NIC_BADREQ;
+  }
+}
+
+/* packetsを相手へ送り、送れた数を返す(相手に空きがなければ全ては送れない) */
+static int link_send(Nic* nic, Packet* packets, int count) {
+  int i;
+
+  if(!nic->connected) {
+    for(i = 0; i < count; i++) {
+      packets[i].status = NIC_NOLINK;
+    }
+    return count;
+  }
+
+  if(nic->link == LINK_SHM) {
+    ShmRing* ring = nic->tx;
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if(count > (int)(SHM_SLOTS - (tail - head))) {
+      count = SHM_SLOTS - (tail - head);
+    }
+    for(i = 0; i < count; i++) {
+      ShmSlot* slot = &ring->slots[(tail + i) & (SHM_SLOTS - 1)];
+      slot->length = packets[i].length;
+      memcpy(slot->data, packets[i].data, packets[i].length);
+    }
+    if(count > 0) {
+      /* まとめて1回で公開し、待っている相手を1回だけ起こす */
+      atomic_store_explicit(&ring->tail, tail + count, memory_order_seq_cst);
+      if(atomic_load(&ring->waiting)) {
+        futex(&ring->tail, FUTEX_WAKE, 1, NULL);
+      }
+    }
+    return count;
+  } else {
+    /* ゲストのメモリを直接指して、1回のシステムコールでまとめて送る */
+    struct mmsghdr messages[NIC_BATCH];
+    struct iovec iov[NIC_BATCH];
+    int sent;
+
+    memset(messages, 0, sizeof(struct mmsghdr) * count);
+    for(i = 0; i < count; i++) {
+      iov[i].iov_base = packets[i].data;
+      iov[i].iov_len  = packets[i].length;
+      messages[i].msg_hdr.msg_iov    = &iov[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    sent = sendmmsg(nic->fd, messages, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(sent >= 0) {
+      return sent;
+    }
+    if(errno == EAGAIN || errno == EINTR) {
+      return 0;
+    }
+    /* 相手がいなくなった */
+    nic->connected = 0;
+    return link_send(nic, packets, count);
+  }
+}
+
+/* 相手から届いたパケットをpacketsのバッファへ受け取り、受け取った数を返す */
+static int link_receive(Nic* nic, Packet* packets, int count) {
+  int i;
+
+  if(!nic->connected) {
+    return 0;
+  }
+
+  if(nic->link == LINK_SHM) {
+    ShmRing* ring = nic->rx;
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if(count > (int)(tail - head)) {
+      count = tail - head;
+    }
+    for(i = 0; i < count; i++) {
+      ShmSlot* slot = &ring->slots[(head + i) & (SHM_SLOTS - 1)];
+      uint32_t length = slot->length;
+      if(length > packets[i].length) {
+        length = packets[i].length;
+        packets[i].status = NIC_TRUNCATED;
+      }
+      memcpy(packets[i].data, slot->data, length);
+      packets[i].length = length;
+    }
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    return count;
+  } else {
+    /* ゲストの受信バッファへ直接受け取る */
+    struct mmsghdr messages[NIC_BATCH];
+    struct iovec iov[NIC_BATCH];
+    int received;
+
+    memset(messages, 0, sizeof(struct mmsghdr) * count);
+    for(i = 0; i < count; i++) {
+      iov[i].iov_base = packets[i].data;
+      iov[i].iov_len  = packets[i].length;
+      messages[i].msg_hdr.msg_iov    = &iov[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    received = recvmmsg(nic->fd, messages, count, MSG_DONTWAIT, NULL);
+    if(received < 0) {
+      if(errno != EAGAIN && errno != EINTR) {
+        nic->connected = 0;
+      }
+      return 0;
+    }
+    for(i = 0; i < received; i++) {
+      /* 長さ0のパケットは送らないので、0は相手が切断したことを表す */
+      if(messages[i].msg_len == 0) {
+        nic->connected = 0;
+        return i;
+      }
+      packets[i].length = messages[i].msg_len;
+      if(messages[i].msg_hdr.msg_flags & MSG_TRUNC) {
+        packets[i].status = NIC_TRUNCATED;
+      }
+    }
+    return received;
+  }
+}
+
+/* ゲストが書いた送信の記述子を、相手が受け取れるだけ送る */
+static void transmit(Nic* nic) {
+  Emulator* emu = nic->emu;
+  uint32_t done = nic->tx_consumed;
+
+  while(nic->tx_consumed != nic->tx_produced) {
+    Packet packets[NIC_BATCH];
+    int count = 0;
+    int sent, i;
+
+    /* 不正な記述子は、その前までを送った後に単独で完了させる */
+    while(count < NIC_BATCH && nic->tx_consumed + count != nic->tx_produced) {
+      Packet* packet = &packets[count];
+      read_descriptor(nic, nic->tx_ring_addr, nic->tx_ring_size, nic->tx_consumed + count, packet);
+      if(packet->length == 0 || packet->length > NIC_MAX_PACKET) {
+        packet->status = NIC_BADREQ;
+      }
+      if(packet->status != NIC_OK) {
+        if(count == 0) {
+          count = 1;
+        }
+        break;
+      }
+      count++;
+    }
+
+    if(packets[0].status == NIC_BADREQ) {
+      sent = 1;
+    } else {
+      sent = link_send(nic, packets, count);
+    }
+    for(i = 0; i < sent; i++) {
+      set_memory8(emu, packets[i].desc + 6, packets[i].status);
+    }
+    nic->tx_consumed += sent;
+    if(sent < count) {
+      break;
+    }
+  }
+
+  if(nic->tx_consumed != done) {
+    notify(nic, NIC_STATUS_TX);
+  }
+}
+
+/* 届いたパケットを、ゲストが用意した受信の記述子へ受け取る */
+static void receive(Nic* nic) {
+  Emulator* emu = nic->emu;
+  uint32_t done = nic->rx_filled;
+
+  while(nic->rx_filled != nic->rx_posted) {
+    Packet packets[NIC_BATCH];
+    int count = 0;
+    int received, i;
+
+    while(count < NIC_BATCH && nic->rx_filled + count != nic->rx_posted) {
+      Packet* packet = &packets[count];
+      read_descriptor(nic, nic->rx_ring_addr, nic->rx_ring_size, nic->rx_filled + count, packet);
+      /* 長さ0のバッファには受け取れず、recvmmsgの0は切断と区別できないので送信と同じく不正とする */
+      if(packet->length == 0) {
+        packet->status = NIC_BADREQ;
+      }
+      if(packet->status != NIC_OK) {
+        if(count == 0) {
+          count = 1;
+        }
+        break;
+      }
+      count++;
+    }
+
+    if(packets[0].status == NIC_BADREQ) {
+      received = 1;
+    } else {
+      received = link_receive(nic, packets, count);
+    }
+    for(i = 0; i < received; i++) {
+      Packet* packet = &packets[i];
+      if(packet->status != NIC_BADREQ) {
+        uint32_t buffer = packet->data - emu->memory;
+        mark_memory_dirty(emu, buffer, packet->length);
+        set_memory8(emu, packet->desc + 4, packet->length & 0xff);
+        set_memory8(emu, packet->desc + 5, packet->length >> 8);
+      }
+      set_memory8(emu, packet->desc + 6, packet->status);
+    }
+    nic->rx_filled += received;
+    if(received < count) {
+      break;
+    }
+  }
+
+  if(nic->rx_filled != done) {
+    notify(nic, NIC_STATUS_RX);
+  }
+}
+
+/* 送り残しがあるか、受信の記述子が用意されていれば、相手を待つ必要がある */
+static int waiting_for_link(Nic* nic) {
+  return nic->connected && (nic->tx_consumed != nic->tx_produced || nic->rx_filled != nic->rx_posted);
+}
+
+/* 相手がパケットを送ってくるか、送信の空きができるまで最大NIC_WAIT_MSだけ眠る */
+static void wait_link(Nic* nic) {
+  int tx_blocked = nic->tx_consumed != nic->tx_produced;
+  int rx_waiting = nic->rx_filled != nic->rx_posted;
+
+  output_flush(&nic->emu->output);
+  if(nic->link == LINK_SHM) {
+    struct timespec timeout = { 0, NIC_WAIT_MS * 1000000L };
+
+    if(rx_waiting) {
+      ShmRing* ring = nic->rx;
+      uint32_t tail = atomic_load(&ring->tail);
+
+      atomic_store(&ring->waiting, 1);
+      if(tail == atomic_load_explicit(&ring->head, memory_order_relaxed)) {
+        futex(&ring->tail, FUTEX_WAIT, tail, &timeout);
+      }
+      atomic_store(&ring->waiting, 0);
+    } else if(tx_blocked) {
+      /* 相手のheadは待てないので、少しずつ眠って空きを調べる */
+      timeout.tv_nsec = 100000;
+      nanosleep(&timeout, NULL);
+    }
+  } else {
+    struct pollfd pfd = { .fd = nic->fd };
+
+    pfd.events = (rx_waiting ? POLLIN : 0) | (tx_blocked ? POLLOUT : 0);
+    poll(&pfd, 1, NIC_WAIT_MS);
+  }
+}
+
+static void schedule_poll(Nic* nic);
+
+static void nic_poll(void* context) {
+  Nic* nic = context;
+
+  nic->poll_scheduled = 0;
+  /* hltで止まっているゲストは割り込みを待っているだけなので、ここで相手を待ってよい */
+  /* ほかのイベントが予定されていれば、先にその割り込みを届けるため待たない */
+  if(nic->emu->halted && waiting_for_link(nic) && sched_next_time(nic->emu->sched) == SCHED_NEVER) {
+    wait_link(nic);
+  }
+  transmit(nic);
+  receive(nic);
+  schedule_poll(nic);
+}
+
+/* 送受信を待っている記述子があれば、しばらく後に相手を調べる */
+static void schedule_poll(Nic* nic) {
+  if(waiting_for_link(nic) && !nic->poll_scheduled) {
+    nic->poll_scheduled = 1;
+    sched_add(nic->emu->sched, &nic->poll_event, nic->emu->vtime + NIC_POLL_INTERVAL, nic_poll, nic);
+  }
+}
+
+/* 2のべき乗に切り下げる */
+static uint32_t ring_size_of(uint32_t value) {
+  return value == 0 ? 0 : 1u << (31 - __builtin_clz(value));
+}
+
+static uint32_t nic_read(void* context, uint16_t address) {
+  Nic* nic = context;
+
+  switch(address) {
+  case NIC_TX_RING_ADDR:
+    return nic->tx_ring_addr;
+  case NIC_TX_RING_SIZE:
+    return nic->tx_ring_size;
+  case NIC_TX_DOORBELL:
+    transmit(nic);
+    return nic->tx_consumed;
+  case NIC_RX_RING_ADDR:
+    return nic->rx_ring_addr;
+  case NIC_RX_RING_SIZE:
+    return nic->rx_ring_size;
+  case NIC_RX_DOORBELL:
+    receive(nic);
+    return nic->rx_filled;
+  case NIC_STATUS:
+    transmit(nic);
+    receive(nic);
+    return nic->status;
+  case NIC_CONTROL:
+    return nic->control;
+  case NIC_LINK:
+    return nic->connected;
+  default:
+    return 0;
+  }
+}
+
+static void nic_write(void* context, uint16_t address, uint32_t value) {
+  Nic* nic = context;
+
+  switch(address) {
+  case NIC_TX_RING_ADDR:
+    nic->tx_ring_addr = value;
+    break;
+  case NIC_TX_RING_SIZE:
+    nic->tx_ring_size = ring_size_of(value);
+    break;
+  case NIC_TX_DOORBELL:
+    if(nic->tx_ring_size == 0) {
+      break;
+    }
+    nic->tx_produced = value;
+    transmit(nic);
+    schedule_poll(nic);
+    break;
+  case NIC_RX_RING_ADDR:
+    nic->rx_ring_addr = value;
+    break;
+  case NIC_RX_RING_SIZE:
+    nic->rx_ring_size = ring_size_of(value);
+    break;
+  case NIC_RX_DOORBELL:
+    if(nic->rx_ring_size == 0) {
+      break;
+    }
+    nic->rx_posted = value;
+    receive(nic);
+    schedule_poll(nic);
+    break;
+  case NIC_STATUS:
+    nic->status &= ~value;
+    break;
+  case NIC_CONTROL:
+    nic->control = value;
+    break;
+  }
+}
+
+/* ゲストがポーリングのループに入ったときに呼ばれる */
+/* 送受信の完了を待っているなら、相手が動くまで眠る */
+static void nic_wait(void* context, uint16_t address) {
+  Nic* nic = context;
+
+  switch(address) {
+  case NIC_TX_DOORBELL:
+  case NIC_RX_DOORBELL:
+  case NIC_STATUS:
+    if(waiting_for_link(nic)) {
+      wait_link(nic);
+    }
+    break;
+  }
+}
+
+/* pathのファイルを共有メモリとして開き、空いている側につなぐ */
+/* fdのoffsetの1バイトにOFDロックを掛ける(typeがF_UNLCKなら外す) */
+static int lock_byte(int fd, int cmd, short type, off_t offset) {
+  struct flock lock = {
+    .l_type   = type,
+    .l_whence = SEEK_SET,
+    .l_start  = offset,
+    .l_len    = 1,
+  };
+  return fcntl(fd, cmd, &lock);
+}
+
+/* 前の実行が残したリングを空にし、誰もつながっていない状態に戻す */
+static void reset_region(ShmRegion* region) {
+  int i;
+
+  atomic_store(&region->attached, 0);
+  for(i = 0; i < 2; i++) {
+    atomic_store(&region->rings[i].head, 0);
+    atomic_store(&region->rings[i].tail, 0);
+    atomic_store(&region->rings[i].waiting, 0);
+  }
+}
+
+static int open_shm(Nic* nic, const char* path) {
+  ShmRegion* region;
+  uint32_t side;
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+  if(fd < 0) {
+    return -1;
+  }
+  /* 同時に開いた相手と、残ったファイルの片付けやattachedの読み書きが重ならないようにする */
+  if(lock_byte(fd, F_OFD_SETLKW, F_WRLCK, SHM_LOCK_ATTACH) < 0) {
+    close(fd);
+    return -1;
+  }
+  /* 先に開いた方が大きさを決める。作ったばかりのファイルは0で埋まっていて、空のリングになる */
+  if(ftruncate(fd, sizeof(ShmRegion)) < 0) {
+    close(fd);
+    return -1;
+  }
+  region = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(region == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  /* 生きている相手がいなければ、異常終了した実行が残したファイルかもしれないので初めからにする */
+  if(lock_byte(fd, F_OFD_SETLK, F_WRLCK, SHM_LOCK_ALIVE) == 0) {
+    reset_region(region);
+  }
+  /* つないでいる間は共有のロックを持ち、後から開いた相手に生きていることを知らせる */
+  if(lock_byte(fd, F_OFD_SETLK, F_RDLCK, SHM_LOCK_ALIVE) < 0) {
+    munmap(region, sizeof(ShmRegion));
+    close(fd);
+    return -1;
+  }
+
+  side = atomic_fetch_add(&region->attached, 1);
+  if(side > 1) {
+    /* 既に2つのエミュレータがつながっている */
+    atomic_fetch_sub(&region->attached, 1);
+    munmap(region, sizeof(ShmRegion));
+    close(fd);
+    return -1;
+  }
+  lock_byte(fd, F_OFD_SETLK, F_UNLCK, SHM_LOCK_ATTACH);
+
+  nic->link   = LINK_SHM;
+  nic->fd     = fd;
+  nic->region = region;
+  nic->tx     = &region->rings[side];
+  nic->rx     = &region->rings[1 - side];
+  nic->path   = strdup(path);
+  return 0;
+}
+
+/* pathのソケットに接続する。誰も待っていなければpathで相手を待つ */
+static int open_unix(Nic* nic, const char* path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int fd, listener;
+
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if(fd < 0) {
+    return -1;
+  }
+  if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    nic->fd = fd;
+    return 0;
+  }
+  close(fd);
+  if(errno != ENOENT && errno != ECONNREFUSED) {
+    return -1;
+  }
+
+  /* 前の実行で残ったソケットのファイルがあれば消してから待つ */
+  listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  unlink(path);
+  if(listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0) {
+    if(listener >= 0) {
+      close(listener);
+    }
+    return -1;
+  }
+  fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+  close(listener);
+  unlink(path);
+  if(fd < 0) {
+    return -1;
+  }
+  nic->fd = fd;
+  return 0;
+}
+
+Nic* create_nic(Emulator* emu, const char* spec) {
+  Nic* nic = calloc(1, sizeof(Nic));
+  int result = -1;
+  IoDevice device = {
+    .read32  = nic_read,
+    .write32 = nic_write,
+    .wait    = nic_wait,
+  };
+
+  nic->emu  = emu;
+  nic->fd   = -1;
+  nic->link = LINK_SOCKET;
+  if(strncmp(spec, "shm:", 4) == 0) {
+    result = open_shm(nic, spec + 4);
+  } else if(strncmp(spec, "unix:", 5) == 0) {
+    result = open_unix(nic, spec + 5);
+    nic->owned = 1;
+  } else if(strncmp(spec, "fd:", 3) == 0) {
+    char* end;
+    long n = strtol(spec + 3, &end, 10);
+    if(*end == '\0' && end != spec + 3 && n >= 0 && fcntl(n, F_GETFD) >= 0) {
+      nic->fd = n;
+      result  = 0;
+    }
+  }
+  if(result < 0) {
+    free(nic);
+    return NULL;
+  }
+  nic->connected = 1;
+
+  device.context = nic;
+  io_register(emu, NIC_PORT, 36, &device);
+  return nic;
+}
+
+void destroy_nic(Nic* nic) {
+  if(nic->poll_scheduled) {
+    sched_cancel(nic->emu->sched, &nic->poll_event);
+  }
+  if(nic->link == LINK_SHM) {
+    /* 最後に離れた方がファイルを消す */
+    if(atomic_fetch_sub(&nic->region->attached, 1) == 1) {
+      unlink(nic->path);
+    }
+    munmap(nic->region, sizeof(ShmRegion));
+    /* 閉じるとロックも外れる */
+    close(nic->fd);
+    free(nic->path);
+  } else if(nic->owned) {
+    close(nic->fd);
+  }
+  free(nic);
+}
@@ -0,0 +1,74 @@
+#ifndef NIC_H_
+#define NIC_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* 同じホストのエミュレータどうしをつなぐネットワークデバイス
+ *
+ * ゲストはメモリ上に送信と受信の記述子のリングを置き、ドアベルのポートに
+ * 書き込んだ記述子の数(通し番号)を書く。パケットはまとめて相手へ渡し、
+ * 記述子のstatusを書き換えて完了を知らせる。
+ * 相手とは共有メモリのリング(shm:path)か、UNIXドメインソケット(unix:path, fd:N)でつながる。
+ * 受信するパケットと仮想時刻は相手次第なので、-R/-Pの記録や再生とは併用できない
+ */
+
+/* I/Oポート(どれも32bitで読み書きする) */
+#define NIC_PORT         0x0700
+#define NIC_TX_RING_ADDR (NIC_PORT + 0)  /* 送信の記述子のリングの番地 */
+#define NIC_TX_RING_SIZE (NIC_PORT + 4)  /* 送信のリングの記述子の数(2のべき乗) */
+#define NIC_TX_DOORBELL  (NIC_PORT + 8)  /* 書き込んだ送信の記述子の通し番号。読むと送り終えた数 */
+#define NIC_RX_RING_ADDR (NIC_PORT + 12) /* 受信の記述子のリングの番地 */
+#define NIC_RX_RING_SIZE (NIC_PORT + 16) /* 受信のリングの記述子の数(2のべき乗) */
+#define NIC_RX_DOORBELL  (NIC_PORT + 20) /* 用意した受信の記述子の通し番号。読むと受信した数 */
+#define NIC_STATUS       (NIC_PORT + 24) /* 読むと状態ビット。1を書いたビットをクリアする */
+#define NIC_CONTROL      (NIC_PORT + 28) /* 制御ビット */
+#define NIC_LINK         (NIC_PORT + 32) /* 相手とつながっていれば1 */
+
+/* NIC_STATUSのビット */
+#define NIC_STATUS_TX 1 /* 前回クリアしてから送り終えた記述子がある */
+#define NIC_STATUS_RX 2 /* 前回クリアしてから受信した記述子がある */
+
+/* NIC_CONTROLのビット */
+#define NIC_CONTROL_IRQ 1 /* 送受信が完了したらNIC_IRQの割り込みを出す */
+
+/* 送受信の完了を知らせる割り込み要求 */
+#define NIC_IRQ 6
+
+/* 記述子(8バイト)
+ *
+ * +0  buffer  パケットを置くゲストのメモリの番地(32bit)
+ * +4  length  送信ではパケットの長さ、受信では用意したバッファの長さ。
+ *             受信が完了するとパケットの長さに書き換わる(16bit)
+ * +6  status  ゲストがNIC_PENDINGにしておき、完了するとホストが結果を書く
+ * +7  予約
+ */
+#define NIC_DESC_SIZE 8
+
+enum {
+  NIC_OK        = 0x00,
+  NIC_NOLINK    = 0x01, /* 相手がいないので送れなかった */
+  NIC_BADREQ    = 0x02,
+  NIC_TRUNCATED = 0x03, /* バッファに収まらなかった分を捨てた */
+  NIC_PENDING   = 0xff,
+};
+
+/* 1つのパケットの最大の長さ */
+#define NIC_MAX_PACKET 2048
+
+typedef struct Nic Nic;
+
+/* specで指定した相手とつなぎ、NIC_PORTから登録する
+ *
+ * "shm:path"  pathのファイルを共有メモリにする。先に開いた方と後に開いた方がつながる
+ * "unix:path" pathのソケットに接続する。誰も待っていなければpathで相手の接続を待つ
+ * "fd:N"      継承したSOCK_SEQPACKETのソケット(socketpairの片方など)を使う
+ *
+ * つなげなければNULLを返す
+ */
+Nic* create_nic(Emulator* emu, const char* spec);
+
+void destroy_nic(Nic* nic);
+
+#endif
@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include "output.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+/* 出力が続いている間、書き出し用のスレッドが起こされなくても書き出す間隔 */
+#define OUTPUT_WRITER_INTERVAL_NS 1000000
+
+/* writer_waitingの値 */
+enum {
+  WRITER_BUSY,  /* 書き出し中 */
+  WRITER_POLL,  /* OUTPUT_WRITER_INTERVAL_NSだけ眠っている */
+  WRITER_SLEEP, /* 起こされるまで眠っている */
+};
+
+void output_init(OutputBuffer* out, int fd) {
+  pthread_condattr_t attr;
+
+  atomic_init(&out->head, 0);
+  atomic_init(&out->tail, 0);
+  out->head_cache = 0;
+  out->fd    = fd;
+  out->owned = 0;
+  out->color = -1;
+  out->colorless = 0;
+  /* ファイルやパイプへはバッファの半分がたまるまで書き出し用のスレッドを起こさず、writevの回数を減らす */
+  out->line_buffered = fd == STDOUT_FILENO || isatty(fd);
+
+  pthread_mutex_init(&out->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&out->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  atomic_init(&out->writer_waiting, 0);
+  atomic_init(&out->producer_waiting, 0);
+  atomic_init(&out->kicked, 0);
+  atomic_init(&out->stop, 0);
+  out->started = 0;
+}
+
+int output_open(OutputBuffer* out, const char* spec) {
+  int fd;
+
+  if(strcmp(spec, "-") == 0) {
+    fd = STDOUT_FILENO;
+  } else if(strcmp(spec, "null") == 0) {
+    fd = -1;
+  } else if(strcmp(spec, "memfd") == 0) {
+    fd = memfd_create("x86-output", MFD_CLOEXEC);
+    if(fd < 0) {
+      return -1;
+    }
+  } else if(strncmp(spec, "fd:", 3) == 0) {
+    char* end;
+    long n = strtol(spec + 3, &end, 10);
+    if(*end != '\0' || end == spec + 3 || n < 0 || fcntl(n, F_GETFD) < 0) {
+      return -1;
+    }
+    fd = n;
+  } else {
+    fd = open(spec, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+      return -1;
+    }
+  }
+
+  output_close(out);
+  output_init(out, fd);
+  out->owned = fd >= 0 && fd != STDOUT_FILENO && strncmp(spec, "fd:", 3) != 0;
+  if(fd < 0) {
+    /* 誰も読まないので、文字色のエスケープシーケンスも作らない */
+    out->colorless     = 1;
+    out->line_buffered = 0;
+  }
+  return 0;
+}
+
+void output_close(OutputBuffer* out) {
+  output_flush(out);
+  if(out->started) {
+    pthread_mutex_lock(&out->lock);
+    atomic_store(&out->stop, 1);
+    pthread_cond_broadcast(&out->cond);
+    pthread_mutex_unlock(&out->lock);
+    pthread_join(out->thread, NULL);
+  }
+  pthread_mutex_destroy(&out->lock);
+  pthread_cond_destroy(&out->cond);
+  if(out->owned) {
+    close(out->fd);
+  }
+  output_init(out, STDOUT_FILENO);
+}
+
+/* リングバッファのheadからtailまでを書き出す */
+static void write_range(OutputBuffer* out, uint32_t head, uint32_t tail) {
+  while(head != tail) {
+    struct iovec iov[2];
+    int iovcnt = 1;
+    uint32_t start = head & (OUTPUT_BUFFER_SIZE - 1);
+    uint32_t size  = tail - head;
+    ssize_t written;
+
+    /* リングバッファの末尾で折り返しているときは2つに分けて渡す */
+    iov[0].iov_base = out->buffer + start;
+    if(start + size > OUTPUT_BUFFER_SIZE) {
+      iov[0].iov_len  = OUTPUT_BUFFER_SIZE - start;
+      iov[1].iov_base = out->buffer;
+      iov[1].iov_len  = size - iov[0].iov_len;
+      iovcnt = 2;
+    } else {
+      iov[0].iov_len = size;
+    }
+
+    written = writev(out->fd, iov, iovcnt);
+    if(written < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      /* 書き出せないデータは捨てる */
+      break;
+    }
+    head += written;
+  }
+}
+
+/* 待っている相手を起こす(書き出し用のスレッドとエミュレータのスレッドは同じcondで待つ) */
+static void wake(OutputBuffer* out) {
+  pthread_mutex_lock(&out->lock);
+  pthread_cond_broadcast(&out->cond);
+  pthread_mutex_unlock(&out->lock);
+}
+
+/* 書き出し用のスレッド
+ *
+ * 起こされるたびに、その時点でたまっているデータをまとめて書き出す。
+ * 書き出した後もしばらくはOUTPUT_WRITER_INTERVAL_NSごとに目を覚まして続きを拾うので、
+ * 出力が続いている間はエミュレータのスレッドが改行のたびに起こす(futexを呼ぶ)必要はない
+ */
+static void* writer_thread(void* arg) {
+  OutputBuffer* out = arg;
+  int stop = 0;
+  int idle = 1;
+
+  while(!stop) {
+    uint32_t head, tail;
+
+    pthread_mutex_lock(&out->lock);
+    if(idle) {
+      atomic_store(&out->writer_waiting, WRITER_SLEEP);
+      while(!atomic_load(&out->kicked) && !atomic_load(&out->stop)) {
+        pthread_cond_wait(&out->cond, &out->lock);
+      }
+    } else if(!atomic_load(&out->kicked) && !atomic_load(&out->stop)) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_nsec += OUTPUT_WRITER_INTERVAL_NS;
+      if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      atomic_store(&out->writer_waiting, WRITER_POLL);
+      pthread_cond_timedwait(&out->cond, &out->lock, &deadline);
+    }
+    atomic_store(&out->writer_waiting, WRITER_BUSY);
+    atomic_store(&out->kicked, 0);
+    stop = atomic_load(&out->stop);
+    pthread_mutex_unlock(&out->lock);
+
+    head = atomic_load_explicit(&out->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&out->tail, memory_order_acquire);
+    /* 何もたまっていなければ出力が途切れたので、次は起こされるまで眠る */
+    idle = head == tail;
+    /* エミュレータ自身がprintfで出したメッセージと順番が入れ替わらないよう、先に書き出しておく */
+    if(!idle && out->fd == STDOUT_FILENO) {
+      fflush(stdout);
+    }
+    write_range(out, head, tail);
+    atomic_store(&out->head, tail);
+    if(atomic_load(&out->producer_waiting)) {
+      wake(out);
+    }
+  }
+  return NULL;
+}
+
+void output_kick(OutputBuffer* out, int urgent) {
+  int waiting;
+
+  if(out->fd < 0) {
+    /* 誰も読まないので、スレッドを作らずにその場で捨てる */
+    uint32_t tail = atomic_load_explicit(&out->tail, memory_order_relaxed);
+    atomic_store_explicit(&out->head, tail, memory_order_relaxed);
+    out->head_cache = tail;
+    return;
+  }
+  if(!out->started) {
+    out->started = 1;
+    pthread_create(&out->thread, NULL, writer_thread, out);
+  }
+  atomic_store(&out->kicked, 1);
+  /* 短い間隔で目を覚ましているスレッドは、急ぎでなければ起こさなくても拾ってくれる */
+  waiting = atomic_load(&out->writer_waiting);
+  if(waiting == WRITER_SLEEP || (urgent && waiting == WRITER_POLL)) {
+    wake(out);
+  }
+}
+
+/* 書き出していないデータがlimitバイト以下になるまで、書き出し用のスレッドを待つ */
+static void wait_writer(OutputBuffer* out, uint32_t limit) {
+  pthread_mutex_lock(&out->lock);
+  atomic_store(&out->producer_waiting, 1);
+  while(atomic_load(&out->tail) - atomic_load(&out->head) > limit) {
+    pthread_cond_wait(&out->cond, &out->lock);
+  }
+  atomic_store(&out->producer_waiting, 0);
+  pthread_mutex_unlock(&out->lock);
+  out->head_cache = atomic_load_explicit(&out->head, memory_order_acquire);
+}
+
+void output_wait_space(OutputBuffer* out) {
+  uint32_t tail = atomic_load_explicit(&out->tail, memory_order_relaxed);
+
+  out->head_cache = atomic_load_explicit(&out->head, memory_order_acquire);
+  if(tail - out->head_cache < OUTPUT_BUFFER_SIZE) {
+    return;
+  }
+  output_kick(out, 1);
+  if(out->fd >= 0) {
+    /* 少しずつ空くたびに起こされないよう、半分まで空くのを待つ */
+    wait_writer(out, OUTPUT_BUFFER_SIZE / 2);
+  }
+}
+
+void output_drain(OutputBuffer* out) {
+  uint32_t tail = atomic_load_explicit(&out->tail, memory_order_relaxed);
+
+  if(atomic_load_explicit(&out->head, memory_order_acquire) == tail) {
+    return;
+  }
+  if(out->started || out->fd < 0) {
+    output_kick(out, 1);
+    if(out->fd >= 0) {
+      wait_writer(out, 0);
+    }
+    return;
+  }
+
+  /* 書き出し用のスレッドを起こすほどの出力がなかったので、このスレッドで書き出す */
+  if(out->fd == STDOUT_FILENO) {
+    fflush(stdout);
+  }
+  write_range(out, atomic_load_explicit(&out->head, memory_order_relaxed), tail);
+  atomic_store_explicit(&out->head, tail, memory_order_relaxed);
+  out->head_cache = tail;
+}
+
+void output_reset_color(OutputBuffer* out) {
+  if(out->color >= 0) {
+    out->color = -1;
+    output_write(out, "\x1b[0m", 4);
+  }
+}
+
+void output_flush(OutputBuffer* out) {
+  output_reset_color(out);
+  output_drain(out);
+}
+
+void output_write(OutputBuffer* out, const void* data, size_t n) {
+  const uint8_t* p = data;
+  int newline = out->line_buffered && memchr(data, '\n', n) != NULL;
+
+  /* バッファより大きいデータも、空きができるのを待ちながら少しずつ書き出し用のスレッドに渡す */
+  while(n > 0) {
+    uint32_t tail  = atomic_load_explicit(&out->tail, memory_order_relaxed);
+    uint32_t start = tail & (OUTPUT_BUFFER_SIZE - 1);
+    size_t chunk;
+
+    if(tail - out->head_cache == OUTPUT_BUFFER_SIZE) {
+      output_wait_space(out);
+    }
+    /* 空きとリングバッファの末尾までの短い方ずつコピーする */
+    chunk = OUTPUT_BUFFER_SIZE - (tail - out->head_cache);
+    if(chunk > OUTPUT_BUFFER_SIZE - start) {
+      chunk = OUTPUT_BUFFER_SIZE - start;
+    }
+    if(chunk > n) {
+      chunk = n;
+    }
+    memcpy(out->buffer + start, p, chunk);
+    atomic_store_explicit(&out->tail, tail + chunk, memory_order_release);
+    p += chunk;
+    n -= chunk;
+    /* バッファの半分の境界を越えたら、急いで書き出し用のスレッドを起こす */
+    if(((tail ^ (tail + chunk)) & ~(OUTPUT_BUFFER_SIZE / 2 - 1)) != 0) {
+      output_kick(out, 1);
+    }
+  }
+  if(newline) {
+    output_kick(out, 0);
+  }
+}
@@ -0,0 +1,116 @@
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* 出力バッファのバイト数(2のべき乗) */
+#define OUTPUT_BUFFER_SIZE 65536
+
+/* ゲストが出力した文字をためておくリングバッファ
+ *
+ * エミュレータのスレッドが書き込み、書き出し用のスレッドがwritevで出力先へ書き出す
+ * 単一生産者・単一消費者のキュー。ポートへの1バイトの出力はバッファへのストア1回で済み、
+ * エミュレータのスレッドはwriteを呼ばない。
+ * 書き出し用のスレッドは、改行(行バッファリング時のみ)かバッファの半分がたまったときに起こす。
+ * 起こすまではスレッドを作らず、短いプログラムの出力は終了時にエミュレータのスレッドで書き出す
+ */
+typedef struct {
+  uint8_t buffer[OUTPUT_BUFFER_SIZE];
+  /* headからtailまでがまだ書き出していないデータ(添字はOUTPUT_BUFFER_SIZEで割った余り) */
+  /* tailはエミュレータのスレッドだけが、headは書き出し用のスレッドだけが書き換える */
+  _Atomic uint32_t tail;
+  /* エミュレータのスレッドが最後に読んだhead。これだけ空きがあるうちはheadを読みに行かない */
+  uint32_t head_cache;
+  /* 書き出し先のファイルディスクリプタ。-1なら捨てる */
+  int fd;
+  /* 1ならfdを自分で開いたので、output_closeで閉じる */
+  int owned;
+  /* 1なら改行のたびに書き出す(端末や、エミュレータのメッセージと同じ標準出力のとき) */
+  int line_buffered;
+
+  /* 端末に最後に設定した文字色(BIOSの色番号)。リセット済みなら-1 */
+  int color;
+  /* 1なら色を付けない(ヘッドレスモード) */
+  int colorless;
+
+  /* 書き出し用のスレッドが書き換えるheadは、tailと別のキャッシュラインに置く */
+  _Atomic uint32_t head __attribute__((aligned(64)));
+
+  /* 相手を待つときだけ使うmutexとcond */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  /* 書き出し用のスレッドが眠っているか(output.cのWRITER_*) */
+  atomic_int writer_waiting;
+  /* エミュレータのスレッドが空きを待っていれば1 */
+  atomic_int producer_waiting;
+  /* 書き出し用のスレッドに書き出しを頼んだら1 */
+  atomic_int kicked;
+  atomic_int stop;
+  int started;
+  pthread_t thread;
+} OutputBuffer;
+
+/* 出力バッファをfdへ書き出すように初期化する */
+void output_init(OutputBuffer* out, int fd);
+
+/* 出力先をspecで指定したものに切り替える
+ *
+ * "-"        標準出力
+ * "null"     捨てる(書き出しも文字色のエスケープシーケンスの生成もしない)
+ * "memfd"    memfd_createで作った無名のメモリファイル(同じプロセスでout->fdから読む)
+ * "fd:N"     開いているファイルディスクリプタN(パイプやソケットなど。閉じない)
+ * それ以外   ファイル名(作成または切り詰めて開く)
+ *
+ * 切り替えられたら0、開けなければ-1を返す(そのときは元の出力先のまま)
+ */
+int output_open(OutputBuffer* out, const char* spec);
+
+/* たまっているデータを書き出し、自分で開いた出力先なら閉じて標準出力に戻す */
+void output_close(OutputBuffer* out);
+
+/* リングバッファの中身を全て書き出し終えるまで待つ(文字色はそのまま) */
+void output_drain(OutputBuffer* out);
+
+/* 書き出し用のスレッドに書き出しを頼み、待たずに戻る
+ *
+ * urgentが0なら、書き出し用のスレッドが短い間隔で目を覚ましている間は起こさずに任せる
+ * (改行のたびの依頼など、1ミリ秒程度遅れてもよいもの)
+ */
+void output_kick(OutputBuffer* out, int urgent);
+
+/* バッファが一杯のとき、空きができるまで待つ */
+void output_wait_space(OutputBuffer* out);
+
+/* 1バイト出力する */
+/* ポートへの出力のたびに呼ばれるので、関数呼び出しを省けるようヘッダに置く */
+static inline void output_put8(OutputBuffer* out, uint8_t value) {
+  uint32_t tail = atomic_load_explicit(&out->tail, memory_order_relaxed);
+
+  if(tail - out->head_cache == OUTPUT_BUFFER_SIZE) {
+    output_wait_space(out);
+  }
+  out->buffer[tail & (OUTPUT_BUFFER_SIZE - 1)] = value;
+  atomic_store_explicit(&out->tail, tail + 1, memory_order_release);
+  if(((tail + 1) & (OUTPUT_BUFFER_SIZE / 2 - 1)) == 0) {
+    output_kick(out, 1);
+  } else if(value == '\n' && out->line_buffered) {
+    output_kick(out, 0);
+  }
+}
+
+/* nバイト出力する */
+void output_write(OutputBuffer* out, const void* data, size_t n);
+
+/* 文字色が設定されていれば、リセットのエスケープシーケンスを出力する */
+void output_reset_color(OutputBuffer* out);
+
+/* たまっているデータを全て書き出す
+ *
+ * 続けてエミュレータ自身のメッセージが出力されてもよいよう、文字色もリセットする
+ */
+void output_flush(OutputBuffer* out);
+
+#endif
@@ -0,0 +1,221 @@
+#include "pit.h"
+
+#include <stdlib.h>
+
+#include "io.h"
+#include "sched.h"
+#include "interrupt.h"
+
+/* カウンタの読み書きの方法(モードレジスタの4,5ビット目) */
+enum {
+  PIT_ACCESS_LATCH = 0,
+  PIT_ACCESS_LOW   = 1,
+  PIT_ACCESS_HIGH  = 2,
+  PIT_ACCESS_WORD  = 3, /* 下位バイト、上位バイトの順 */
+};
+
+typedef struct {
+  Pit* pit;
+  int index;
+
+  /* 初期値(0は65536を表す) */
+  uint16_t reload;
+  uint8_t access;
+  uint8_t mode;
+
+  /* PIT_ACCESS_WORDで次に書く/読むのが上位バイトか */
+  int write_high;
+  int read_high;
+
+  /* ラッチされたカウンタの値 */
+  uint16_t latch;
+  int latched;
+
+  /* カウントを始めた仮想時刻 */
+  uint64_t start;
+  int running;
+
+  TimerEvent event;
+} PitChannel;
+
+struct Pit {
+  Emulator* emu;
+  PitChannel channels[3];
+};
+
+static uint32_t period_of(PitChannel* ch) {
+  return ch->reload == 0 ? 0x10000 : ch->reload;
+}
+
+/* 現在のカウンタの値 */
+static uint16_t current_count(PitChannel* ch) {
+  uint64_t elapsed;
+  uint32_t period = period_of(ch);
+
+  if(!ch->running) {
+    return ch->reload;
+  }
+  elapsed = ch->pit->emu->vtime - ch->start;
+  /* モード0は0になったら止まる(実機では折り返すが、割り込みはもう出ない) */
+  if(ch->mode == 0) {
+    return elapsed >= period ? 0 : period - elapsed;
+  }
+  return period - (elapsed % period);
+}
+
+/* カウンタが0になったときのイベント */
+static void pit_expire(void* context) {
+  PitChannel* ch = context;
+  Emulator* emu  = ch->pit->emu;
+
+  raise_irq(emu, PIT_IRQ);
+
+  /* モード2(レートジェネレータ)とモード3(方形波)は周期的に割り込みを出す */
+  if(ch->mode == 2 || ch->mode == 3) {
+    sched_add(emu->sched, &ch->event, ch->event.when + period_of(ch), pit_expire, ch);
+  }
+}
+
+/* 初期値の書き込みが終わったのでカウントを始める */
+static void start_counter(PitChannel* ch) {
+  Emulator* emu = ch->pit->emu;
+
+  ch->start   = emu->vtime;
+  ch->running = 1;
+  /* 割り込みを出すのはチャンネル0だけ */
+  if(ch->index == 0) {
+    sched_add(emu->sched, &ch->event, ch->start + period_of(ch), pit_expire, ch);
+  }
+}
+
+static void write_mode(Pit* pit, uint8_t value) {
+  int index = value >> 6;
+  PitChannel* ch;
+
+  /* リードバックコマンドは未対応 */
+  if(index == 3) {
+    return;
+  }
+  ch = &pit->channels[index];
+
+  if(((value >> 4) & 3) == PIT_ACCESS_LATCH) {
+    ch->latch   = current_count(ch);
+    ch->latched = 1;
+    return;
+  }
+
+  ch->access     = (value >> 4) & 3;
+  /* モード6,7はモード2,3と同じ */
+  ch->mode       = ((value >> 1) & 7) > 5 ? ((value >> 1) & 7) - 4 : (value >> 1) & 7;
+  ch->write_high = 0;
+  ch->read_high  = 0;
+  ch->latched    = 0;
+  ch->running    = 0;
+  sched_cancel(pit->emu->sched, &ch->event);
+}
+
+static void write_counter(PitChannel* ch, uint8_t value) {
+  switch(ch->access) {
+  case PIT_ACCESS_LOW:
+    ch->reload = value;
+    start_counter(ch);
+    break;
+  case PIT_ACCESS_HIGH:
+    ch->reload = value << 8;
+    start_counter(ch);
+    break;
+  case PIT_ACCESS_WORD:
+    if(!ch->write_high) {
+      ch->reload     = (ch->reload & 0xff00) | value;
+      ch->write_high = 1;
+    } else {
+      ch->reload     = (ch->reload & 0x00ff) | (value << 8);
+      ch->write_high = 0;
+      start_counter(ch);
+    }
+    break;
+  }
+}
+
+static uint8_t read_counter(PitChannel* ch) {
+  uint16_t count = ch->latched ? ch->latch : current_count(ch);
+  uint8_t value;
+
+  switch(ch->access) {
+  case PIT_ACCESS_HIGH:
+    ch->latched = 0;
+    return count >> 8;
+  case PIT_ACCESS_WORD:
+    value = ch->read_high ? count >> 8 : count & 0xff;
+    ch->read_high = !ch->read_high;
+    /* 上位バイトまで読んだらラッチを解除する */
+    if(!ch->read_high) {
+      ch->latched = 0;
+    }
+    return value;
+  default:
+    ch->latched = 0;
+    return count & 0xff;
+  }
+}
+
+static uint32_t pit_read(void* context, uint16_t address) {
+  Pit* pit = context;
+  int index = address - PIT_PORT;
+
+  if(index == 3) {
+    return 0;
+  }
+  return read_counter(&pit->channels[index]);
+}
+
+static void pit_write(void* context, uint16_t address, uint32_t value) {
+  Pit* pit = context;
+  int index = address - PIT_PORT;
+
+  if(index == 3) {
+    write_mode(pit, value);
+  } else {
+    write_counter(&pit->channels[index], value);
+  }
+}
+
+/* タイマーの予定を取り消し、どのチャンネルも止まった状態に戻す */
+static void pit_reset(void* context) {
+  Pit* pit = context;
+  int i;
+
+  for(i = 0; i < 3; i++) {
+    PitChannel* ch = &pit->channels[i];
+    sched_cancel(pit->emu->sched, &ch->event);
+    *ch = (PitChannel){
+      .pit    = pit,
+      .index  = i,
+      .access = PIT_ACCESS_WORD,
+    };
+  }
+}
+
+Pit* create_pit(Emulator* emu) {
+  Pit* pit = calloc(1, sizeof(Pit));
+  IoDevice device = {
+    .read8   = pit_read,
+    .write8  = pit_write,
+    .reset   = pit_reset,
+    .context = pit,
+  };
+
+  pit->emu = emu;
+  pit_reset(pit);
+  io_register(emu, PIT_PORT, 4, &device);
+  return pit;
+}
+
+void destroy_pit(Pit* pit) {
+  int i;
+
+  for(i = 0; i < 3; i++) {
+    sched_cancel(pit->emu->sched, &pit->channels[i].event);
+  }
+  free(pit);
+}
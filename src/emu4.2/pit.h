@@ -0,0 +1,25 @@
+#ifndef PIT_H_
+#define PIT_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* 8253/8254 PIT(プログラマブル・インターバル・タイマー)のI/Oポート */
+#define PIT_PORT 0x40
+
+/* チャンネル0が出す割り込み要求 */
+#define PIT_IRQ 0
+
+typedef struct Pit Pit;
+
+/* PITを作成し、PIT_PORTから4ポートに登録する
+ *
+ * カウンタは仮想時間の1単位(ゲストの1命令)ごとに1つ減る
+ */
+Pit* create_pit(Emulator* emu);
+
+/* PITを破棄する */
+void destroy_pit(Pit* pit);
+
+#endif
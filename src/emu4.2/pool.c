@@ -0,0 +1,139 @@
+#include "pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "io.h"
+
+/* プールに置いておけるエミュレータの最大数 */
+#define POOL_CAPACITY 64
+
+/* 返却済みのエミュレータを積んでおくスタック */
+static Emulator* pool[POOL_CAPACITY];
+static size_t pool_count;
+static size_t pool_memory_size;
+
+/* ダーティページのビットマップに必要なuint32_tの個数 */
+static size_t dirty_words(size_t size) {
+  size_t pages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  return (pages + 31) / 32;
+}
+
+/* レジスタとCPUの状態を初期状態にする */
+static void reset_registers(Emulator* emu, uint32_t eip, uint32_t esp) {
+  /* 汎用レジスタの初期値をすべて0にする */
+  memset(emu->registers, 0, sizeof(emu->registers));
+  emu->eflags = 0;
+  emu->vtime       = 0;
+  emu->irq_pending = 0;
+  emu->halted      = 0;
+  /* 外から付けたものは次の利用者に引き継がない */
+  /* (仮想時間が0に戻るので記録や再生は続けられず、ディスクも別のものを使う) */
+  emu->replay      = NULL;
+  emu->disk        = NULL;
+  emu->vga         = NULL;
+  emu->callstack   = NULL;
+  emu->heatmap     = NULL;
+  emu->trace       = NULL;
+  emu->hooks       = 0;
+  emu->code_lines    = NULL;
+  emu->code_versions = NULL;
+
+  /* レジスタの初期値を指定されたものにする */
+  emu->eip            = eip;
+  emu->registers[ESP] = esp;
+}
+
+Emulator* create_emu(size_t size, uint32_t eip, uint32_t esp) {
+
+  /* ホットなフィールドが1キャッシュラインに収まるよう、キャッシュライン境界に配置する */
+  Emulator* emu    = aligned_alloc(CACHE_LINE_SIZE, sizeof(Emulator));
+  emu->memory      = malloc(size);
+  emu->memory_size = size;
+  emu->dirty_pages = calloc(dirty_words(size), sizeof(uint32_t));
+  output_init(&emu->output, STDOUT_FILENO);
+  emu->sched = malloc(sizeof(Scheduler));
+  sched_init(emu->sched);
+  init_io(emu);
+
+  /* calloc任せにせず自分で書き込むことで、物理ページをここで割り当てさせる */
+  memset(emu->memory, 0, size);
+
+  reset_registers(emu, eip, esp);
+
+  return emu;
+}
+
+void destroy_emu(Emulator* emu) {
+  output_close(&emu->output);
+  destroy_io(emu);
+  free(emu->sched);
+  free(emu->dirty_pages);
+  free(emu->memory);
+  free(emu);
+}
+
+void init_emu_pool(size_t count, size_t memory_size) {
+  if(count > POOL_CAPACITY) {
+    count = POOL_CAPACITY;
+  }
+  pool_memory_size = memory_size;
+  while(pool_count < count) {
+    pool[pool_count++] = create_emu(memory_size, 0, 0);
+  }
+}
+
+void destroy_emu_pool(void) {
+  while(pool_count > 0) {
+    destroy_emu(pool[--pool_count]);
+  }
+}
+
+Emulator* acquire_emu(uint32_t eip, uint32_t esp) {
+  Emulator* emu;
+
+  if(pool_count == 0) {
+    return create_emu(pool_memory_size, eip, esp);
+  }
+
+  /* 返却時にリセット済みなので、レジスタを設定するだけで使える */
+  emu = pool[--pool_count];
+  emu->eip            = eip;
+  emu->registers[ESP] = esp;
+  return emu;
+}
+
+void release_emu(Emulator* emu) {
+  size_t i;
+  size_t words = dirty_words(emu->memory_size);
+
+  /* 出力先を切り替えていれば閉じて、標準出力に戻す */
+  output_close(&emu->output);
+
+  if(pool_count == POOL_CAPACITY || emu->memory_size != pool_memory_size) {
+    destroy_emu(emu);
+    return;
+  }
+
+  /* 書き込みのあったページだけを0に戻す */
+  for(i = 0; i < words; i++) {
+    uint32_t bits = emu->dirty_pages[i];
+    while(bits != 0) {
+      size_t offset = ((i << 5) + __builtin_ctz(bits)) << PAGE_SHIFT;
+      size_t length = emu->memory_size - offset < PAGE_SIZE ? emu->memory_size - offset : PAGE_SIZE;
+      memset(emu->memory + offset, 0, length);
+      bits &= bits - 1;
+    }
+    emu->dirty_pages[i] = 0;
+  }
+
+  /* デバイスは作り直さずにその場で初期状態に戻す。タイマーの予定もデバイスが取り消すので、
+     スケジューラは時刻を戻すだけで済む */
+  /* (UARTの読み込みスレッドがホストから先読みした入力は、次の利用者に引き継ぐ) */
+  reset_io(emu);
+  sched_reset(emu->sched);
+
+  reset_registers(emu, 0, 0);
+  pool[pool_count++] = emu;
+}
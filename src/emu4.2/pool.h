@@ -0,0 +1,40 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* エミュレータを作成する
+ *
+ * メモリは0クリアし、全ページに一度触れておくことで実行中のページフォルトを避ける
+ */
+Emulator* create_emu(size_t size, uint32_t eip, uint32_t esp);
+
+/* エミュレータを破棄する */
+void destroy_emu(Emulator* emu);
+
+/* エミュレータのプールを初期化する
+ *
+ * memory_sizeバイトのメモリを持つエミュレータをcount個あらかじめ作成しておく
+ */
+void init_emu_pool(size_t count, size_t memory_size);
+
+/* プールの全エミュレータを破棄する */
+void destroy_emu_pool(void);
+
+/* プールからエミュレータを取り出し、eipとespを設定して返す
+ *
+ * プールが空のときは新しく作成する
+ */
+Emulator* acquire_emu(uint32_t eip, uint32_t esp);
+
+/* エミュレータをプールに返却する
+ *
+ * 書き込みのあったページだけを0クリアし、レジスタとデバイスを初期状態に戻す。
+ * プールが満杯のときは破棄する
+ */
+void release_emu(Emulator* emu);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "emulator.h"
+#include "emulator_function.h"
+#include "instruction.h"
+#include "pool.h"
+
+/* エミュレータの作成、小さなゲストの実行、破棄を繰り返し、1回あたりの時間を測る
+ *
+ * mallocで作るだけのエミュレータ(プールを入れる前のcreate_emu)、
+ * create_emuとdestroy_emu、プールのacquire_emuとrelease_emuの3通りを比べる
+ */
+
+/* メモリは1MB(x86と同じ) */
+#define MEMORY_SIZE (1024 * 1024)
+
+/* 各方法を繰り返す回数 */
+#define ITERATIONS 5000
+
+/* mov eax, 1; mov ebx, 2; push eax; pop ecx; jmp 0 */
+static const uint8_t guest[] = {
+  0xb8, 0x01, 0x00, 0x00, 0x00,
+  0xbb, 0x02, 0x00, 0x00, 0x00,
+  0x50,
+  0x59,
+  0xe9, 0xef, 0x83, 0xff, 0xff,
+};
+
+/* プールを入れる前のcreate_emuと同じく、確保するだけでメモリを0クリアしない */
+/* 命令の実行に使うフィールドだけを初期化する */
+static Emulator* create_plain_emu(size_t size, uint32_t eip, uint32_t esp) {
+  Emulator* emu = malloc(sizeof(Emulator));
+
+  emu->memory      = malloc(size);
+  emu->memory_size = size;
+  emu->dirty_pages = calloc((size / PAGE_SIZE + 31) / 32, sizeof(uint32_t));
+  emu->memory_writes = 0;
+  emu->hooks         = 0;
+  emu->vga         = NULL;
+  emu->heatmap     = NULL;
+  emu->callstack   = NULL;
+  memset(emu->registers, 0, sizeof(emu->registers));
+  emu->eflags         = 0;
+  emu->eip            = eip;
+  emu->registers[ESP] = esp;
+  return emu;
+}
+
+static void destroy_plain_emu(Emulator* emu) {
+  free(emu->dirty_pages);
+  free(emu->memory);
+  free(emu);
+}
+
+/* ゲストを読み込み、jmp 0で終わるまで1命令ずつ実行する */
+static void run(Emulator* emu) {
+  memcpy(emu->memory + 0x7c00, guest, sizeof(guest));
+  mark_memory_dirty(emu, 0x7c00, sizeof(guest));
+  while(emu->eip != 0) {
+    instructions[get_code8(emu, 0)](emu);
+  }
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void) {
+  double start;
+  int i;
+
+  init_instructions();
+
+  start = now_ns();
+  for(i = 0; i < ITERATIONS; i++) {
+    Emulator* emu = create_plain_emu(MEMORY_SIZE, 0x7c00, 0x7c00);
+    run(emu);
+    destroy_plain_emu(emu);
+  }
+  printf("malloc + run + free:          %10.1f ns\n", (now_ns() - start) / ITERATIONS);
+
+  start = now_ns();
+  for(i = 0; i < ITERATIONS; i++) {
+    Emulator* emu = create_emu(MEMORY_SIZE, 0x7c00, 0x7c00);
+    run(emu);
+    destroy_emu(emu);
+  }
+  printf("create_emu + run + destroy:   %10.1f ns\n", (now_ns() - start) / ITERATIONS);
+
+  init_emu_pool(1, MEMORY_SIZE);
+  start = now_ns();
+  for(i = 0; i < ITERATIONS; i++) {
+    Emulator* emu = acquire_emu(0x7c00, 0x7c00);
+    run(emu);
+    release_emu(emu);
+  }
+  printf("acquire_emu + run + release:  %10.1f ns\n", (now_ns() - start) / ITERATIONS);
+  destroy_emu_pool();
+  return 0;
+}
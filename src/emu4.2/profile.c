@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+#include "profile.h"
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* サンプリングしているエミュレータ。シグナルハンドラから読む */
+static Emulator* volatile profiled;
+static timer_t timer;
+
+/* シグナルハンドラだけが書き込み、止めた後にprofile_dumpが読む */
+static uint32_t* samples;
+static atomic_uint sample_count;
+
+/* SIGPROFのハンドラ */
+/* ロックも確保もせず、EIPを配列の次の位置に書くだけにする */
+static void on_sigprof(int number) {
+  Emulator* emu = profiled;
+  uint32_t index;
+
+  (void)number;
+  if(emu == NULL) {
+    return;
+  }
+  index = atomic_fetch_add_explicit(&sample_count, 1, memory_order_relaxed);
+  if(index < PROFILE_MAX_SAMPLES) {
+    samples[index] = emu->eip;
+  }
+}
+
+int profile_start(Emulator* emu, uint32_t interval_us) {
+  struct sigaction action;
+  struct sigevent event;
+  struct itimerspec spec;
+
+  samples = malloc(sizeof(uint32_t) * PROFILE_MAX_SAMPLES);
+  atomic_store(&sample_count, 0);
+  profiled = emu;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_sigprof;
+  /* 割り込まれたシステムコールはやり直させる */
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, NULL);
+
+  /* 書き出し用などの他のスレッドではなく、このスレッドが使ったCPU時間で、このスレッドに届ける */
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify          = SIGEV_THREAD_ID;
+  event.sigev_signo           = SIGPROF;
+  event._sigev_un._tid        = gettid();
+  if(timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer) < 0) {
+    profiled = NULL;
+    return -1;
+  }
+
+  spec.it_interval.tv_sec  = interval_us / 1000000;
+  spec.it_interval.tv_nsec = (interval_us % 1000000) * 1000;
+  spec.it_value = spec.it_interval;
+  timer_settime(timer, 0, &spec, NULL);
+  return 0;
+}
+
+void profile_stop(void) {
+  if(profiled == NULL) {
+    return;
+  }
+  timer_delete(timer);
+  profiled = NULL;
+}
+
+typedef struct {
+  uint32_t key;
+  const Symbol* symbol;
+  uint32_t count;
+} ProfileEntry;
+
+static int compare_key(const void* a, const void* b) {
+  const ProfileEntry* x = a;
+  const ProfileEntry* y = b;
+  return x->key < y->key ? -1 : x->key > y->key ? 1 : 0;
+}
+
+static int compare_count(const void* a, const void* b) {
+  const ProfileEntry* x = a;
+  const ProfileEntry* y = b;
+  return x->count < y->count ? 1 : x->count > y->count ? -1 : compare_key(a, b);
+}
+
+void profile_dump(const Symbols* symbols) {
+  uint32_t total = atomic_load(&sample_count);
+  uint32_t recorded = total < PROFILE_MAX_SAMPLES ? total : PROFILE_MAX_SAMPLES;
+  ProfileEntry* entries;
+  uint32_t count = 0;
+  uint32_t cumulative = 0;
+  uint32_t i;
+
+  if(samples == NULL) {
+    return;
+  }
+
+  /* サンプルを関数(シンボルがなければEIP)に置き換えて並べ、同じものを数える */
+  entries = malloc(sizeof(ProfileEntry) * (recorded + 1));
+  for(i = 0; i < recorded; i++) {
+    const Symbol* symbol = symbols != NULL ? symbol_lookup(symbols, samples[i]) : NULL;
+    entries[i].symbol = symbol;
+    entries[i].key    = symbol != NULL ? symbol->address : samples[i];
+    entries[i].count  = 1;
+  }
+  qsort(entries, recorded, sizeof(ProfileEntry), compare_key);
+  for(i = 0; i < recorded; i++) {
+    if(count > 0 && entries[count - 1].key == entries[i].key
+       && (entries[count - 1].symbol == NULL) == (entries[i].symbol == NULL)) {
+      entries[count - 1].count++;
+    } else {
+      entries[count++] = entries[i];
+    }
+  }
+  qsort(entries, count, sizeof(ProfileEntry), compare_count);
+
+  printf("\n%10s %7s %7s  %s\n", "samples", "%", "cum%", symbols != NULL ? "function" : "eip");
+  for(i = 0; i < count; i++) {
+    cumulative += entries[i].count;
+    printf("%10u %6.2f%% %6.2f%%  ", entries[i].count,
+           100.0 * entries[i].count / recorded, 100.0 * cumulative / recorded);
+    if(entries[i].symbol != NULL) {
+      printf("%s\n", entries[i].symbol->name);
+    } else {
+      printf("0x%08x\n", entries[i].key);
+    }
+  }
+  printf("%10u samples", recorded);
+  if(total > recorded) {
+    printf(" (%u dropped)", total - recorded);
+  }
+  printf("\n");
+
+  free(entries);
+  free(samples);
+  samples = NULL;
+}
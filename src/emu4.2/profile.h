@@ -0,0 +1,27 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "symbols.h"
+
+/* サンプリングするゲストのEIPの最大数 */
+#define PROFILE_MAX_SAMPLES (1 << 22)
+
+/* emuを実行しているスレッドが、CPU時間でinterval_usマイクロ秒使うたびにSIGPROFでEIPを記録する
+ *
+ * この関数はemuを実行するスレッドから呼ぶ。開始できなければ-1を返す
+ */
+int profile_start(Emulator* emu, uint32_t interval_us);
+
+/* サンプリングを止める */
+void profile_stop(void);
+
+/* 記録したEIPをsymbolsの関数ごとに数え、多い順に標準出力に出す
+ *
+ * symbolsがNULLなら、EIPごとに数える
+ */
+void profile_dump(const Symbols* symbols);
+
+#endif
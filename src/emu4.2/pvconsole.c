@@ -0,0 +1,74 @@
+#include "pvconsole.h"
+
+#include <stdlib.h>
+
+#include "io.h"
+
+struct PvConsole {
+  Emulator* emu;
+  uint32_t address;
+};
+
+static uint32_t pvconsole_read(void* context, uint16_t address) {
+  PvConsole* console = context;
+
+  switch(address) {
+  case PVCONSOLE_ADDR:
+    return console->address;
+  case PVCONSOLE_WRITE:
+    return PVCONSOLE_MAGIC;
+  default:
+    return 0;
+  }
+}
+
+static void pvconsole_write(void* context, uint16_t address, uint32_t value) {
+  PvConsole* console = context;
+  Emulator* emu      = console->emu;
+  uint32_t start     = console->address;
+  uint32_t length    = value;
+
+  switch(address) {
+  case PVCONSOLE_ADDR:
+    console->address = value;
+    break;
+  case PVCONSOLE_WRITE:
+    /* ゲストのメモリからはみ出す部分は出力しない */
+    if(start >= emu->memory_size) {
+      break;
+    }
+    if(length > emu->memory_size - start) {
+      length = emu->memory_size - start;
+    }
+    /* BIOSのテレタイプ出力で付けた色が残っていたら元に戻す */
+    if(emu->output.color >= 0) {
+      output_reset_color(&emu->output);
+    }
+    output_write(&emu->output, emu->memory + start, length);
+    break;
+  }
+}
+
+static void pvconsole_reset(void* context) {
+  PvConsole* console = context;
+  console->address = 0;
+}
+
+PvConsole* create_pvconsole(Emulator* emu) {
+  PvConsole* console = calloc(1, sizeof(PvConsole));
+  /* 32bitのレジスタしかないので、8bit, 16bitの読み書きは未登録のポートと同じ扱いにする */
+  IoDevice device = {
+    .read32  = pvconsole_read,
+    .write32 = pvconsole_write,
+    .reset   = pvconsole_reset,
+    .context = console,
+  };
+
+  console->emu = emu;
+  io_register(emu, PVCONSOLE_PORT, 8, &device);
+  return console;
+}
+
+void destroy_pvconsole(PvConsole* console) {
+  free(console);
+}
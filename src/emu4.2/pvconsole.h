@@ -0,0 +1,33 @@
+#ifndef PVCONSOLE_H_
+#define PVCONSOLE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* 準仮想化コンソールのI/Oポート
+ *
+ * 1文字ずつout命令で書く代わりに、ゲストのメモリにある文字列の番地と長さを
+ * ポートに書くと、ホストがまとめて出力バッファへコピーする。
+ *
+ * PVCONSOLE_ADDR  (+0) 書き込む文字列の番地(32bit, 読み書き可)
+ * PVCONSOLE_WRITE (+4) 長さを書き込むと、ADDRからその長さだけ出力する。
+ *                      読むとPVCONSOLE_MAGICが返るので、ゲストはこれでデバイスの有無を調べられる
+ */
+#define PVCONSOLE_PORT  0x0500
+#define PVCONSOLE_ADDR  (PVCONSOLE_PORT + 0)
+#define PVCONSOLE_WRITE (PVCONSOLE_PORT + 4)
+
+/* PVCONSOLE_WRITEを読んだときの値("PVC1") */
+#define PVCONSOLE_MAGIC 0x31435650
+
+typedef struct PvConsole PvConsole;
+
+/* 準仮想化コンソールを作成し、PVCONSOLE_PORTから8ポートに登録する */
+/* 出力はemu->outputに書き込む */
+PvConsole* create_pvconsole(Emulator* emu);
+
+/* 準仮想化コンソールを破棄する */
+void destroy_pvconsole(PvConsole* console);
+
+#endif
@@ -0,0 +1,195 @@
+#include "replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ログファイルの先頭に置く識別子 */
+static const char replay_magic[8] = "X86RPLY2";
+
+#define REPLAY_SAME_ADDRESS 1
+#define REPLAY_SAME_VALUE   2
+
+/* ログの終わりを表すレコードのポート番号(16bitのポート番号と重ならない) */
+#define REPLAY_END_ADDRESS 0x10000
+
+/* ログの形式
+ *
+ * 先頭にreplay_magic、その後に受け取った値1つごとのレコードが並ぶ。
+ * 数値はどれも下位7ビットずつ、続きがあれば最上位ビットを立てる可変長整数(LEB128)で、
+ * レコードは「前のレコードからの仮想時間の差 << 2 | 値が前と同じか << 1 | ポートが前と同じか」
+ * から始まり、前のレコードと違うときだけポート番号、値の順に続く。
+ * 同じポートに1文字ずつ届く入力は1文字2バイトになる。
+ * 最後に、実行を終えた時刻とREPLAY_END_ADDRESSを持つレコードを置く
+ */
+struct Replay {
+  FILE* file;
+  enum ReplayMode mode;
+  uint64_t vtime;
+  uint16_t address;
+  uint32_t value;
+  /* 再生中、次のレコードの値(ログの終わりならhas_nextが0) */
+  int has_next;
+  /* 再生中、ログの終わりのレコードを読んでいれば1と、その時刻 */
+  int ended;
+  uint64_t end_vtime;
+  uint64_t next_vtime;
+  uint16_t next_address;
+  uint32_t next_value;
+  /* 記録/再生したレコードの数 */
+  uint64_t count;
+};
+
+static void write_varint(FILE* file, uint64_t value) {
+  while(value >= 0x80) {
+    putc((value & 0x7f) | 0x80, file);
+    value >>= 7;
+  }
+  putc(value, file);
+}
+
+/* 読めたら0、ログが終わっていれば-1を返す */
+static int read_varint(FILE* file, uint64_t* value) {
+  uint64_t result = 0;
+  int shift = 0;
+  int c;
+
+  do {
+    c = getc(file);
+    if(c == EOF || shift > 63) {
+      return -1;
+    }
+    result |= (uint64_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while(c & 0x80);
+  *value = result;
+  return 0;
+}
+
+/* 次のレコードを先読みしておく */
+static void read_next(Replay* replay) {
+  uint64_t head, address, value;
+
+  replay->has_next = 0;
+  if(read_varint(replay->file, &head) < 0) {
+    return;
+  }
+  replay->next_vtime = replay->vtime + (head >> 2);
+  address = replay->address;
+  value   = replay->value;
+  if(!(head & REPLAY_SAME_ADDRESS) && read_varint(replay->file, &address) < 0) {
+    return;
+  }
+  if(!(head & REPLAY_SAME_VALUE) && read_varint(replay->file, &value) < 0) {
+    return;
+  }
+  if(address == REPLAY_END_ADDRESS) {
+    replay->ended     = 1;
+    replay->end_vtime = replay->next_vtime;
+    return;
+  }
+  replay->next_address = address;
+  replay->next_value   = value;
+  replay->has_next     = 1;
+}
+
+Replay* open_replay(const char* filename, enum ReplayMode mode) {
+  Replay* replay;
+  char magic[sizeof(replay_magic)];
+  FILE* file = fopen(filename, mode == REPLAY_RECORD ? "wb" : "rb");
+
+  if(file == NULL) {
+    return NULL;
+  }
+  if(mode == REPLAY_RECORD) {
+    fwrite(replay_magic, 1, sizeof(replay_magic), file);
+  } else if(fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+            || memcmp(magic, replay_magic, sizeof(magic)) != 0) {
+    fclose(file);
+    return NULL;
+  }
+
+  replay = calloc(1, sizeof(Replay));
+  replay->file = file;
+  replay->mode = mode;
+  /* 入力のたびにシステムコールを呼ばないよう、大きめのバッファを付ける */
+  setvbuf(file, NULL, _IOFBF, 1 << 16);
+  if(mode == REPLAY_PLAY) {
+    read_next(replay);
+  }
+  return replay;
+}
+
+void close_replay(Replay* replay) {
+  fclose(replay->file);
+  free(replay);
+}
+
+void replay_finish(Replay* replay, uint64_t vtime) {
+  if(replay->mode != REPLAY_RECORD) {
+    return;
+  }
+  write_varint(replay->file, (vtime - replay->vtime) << 2 | REPLAY_SAME_VALUE);
+  write_varint(replay->file, REPLAY_END_ADDRESS);
+}
+
+enum ReplayMode replay_mode(Replay* replay) {
+  return replay->mode;
+}
+
+void replay_record(Replay* replay, uint64_t vtime, uint16_t address, uint32_t value) {
+  uint64_t head = (vtime - replay->vtime) << 2;
+
+  /* 最初のレコードは前と比べず、ポートと値を必ず書く */
+  if(replay->count > 0 && address == replay->address) {
+    head |= REPLAY_SAME_ADDRESS;
+  }
+  if(replay->count > 0 && value == replay->value) {
+    head |= REPLAY_SAME_VALUE;
+  }
+  write_varint(replay->file, head);
+  if(!(head & REPLAY_SAME_ADDRESS)) {
+    write_varint(replay->file, address);
+  }
+  if(!(head & REPLAY_SAME_VALUE)) {
+    write_varint(replay->file, value);
+  }
+  replay->vtime   = vtime;
+  replay->address = address;
+  replay->value   = value;
+  replay->count++;
+}
+
+uint32_t replay_play(Replay* replay, uint64_t vtime, uint16_t address) {
+  if(!replay->has_next) {
+    fprintf(stderr, "replay: log ended at record %llu (vtime %llu, port %04x)\n",
+            (unsigned long long)replay->count, (unsigned long long)vtime, address);
+    exit(1);
+  }
+  if(replay->next_vtime != vtime || replay->next_address != address) {
+    fprintf(stderr, "replay: diverged at record %llu: expected port %04x at vtime %llu, got port %04x at vtime %llu\n",
+            (unsigned long long)replay->count,
+            replay->next_address, (unsigned long long)replay->next_vtime,
+            address, (unsigned long long)vtime);
+    exit(1);
+  }
+  replay->vtime   = replay->next_vtime;
+  replay->address = replay->next_address;
+  replay->value   = replay->next_value;
+  replay->count++;
+  read_next(replay);
+  return replay->value;
+}
+
+int replay_poll(Replay* replay, uint64_t vtime, uint16_t address, uint32_t* value) {
+  /* 記録を終えた時刻までは、入力がもう届かないだけ */
+  if(!replay->has_next && replay->ended && vtime <= replay->end_vtime) {
+    return 0;
+  }
+  if(replay->has_next && replay->next_vtime > vtime) {
+    return 0;
+  }
+  /* 記録したときより遅れて調べにきたか、別のデバイスの番なら実行がずれている */
+  *value = replay_play(replay, vtime, address);
+  return 1;
+}
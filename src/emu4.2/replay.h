@@ -0,0 +1,53 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <stdint.h>
+
+/* 非決定的な入力の記録と再生
+ *
+ * デバイスがホストから受け取った入力のように実行のたびに変わりうる値を、
+ * 受け取った時点の仮想時間(命令数)とともにログファイルへ記録する。
+ * 再生時はデバイスがホストの代わりにログから同じ時刻に同じ値を受け取るので、
+ * ホストの入出力なしに同じ実行を再現できる
+ */
+
+enum ReplayMode {
+  REPLAY_RECORD,
+  REPLAY_PLAY,
+};
+
+typedef struct Replay Replay;
+
+/* filenameのログを記録用または再生用に開く。開けなければNULLを返す */
+Replay* open_replay(const char* filename, enum ReplayMode mode);
+
+/* ログを書き出して閉じる */
+void close_replay(Replay* replay);
+
+/* 記録中なら、実行を終えた仮想時刻vtimeをログの終わりとして書く
+ *
+ * 終わりのないログ(記録中に止めたもの)を再生すると、最後のレコードより後で
+ * デバイスが入力を調べたところで、エラーを表示して終了する
+ */
+void replay_finish(Replay* replay, uint64_t vtime);
+
+enum ReplayMode replay_mode(Replay* replay);
+
+/* 仮想時刻vtimeに、ポートaddressのデバイスがホストから受け取ったvalueを記録する */
+void replay_record(Replay* replay, uint64_t vtime, uint16_t address, uint32_t value);
+
+/* 仮想時刻vtimeにポートaddressのデバイスが受け取る値をログから取り出す
+ *
+ * 記録したときに必ず値を受け取っていた時点で呼ぶ。
+ * 記録したときと実行がずれていたら、エラーを表示して終了する
+ */
+uint32_t replay_play(Replay* replay, uint64_t vtime, uint16_t address);
+
+/* 次のレコードが仮想時刻vtimeのポートaddressのものなら、取り出してvalueに入れて1を返す
+ *
+ * 次のレコードがもっと後の時刻か、記録を終えた時刻までにもうレコードがなければ0を返す。
+ * デバイスがホストの入力を調べるたびに呼び、記録したときにその時刻で受け取った値だけを受け取る
+ */
+int replay_poll(Replay* replay, uint64_t vtime, uint16_t address, uint32_t* value);
+
+#endif
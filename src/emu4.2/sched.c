@@ -0,0 +1,241 @@
+#include "sched.h"
+
+/* 番兵だけの空のリストにする */
+static void list_init(TimerEvent* head) {
+  head->prev = head;
+  head->next = head;
+}
+
+static void list_remove(TimerEvent* event) {
+  event->prev->next = event->next;
+  event->next->prev = event->prev;
+  event->prev = event;
+  event->next = event;
+}
+
+static void list_append(TimerEvent* head, TimerEvent* event) {
+  event->prev       = head->prev;
+  event->next       = head;
+  head->prev->next  = event;
+  head->prev        = event;
+}
+
+static TimerEvent* head_of(Scheduler* sched, int level, int slot) {
+  return level == WHEEL_LEVELS ? &sched->overflow : &sched->slots[level][slot];
+}
+
+/* 段levelのイベントの中で最も早い時刻を求め直す */
+/* イベントのつながっているスロットだけを調べるので、ホイール全体は走査しない */
+static void update_level_next(Scheduler* sched, int level) {
+  uint64_t next = SCHED_NEVER;
+  uint64_t bits = level == WHEEL_LEVELS ? 1 : sched->occupied[level];
+  TimerEvent* event;
+
+  while(bits != 0) {
+    TimerEvent* head = head_of(sched, level, __builtin_ctzll(bits));
+    for(event = head->next; event != head; event = event->next) {
+      if(event->when < next) {
+        next = event->when;
+      }
+    }
+    bits &= bits - 1;
+  }
+  sched->level_next[level] = next;
+}
+
+/* 各段の最も早い時刻からnext_timeを求める */
+static void update_next_time(Scheduler* sched) {
+  uint64_t next = SCHED_NEVER;
+  int level;
+
+  for(level = 0; level <= WHEEL_LEVELS; level++) {
+    if(sched->level_next[level] < next) {
+      next = sched->level_next[level];
+    }
+  }
+  sched->next_time = next;
+}
+
+/* 現在の時刻から見たイベントの位置にリストをつなぐ */
+static void place(Scheduler* sched, TimerEvent* event) {
+  uint64_t delta = event->when - sched->now;
+  int level;
+
+  for(level = 0; level < WHEEL_LEVELS; level++) {
+    if(delta < (1ull << (WHEEL_BITS * (level + 1)))) {
+      break;
+    }
+  }
+  event->level = level;
+  event->slot  = level == WHEEL_LEVELS ? 0 : (event->when >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+  list_append(head_of(sched, level, event->slot), event);
+  if(level < WHEEL_LEVELS) {
+    sched->occupied[level] |= 1ull << event->slot;
+  }
+  if(event->when < sched->level_next[level]) {
+    sched->level_next[level] = event->when;
+  }
+}
+
+/* イベントをリストから外す。その段で最も早いイベントだったときだけ段の時刻を求め直す */
+static void unlink_event(Scheduler* sched, TimerEvent* event) {
+  TimerEvent* head = head_of(sched, event->level, event->slot);
+
+  list_remove(event);
+  if(event->level < WHEEL_LEVELS && head->next == head) {
+    sched->occupied[event->level] &= ~(1ull << event->slot);
+  }
+  if(event->when == sched->level_next[event->level]) {
+    update_level_next(sched, event->level);
+  }
+}
+
+/* 段levelのスロットslotにつながっているイベントを、現在の時刻から見た位置につなぎ直す */
+static void replace_list(Scheduler* sched, int level, int slot) {
+  TimerEvent* head = head_of(sched, level, slot);
+  TimerEvent list;
+  TimerEvent* event;
+
+  if(head->next == head) {
+    return;
+  }
+  /* いったん別のリストへ移し、段の時刻を求め直してから置き直す */
+  list.next       = head->next;
+  list.prev       = head->prev;
+  list.next->prev = &list;
+  list.prev->next = &list;
+  list_init(head);
+  if(level < WHEEL_LEVELS) {
+    sched->occupied[level] &= ~(1ull << slot);
+  }
+  update_level_next(sched, level);
+
+  while((event = list.next) != &list) {
+    list_remove(event);
+    place(sched, event);
+  }
+}
+
+/* 時刻toまで、途中で発火するイベントがないと分かっているときに一気に進める */
+static void jump(Scheduler* sched, uint64_t to) {
+  int level;
+
+  sched->now = to;
+  for(level = 1; level < WHEEL_LEVELS; level++) {
+    uint64_t bits = sched->occupied[level];
+
+    /* 置き直したイベントが同じ段に戻ることもあるので、始める前のビットマップを使う */
+    while(bits != 0) {
+      replace_list(sched, level, __builtin_ctzll(bits));
+      bits &= bits - 1;
+    }
+  }
+  replace_list(sched, WHEEL_LEVELS, 0);
+}
+
+/* 時刻を1進め、上の段から降りてくるイベントを移し、最下段のスロットを発火させる */
+static void tick(Scheduler* sched) {
+  TimerEvent* head;
+  TimerEvent* event;
+  int level;
+
+  sched->now++;
+
+  /* 下の段が一周したら、上の段の該当スロットを下の段へ降ろす */
+  for(level = 1; level < WHEEL_LEVELS; level++) {
+    if(sched->now & ((1ull << (WHEEL_BITS * level)) - 1)) {
+      break;
+    }
+    replace_list(sched, level, (sched->now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1));
+  }
+  if(level == WHEEL_LEVELS && (sched->now & ((1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1)) == 0) {
+    replace_list(sched, WHEEL_LEVELS, 0);
+  }
+
+  if(sched->now < sched->next_time) {
+    return;
+  }
+  head = &sched->slots[0][sched->now & (WHEEL_SIZE - 1)];
+  while((event = head->next) != head) {
+    unlink_event(sched, event);
+    event->pending = 0;
+    /* イベントの中からsched_next_timeで残りの予定を調べられるよう、先に求め直しておく */
+    update_next_time(sched);
+    /* イベントの中で次のイベントを登録してもよい */
+    event->func(event->context);
+  }
+  update_next_time(sched);
+}
+
+void sched_init(Scheduler* sched) {
+  int level, slot;
+
+  sched->now       = 0;
+  sched->next_time = SCHED_NEVER;
+  for(level = 0; level < WHEEL_LEVELS; level++) {
+    for(slot = 0; slot < WHEEL_SIZE; slot++) {
+      list_init(&sched->slots[level][slot]);
+    }
+    sched->occupied[level] = 0;
+  }
+  for(level = 0; level <= WHEEL_LEVELS; level++) {
+    sched->level_next[level] = SCHED_NEVER;
+  }
+  list_init(&sched->overflow);
+}
+
+void sched_reset(Scheduler* sched) {
+  if(sched->next_time != SCHED_NEVER) {
+    sched_init(sched);
+    return;
+  }
+  sched->now = 0;
+}
+
+void sched_add(Scheduler* sched, TimerEvent* event, uint64_t when, event_func_t* func, void* context) {
+  if(event->pending) {
+    unlink_event(sched, event);
+  }
+  /* 過去の時刻は次の時刻として扱う */
+  if(when <= sched->now) {
+    when = sched->now + 1;
+  }
+  event->when    = when;
+  event->func    = func;
+  event->context = context;
+  event->pending = 1;
+  place(sched, event);
+  update_next_time(sched);
+}
+
+void sched_cancel(Scheduler* sched, TimerEvent* event) {
+  if(event->pending) {
+    unlink_event(sched, event);
+    event->pending = 0;
+    update_next_time(sched);
+  }
+}
+
+void sched_run(Scheduler* sched, uint64_t now) {
+  while(sched->next_time <= now) {
+    uint64_t target = sched->next_time;
+
+    /* 次のイベントの直前まで、途中を飛ばして進める */
+    if(target - sched->now > WHEEL_SIZE) {
+      jump(sched, target - 1);
+    }
+    /* 発火したイベントが次の予定を入れてもtargetより先には進まない */
+    while(sched->now < target) {
+      tick(sched);
+    }
+  }
+  if(now > sched->now) {
+    if(now - sched->now > WHEEL_SIZE) {
+      jump(sched, now);
+    } else {
+      while(sched->now < now) {
+        tick(sched);
+      }
+    }
+  }
+}
@@ -0,0 +1,79 @@
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <stdint.h>
+
+/* 仮想時間で動くイベントスケジューラ
+ *
+ * 仮想時間の単位はゲストの1命令。
+ * 64スロット×4段の階層タイマーホイールでイベントを管理する
+ */
+
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/* どのイベントも予定されていないときのsched_next_timeの値 */
+#define SCHED_NEVER UINT64_MAX
+
+typedef void event_func_t(void* context);
+
+/* タイマーイベント
+ *
+ * 呼び出し側で確保し、sched_addで登録する。発火するとスケジューラから外れる
+ */
+typedef struct TimerEvent {
+  uint64_t when;
+  event_func_t* func;
+  void* context;
+  struct TimerEvent* prev;
+  struct TimerEvent* next;
+  int pending;
+  /* つながっている段(WHEEL_LEVELSならoverflow)とスロット */
+  int level;
+  int slot;
+} TimerEvent;
+
+typedef struct {
+  /* ホイールが処理済みの時刻 */
+  uint64_t now;
+  /* 予定されているイベントの中で最も早い時刻 */
+  uint64_t next_time;
+  /* 各段(最後はoverflow)のイベントの中で最も早い時刻。next_timeはこれらの最小値 */
+  uint64_t level_next[WHEEL_LEVELS + 1];
+  /* 各段のイベントがつながっているスロットのビットマップ */
+  uint64_t occupied[WHEEL_LEVELS];
+  /* 各段のスロットごとの双方向リスト(番兵) */
+  TimerEvent slots[WHEEL_LEVELS][WHEEL_SIZE];
+  /* 最上段にも収まらない遠い未来のイベント */
+  TimerEvent overflow;
+} Scheduler;
+
+/* スケジューラを初期化する */
+void sched_init(Scheduler* sched);
+
+/* 時刻を0に戻し、残っている予定を捨てる
+ *
+ * 予定がすべて取り消されていればホイールのリストは空のままなので、時刻だけを戻す
+ */
+void sched_reset(Scheduler* sched);
+
+/* 時刻whenにfunc(context)を呼ぶイベントを登録する(登録済みなら予定を変更する) */
+void sched_add(Scheduler* sched, TimerEvent* event, uint64_t when, event_func_t* func, void* context);
+
+/* 登録したイベントを取り消す */
+void sched_cancel(Scheduler* sched, TimerEvent* event);
+
+/* 時刻nowまでに予定されているイベントを時刻順に発火させる */
+void sched_run(Scheduler* sched, uint64_t now);
+
+/* 次にイベントが予定されている時刻を返す
+ *
+ * メインループはブロックの境界で仮想時間とこの値を比べ、
+ * 超えていたときだけsched_runを呼べばよい
+ */
+static inline uint64_t sched_next_time(Scheduler* sched) {
+  return sched->next_time;
+}
+
+#endif
@@ -0,0 +1,150 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <x86intrin.h>
+
+#include "emulator_function.h"
+#include "instruction.h"
+
+/* 統計を取る命令の数(1バイトのオペコードと、83 /0〜7, FF /0〜7) */
+#define STATS_GROUP_83 256
+#define STATS_GROUP_FF (256 + 8)
+#define STATS_ENTRIES  (256 + 16)
+
+/* 実行時間のヒストグラムの区間の数(i番目の区間は2^i〜2^(i+1)-1サイクル) */
+#define STATS_BUCKETS 32
+
+typedef struct {
+  uint64_t count;
+  uint64_t cycles;
+  uint64_t histogram[STATS_BUCKETS];
+} OpcodeStats;
+
+static int enabled;
+static OpcodeStats stats[STATS_ENTRIES];
+/* 置き換える前の実行関数 */
+static instruction_func_t* handlers[256];
+/* rdtscを続けて2回呼んだときの差。測った時間から引いておく */
+static uint64_t rdtsc_overhead;
+
+/* 実行時間の区間の番号 */
+static int bucket_of(uint64_t cycles) {
+  return cycles == 0 ? 0 : 63 - __builtin_clzll(cycles);
+}
+
+/* 命令を実行し、回数と時間を記録する */
+static void counted(Emulator* emu) {
+  uint8_t code = get_code8(emu, 0);
+  int index    = code;
+  uint64_t start, cycles;
+  OpcodeStats* entry;
+
+  if(code == 0x83) {
+    index = STATS_GROUP_83 + ((get_code8(emu, 1) >> 3) & 7);
+  } else if(code == 0xFF) {
+    index = STATS_GROUP_FF + ((get_code8(emu, 1) >> 3) & 7);
+  }
+
+  start = __rdtsc();
+  handlers[code](emu);
+  cycles = __rdtsc() - start;
+  cycles = cycles > rdtsc_overhead ? cycles - rdtsc_overhead : 0;
+
+  entry = &stats[index];
+  entry->count++;
+  entry->cycles += cycles;
+  entry->histogram[bucket_of(cycles)]++;
+}
+
+void stats_enable(void) {
+  int i;
+
+  /* 一番短かった回をrdtsc自体にかかる時間とみなす */
+  rdtsc_overhead = UINT64_MAX;
+  for(i = 0; i < 1000; i++) {
+    uint64_t start = __rdtsc();
+    uint64_t cycles = __rdtsc() - start;
+    if(cycles < rdtsc_overhead) {
+      rdtsc_overhead = cycles;
+    }
+  }
+
+  for(i = 0; i < 256; i++) {
+    handlers[i] = instructions[i];
+    if(instructions[i] != NULL) {
+      instructions[i] = counted;
+    }
+  }
+  enabled = 1;
+}
+
+/* 命令の表示名 */
+static void name_of(int index, char* buf, size_t size) {
+  if(index >= STATS_GROUP_FF) {
+    snprintf(buf, size, "FF /%d", index - STATS_GROUP_FF);
+  } else if(index >= STATS_GROUP_83) {
+    snprintf(buf, size, "83 /%d", index - STATS_GROUP_83);
+  } else {
+    snprintf(buf, size, "%02X", index);
+  }
+}
+
+/* ヒストグラムから、全体のratioの回数が収まる区間の上限を求める */
+static uint64_t percentile(OpcodeStats* entry, double ratio) {
+  uint64_t target = entry->count * ratio;
+  uint64_t seen   = 0;
+  int i;
+
+  for(i = 0; i < STATS_BUCKETS; i++) {
+    seen += entry->histogram[i];
+    if(seen > target) {
+      break;
+    }
+  }
+  return (2ull << i) - 1;
+}
+
+static int compare_cycles(const void* a, const void* b) {
+  const OpcodeStats* x = &stats[*(const int*)a];
+  const OpcodeStats* y = &stats[*(const int*)b];
+  return x->cycles < y->cycles ? 1 : x->cycles > y->cycles ? -1 : 0;
+}
+
+void stats_dump(void) {
+  int order[STATS_ENTRIES];
+  int count = 0;
+  uint64_t total_count  = 0;
+  uint64_t total_cycles = 0;
+  int i;
+
+  if(!enabled) {
+    return;
+  }
+  for(i = 0; i < STATS_ENTRIES; i++) {
+    if(stats[i].count > 0) {
+      order[count++] = i;
+      total_count  += stats[i].count;
+      total_cycles += stats[i].cycles;
+    }
+  }
+  qsort(order, count, sizeof(int), compare_cycles);
+
+  /* p50, p99は2のべき乗の区間の上限なので、おおよその値 */
+  printf("\n%-6s %12s %6s %14s %6s %8s %6s %6s\n",
+         "opcode", "count", "count%", "cycles", "cyc%", "cyc/op", "p50", "p99");
+  for(i = 0; i < count; i++) {
+    OpcodeStats* entry = &stats[order[i]];
+    char name[16];
+    name_of(order[i], name, sizeof(name));
+    printf("%-6s %12llu %5.1f%% %14llu %5.1f%% %8.1f %6llu %6llu\n", name,
+           (unsigned long long)entry->count, 100.0 * entry->count / total_count,
+           (unsigned long long)entry->cycles, total_cycles ? 100.0 * entry->cycles / total_cycles : 0.0,
+           (double)entry->cycles / entry->count,
+           (unsigned long long)percentile(entry, 0.5), (unsigned long long)percentile(entry, 0.99));
+  }
+  printf("%-6s %12llu %6s %14llu (rdtsc overhead %llu cycles subtracted)\n", "total",
+         (unsigned long long)total_count, "", (unsigned long long)total_cycles,
+         (unsigned long long)rdtsc_overhead);
+}
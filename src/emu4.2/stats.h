@@ -0,0 +1,17 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+/* 命令ごとの実行回数と実行時間の統計
+ *
+ * 有効にするとinstructions配列の各要素を、回数を数えてrdtscで実行時間を測る
+ * ラッパーに置き換える。メインループは変わらないので、有効にしなければ何も増えない。
+ * 83とFFはModR/MのREGビットで命令が決まるので、REGビットごとに分けて数える
+ */
+
+/* init_instructionsの後に呼ぶと、以降に実行する命令の統計を取る */
+void stats_enable(void);
+
+/* 統計を取っていれば、実行時間の合計の多い順に表にして標準出力に出す */
+void stats_dump(void);
+
+#endif
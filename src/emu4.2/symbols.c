@@ -0,0 +1,194 @@
+#include "symbols.h"
+
+#include <ctype.h>
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void add_symbol(Symbols* symbols, int* capacity, uint32_t address, uint32_t size, const char* name) {
+  if(symbols->count == *capacity) {
+    *capacity = *capacity == 0 ? 64 : *capacity * 2;
+    symbols->symbols = realloc(symbols->symbols, sizeof(Symbol) * *capacity);
+  }
+  symbols->symbols[symbols->count].address = address;
+  symbols->symbols[symbols->count].size    = size;
+  symbols->symbols[symbols->count].name    = strdup(name);
+  symbols->count++;
+}
+
+/* ELFのシンボルテーブルから、関数とラベル(種類のないシンボル)を読む */
+static void load_elf(Symbols* symbols, const uint8_t* data, size_t size) {
+  const Elf32_Ehdr* ehdr = (const Elf32_Ehdr*)data;
+  const Elf32_Shdr* shdrs;
+  int capacity = 0;
+  int i;
+
+  if(size < sizeof(Elf32_Ehdr) || ehdr->e_ident[EI_CLASS] != ELFCLASS32
+     || ehdr->e_shoff == 0 || ehdr->e_shoff + (size_t)ehdr->e_shnum * sizeof(Elf32_Shdr) > size) {
+    return;
+  }
+  shdrs = (const Elf32_Shdr*)(data + ehdr->e_shoff);
+
+  for(i = 0; i < ehdr->e_shnum; i++) {
+    const Elf32_Shdr* symtab = &shdrs[i];
+    const Elf32_Shdr* strtab;
+    uint32_t j;
+
+    if(symtab->sh_type != SHT_SYMTAB || symtab->sh_link >= ehdr->e_shnum
+       || symtab->sh_offset + (size_t)symtab->sh_size > size) {
+      continue;
+    }
+    strtab = &shdrs[symtab->sh_link];
+    if(strtab->sh_offset + (size_t)strtab->sh_size > size) {
+      continue;
+    }
+    for(j = 0; j < symtab->sh_size / sizeof(Elf32_Sym); j++) {
+      const Elf32_Sym* sym = (const Elf32_Sym*)(data + symtab->sh_offset) + j;
+      int type = ELF32_ST_TYPE(sym->st_info);
+      if((type != STT_FUNC && type != STT_NOTYPE) || sym->st_shndx == SHN_UNDEF
+         || sym->st_name == 0 || sym->st_name >= strtab->sh_size) {
+        continue;
+      }
+      add_symbol(symbols, &capacity, sym->st_value, sym->st_size,
+                 (const char*)data + strtab->sh_offset + sym->st_name);
+    }
+  }
+}
+
+/* 識別子として使える文字列か */
+static int is_identifier(const char* s) {
+  if(!isalpha((unsigned char)*s) && *s != '_' && *s != '.') {
+    return 0;
+  }
+  for(; *s != '\0'; s++) {
+    if(!isalnum((unsigned char)*s) && *s != '_' && *s != '.' && *s != '$') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* マップファイルかnmの出力を1行ずつ読む */
+static void load_text(Symbols* symbols, char* text) {
+  int capacity = 0;
+  char* line;
+  char* save;
+
+  for(line = strtok_r(text, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+    char* words[4];
+    int count = 0;
+    char* word;
+    char* word_save;
+    char* end;
+    unsigned long address;
+
+    for(word = strtok_r(line, " \t\r", &word_save); word != NULL && count < 4;
+        word = strtok_r(NULL, " \t\r", &word_save)) {
+      words[count++] = word;
+    }
+    /* 「番地 名前」(マップファイル)か「番地 種類 名前」(nm)の行だけを使う */
+    if(count == 3 && strlen(words[1]) == 1) {
+      words[1] = words[2];
+    } else if(count != 2) {
+      continue;
+    }
+    address = strtoul(words[0], &end, 16);
+    if(*end != '\0' || end == words[0] || !is_identifier(words[1])) {
+      continue;
+    }
+    add_symbol(symbols, &capacity, address, 0, words[1]);
+  }
+}
+
+static int compare_address(const void* a, const void* b) {
+  const Symbol* x = a;
+  const Symbol* y = b;
+  return x->address < y->address ? -1 : x->address > y->address ? 1 : 0;
+}
+
+Symbols* load_symbols(const char* filename) {
+  FILE* file = fopen(filename, "rb");
+  Symbols* symbols;
+  uint8_t* data;
+  long size;
+  int i, count;
+
+  if(file == NULL) {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  data = malloc(size + 1);
+  if(size < 0 || fread(data, 1, size, file) != (size_t)size) {
+    free(data);
+    fclose(file);
+    return NULL;
+  }
+  fclose(file);
+  data[size] = '\0';
+
+  symbols = calloc(1, sizeof(Symbols));
+  if(size >= SELFMAG && memcmp(data, ELFMAG, SELFMAG) == 0) {
+    load_elf(symbols, data, size);
+  } else {
+    load_text(symbols, (char*)data);
+  }
+  free(data);
+
+  if(symbols->count == 0) {
+    free_symbols(symbols);
+    return NULL;
+  }
+
+  /* 番地の順に並べ、同じ番地に付いた名前は最初の1つだけにする */
+  qsort(symbols->symbols, symbols->count, sizeof(Symbol), compare_address);
+  count = 1;
+  for(i = 1; i < symbols->count; i++) {
+    if(symbols->symbols[i].address == symbols->symbols[count - 1].address) {
+      if(symbols->symbols[count - 1].size == 0) {
+        symbols->symbols[count - 1].size = symbols->symbols[i].size;
+      }
+      free(symbols->symbols[i].name);
+    } else {
+      symbols->symbols[count++] = symbols->symbols[i];
+    }
+  }
+  symbols->count = count;
+  return symbols;
+}
+
+void free_symbols(Symbols* symbols) {
+  int i;
+
+  for(i = 0; i < symbols->count; i++) {
+    free(symbols->symbols[i].name);
+  }
+  free(symbols->symbols);
+  free(symbols);
+}
+
+const Symbol* symbol_lookup(const Symbols* symbols, uint32_t address) {
+  int low  = 0;
+  int high = symbols->count;
+  const Symbol* symbol;
+
+  /* address以下で最大の番地のシンボルを二分探索する */
+  while(low < high) {
+    int mid = (low + high) / 2;
+    if(symbols->symbols[mid].address <= address) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if(low == 0) {
+    return NULL;
+  }
+  symbol = &symbols->symbols[low - 1];
+  if(symbol->size != 0 && address - symbol->address >= symbol->size) {
+    return NULL;
+  }
+  return symbol;
+}
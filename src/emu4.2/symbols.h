@@ -0,0 +1,33 @@
+#ifndef SYMBOLS_H_
+#define SYMBOLS_H_
+
+#include <stdint.h>
+
+/* ゲストのプログラムのシンボル(関数やラベルの番地) */
+typedef struct {
+  uint32_t address;
+  /* バイト数。わからなければ0(次のシンボルの手前までとみなす) */
+  uint32_t size;
+  char* name;
+} Symbol;
+
+/* 番地の順に並べたシンボルの表 */
+typedef struct {
+  Symbol* symbols;
+  int count;
+} Symbols;
+
+/* filenameからシンボルを読み込む
+ *
+ * ELF(32bit)ならシンボルテーブルを、それ以外はテキストとして
+ * リンカのマップファイル(ld -Map)の「番地 名前」の行か、nmの「番地 種類 名前」の行を読む。
+ * 開けないかシンボルが1つもなければNULLを返す
+ */
+Symbols* load_symbols(const char* filename);
+
+void free_symbols(Symbols* symbols);
+
+/* addressを含むシンボルを返す。なければNULLを返す */
+const Symbol* symbol_lookup(const Symbols* symbols, uint32_t address);
+
+#endif
@@ -0,0 +1,79 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* dataのnバイトを全て書く。書けなければ-1を返す */
+static int write_all(int fd, const void* data, size_t n) {
+  const uint8_t* p = data;
+
+  while(n > 0) {
+    ssize_t written = write(fd, p, n);
+    if(written < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += written;
+    n -= written;
+  }
+  return 0;
+}
+
+Trace* open_trace(const char* filename, uint32_t flags, Emulator* emu) {
+  TraceHeader header;
+  Trace* trace;
+  int fd;
+
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    return NULL;
+  }
+  trace = malloc(sizeof(Trace));
+  if(trace == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.flags   = flags;
+  header.eip     = emu->eip;
+  memcpy(header.registers, emu->registers, sizeof(header.registers));
+  header.eflags  = emu->eflags;
+
+  trace->fd     = fd;
+  trace->flags  = flags;
+  trace->eip    = emu->eip;
+  memcpy(trace->registers, emu->registers, sizeof(trace->registers));
+  trace->eflags = emu->eflags;
+  trace->error  = 0;
+  /* ヘッダもバッファに入れ、最初のレコードと一緒に書き出す */
+  memcpy(trace->buffer, &header, sizeof(header));
+  trace->used   = sizeof(header);
+  return trace;
+}
+
+void trace_flush(Trace* trace) {
+  if(!trace->error && write_all(trace->fd, trace->buffer, trace->used) < 0) {
+    trace->error = 1;
+  }
+  trace->used = 0;
+}
+
+int close_trace(Trace* trace) {
+  int result;
+
+  trace_flush(trace);
+  if(close(trace->fd) < 0) {
+    trace->error = 1;
+  }
+  result = trace->error ? -1 : 0;
+  free(trace);
+  return result;
+}
@@ -0,0 +1,139 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* 実行した命令を1つずつ記録するバイナリのトレース
+ *
+ * ファイルの先頭にTraceHeaderを置き、その後に実行した命令ごとに1つのレコードが続く。
+ * レコードの形式は次のとおり(varintは下位から7bitずつ、続きがあれば最上位ビットを立てる)
+ *
+ *   varint  (zigzag(EIP - 前の命令のEIP) << 1) | レジスタが変化していれば1
+ *   u8      命令の1バイト目
+ *   varint  変化したレジスタのビットマスク(ビット0から7が汎用レジスタ、ビット8がEFLAGS)
+ *   varint  ビットの立ったレジスタごとに、zigzag(新しい値 - 前の値)
+ *
+ * 後ろの2つはTRACE_REGISTERSを指定し、前のレコードからレジスタが変化したときだけ置く。
+ * レジスタの値はその命令を実行する直前のもの。ほとんどの命令は3バイトに収まる。
+ * x86-tracedumpで読める形にする
+ */
+
+#define TRACE_MAGIC   "X86TRACE"
+#define TRACE_VERSION 1
+
+/* TraceHeaderのflags */
+#define TRACE_REGISTERS 1 /* レジスタの変化も記録する */
+
+/* レジスタのビットマスクでEFLAGSを表すビット */
+#define TRACE_EFLAGS_BIT REGISTERS_COUNT
+
+/* ファイルの先頭(ホストのバイト順) */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  /* トレースを始めたときのEIPとレジスタ */
+  uint32_t eip;
+  uint32_t registers[REGISTERS_COUNT];
+  uint32_t eflags;
+} TraceHeader;
+
+/* 書き出す前にレコードをためておくバイト数 */
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+/* 1つのレコードの最大のバイト数 */
+#define TRACE_RECORD_MAX (10 + 1 + 2 + (REGISTERS_COUNT + 1) * 5)
+
+typedef struct Trace {
+  int fd;
+  uint32_t flags;
+  /* 前のレコードのEIPとレジスタ */
+  uint32_t eip;
+  uint32_t registers[REGISTERS_COUNT];
+  uint32_t eflags;
+  /* 書き込みに失敗したら1。以降のレコードは捨てる */
+  int error;
+  size_t used;
+  uint8_t buffer[TRACE_BUFFER_SIZE];
+} Trace;
+
+/* filenameを作成または切り詰めて開き、emuの今の状態をヘッダに書く
+ *
+ * flagsはTRACE_REGISTERSか0。開けなければNULLを返す
+ */
+Trace* open_trace(const char* filename, uint32_t flags, Emulator* emu);
+
+/* 残りのレコードを書き出して閉じる。途中で書き込みに失敗していれば-1を返す */
+int close_trace(Trace* trace);
+
+/* たまっているレコードを書き出す */
+void trace_flush(Trace* trace);
+
+static inline uint32_t trace_zigzag(int32_t value) {
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline uint8_t* trace_put_varint(uint8_t* p, uint64_t value) {
+  while(value >= 0x80) {
+    *p++ = (uint8_t)value | 0x80;
+    value >>= 7;
+  }
+  *p++ = (uint8_t)value;
+  return p;
+}
+
+/* これからeipで実行する命令を、実行する直前のregistersとeflagsとともに記録する */
+/* 1命令ごとに呼ばれるので、関数呼び出しを省けるようヘッダに置く */
+static inline void trace_record(Trace* trace, uint32_t eip, uint8_t code,
+                                const uint32_t* registers, uint32_t eflags) {
+  uint8_t* p;
+  uint32_t mask = 0;
+  uint64_t head;
+  int i;
+
+  if(TRACE_BUFFER_SIZE - trace->used < TRACE_RECORD_MAX) {
+    trace_flush(trace);
+  }
+  p = trace->buffer + trace->used;
+
+  if(trace->flags & TRACE_REGISTERS) {
+    /* 分岐の予測を外さないよう、比べた結果をそのままビットにする */
+    for(i = 0; i < REGISTERS_COUNT; i++) {
+      mask |= (uint32_t)(registers[i] != trace->registers[i]) << i;
+    }
+    mask |= (uint32_t)(eflags != trace->eflags) << TRACE_EFLAGS_BIT;
+  }
+
+  head = (uint64_t)trace_zigzag((int32_t)(eip - trace->eip)) << 1;
+  p = trace_put_varint(p, head | (mask != 0));
+  *p++ = code;
+  trace->eip = eip;
+
+  if(mask != 0) {
+    uint32_t rest = mask & ((1 << REGISTERS_COUNT) - 1);
+
+    p = trace_put_varint(p, mask);
+    /* 変化したレジスタだけを順に書く */
+    while(rest != 0) {
+      i = __builtin_ctz(rest);
+      p = trace_put_varint(p, trace_zigzag((int32_t)(registers[i] - trace->registers[i])));
+      trace->registers[i] = registers[i];
+      rest &= rest - 1;
+    }
+    if(mask & (1 << TRACE_EFLAGS_BIT)) {
+      p = trace_put_varint(p, trace_zigzag((int32_t)(eflags - trace->eflags)));
+      trace->eflags = eflags;
+    }
+  }
+  trace->used = p - trace->buffer;
+}
+
+/* これから実行する命令を、emuのレジスタとともに記録する */
+static inline void trace_instruction(Trace* trace, Emulator* emu, uint8_t code) {
+  trace_record(trace, emu->eip, code, emu->registers, emu->eflags);
+}
+
+#endif
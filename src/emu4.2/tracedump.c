@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "trace.h"
+#include "symbols.h"
+
+/* x86の-tで書いたバイナリのトレースを読み、1命令1行のテキストにする
+ *
+ * 各行はx86を-qなしで実行したときと同じ「EIP = %X, Code = %02X」で始まるので、
+ * そのままdiffで比べられる。レジスタも記録していれば、変化したレジスタを後ろに付ける
+ */
+
+static char* registers_name[] = {
+  "EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI"};
+
+/* 読めたら0、トレースが終わっていれば-1を返す */
+static int read_varint(FILE* file, uint64_t* value) {
+  uint64_t result = 0;
+  int shift = 0;
+  int c;
+
+  do {
+    c = getc_unlocked(file);
+    if(c == EOF || shift > 63) {
+      return -1;
+    }
+    result |= (uint64_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while(c & 0x80);
+  *value = result;
+  return 0;
+}
+
+static int32_t unzigzag(uint64_t value) {
+  return (int32_t)((uint32_t)(value >> 1) ^ -(uint32_t)(value & 1));
+}
+
+/* 1命令分のレコードを読み、1行出す。トレースが終わっていれば-1を返す */
+static int dump_record(FILE* file, TraceHeader* state, const Symbols* symbols) {
+  uint64_t head, mask, delta;
+  int code;
+  int i;
+
+  if(read_varint(file, &head) < 0) {
+    return -1;
+  }
+  code = getc_unlocked(file);
+  if(code == EOF) {
+    return -1;
+  }
+  state->eip += unzigzag(head >> 1);
+
+  printf("EIP = %X, Code = %02X", state->eip, code);
+  if(symbols != NULL) {
+    const Symbol* symbol = symbol_lookup(symbols, state->eip);
+    if(symbol != NULL) {
+      printf("  <%s+0x%x>", symbol->name, state->eip - symbol->address);
+    }
+  }
+
+  if(head & 1) {
+    if(read_varint(file, &mask) < 0) {
+      return -1;
+    }
+    for(i = 0; i < REGISTERS_COUNT; i++) {
+      if(mask & (1 << i)) {
+        if(read_varint(file, &delta) < 0) {
+          return -1;
+        }
+        state->registers[i] += unzigzag(delta);
+        printf(" %s=%08x", registers_name[i], state->registers[i]);
+      }
+    }
+    if(mask & (1 << TRACE_EFLAGS_BIT)) {
+      if(read_varint(file, &delta) < 0) {
+        return -1;
+      }
+      state->eflags += unzigzag(delta);
+      printf(" EFLAGS=%08x", state->eflags);
+    }
+  }
+  putchar('\n');
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  TraceHeader header;
+  Symbols* symbols = NULL;
+  FILE* file;
+  uint64_t count = 0;
+  int i;
+
+  /* -S fileでシンボルを読み、命令ごとに関数名を付ける */
+  if(argc == 4 && strcmp(argv[1], "-S") == 0) {
+    symbols = load_symbols(argv[2]);
+    if(symbols == NULL) {
+      printf("%s からシンボルを読めません\n", argv[2]);
+      return 1;
+    }
+    argv += 2;
+    argc -= 2;
+  }
+  if(argc != 2) {
+    printf("usage: x86-tracedump [-S symbols] tracefile\n");
+    return 1;
+  }
+
+  file = fopen(argv[1], "rb");
+  if(file == NULL) {
+    printf("%s ファイルを開けません\n", argv[1]);
+    return 1;
+  }
+  if(fread(&header, sizeof(header), 1, file) != 1
+     || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+     || header.version != TRACE_VERSION) {
+    printf("%s はトレースのファイルではありません\n", argv[1]);
+    fclose(file);
+    return 1;
+  }
+
+  if(header.flags & TRACE_REGISTERS) {
+    for(i = 0; i < REGISTERS_COUNT; i++) {
+      printf("%s = %08x\n", registers_name[i], header.registers[i]);
+    }
+    printf("EFLAGS = %08x\n", header.eflags);
+  }
+
+  while(dump_record(file, &header, symbols) == 0) {
+    count++;
+  }
+  fprintf(stderr, "%llu instructions\n", (unsigned long long)count);
+
+  fclose(file);
+  if(symbols != NULL) {
+    free_symbols(symbols);
+  }
+  return 0;
+}
@@ -0,0 +1,575 @@
+#include "uart.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "emulator_function.h"
+#include "interrupt.h"
+#include "io.h"
+#include "replay.h"
+#include "sched.h"
+#include "vga.h"
+
+/* レジスタのオフセット */
+enum {
+  UART_RBR = 0, /* 受信バッファ(読み込み) / 送信保持レジスタ(書き込み) */
+  UART_IER = 1,
+  UART_IIR = 2, /* 割り込み識別(読み込み) / FIFO制御(書き込み) */
+  UART_LCR = 3,
+  UART_MCR = 4,
+  UART_LSR = 5,
+  UART_MSR = 6,
+  UART_SCR = 7,
+};
+
+/* LCRの最上位ビットが立っているとき、0番と1番はボーレートの分周比になる */
+#define UART_LCR_DLAB (1 << 7)
+
+/* 受信の割り込みが許可されているとき、ホストの入力を調べる間隔(仮想時間) */
+#define UART_POLL_INTERVAL 10000
+
+/* 入力の記録と再生で、ホストの入力が終わったことを表す値(受信データの1バイトと区別する) */
+#define UART_INPUT_EOF 0x100
+
+/* まだホストの入力を調べていないときのsampledの値 */
+#define UART_NOT_SAMPLED UINT64_MAX
+
+/* ホストの入力を読み込むスレッドとの間のリングバッファ
+ *
+ * 読み込みスレッドが書き込み、エミュレータのスレッドが読み出す単一生産者・単一消費者のキュー。
+ * 普段はロックを取らず、相手を待つときだけmutexとcondを使う
+ */
+typedef struct {
+  uint8_t buffer[UART_HOST_BUFFER_SIZE];
+  _Atomic uint32_t head;
+  _Atomic uint32_t tail;
+  /* ホストの入力が終わった(EOFまたはエラー) */
+  atomic_int eof;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  atomic_int consumer_waiting;
+  atomic_int producer_waiting;
+
+  int fd;
+  /* 読み込みスレッドを止めるためのeventfd */
+  int stop_fd;
+  atomic_int stop;
+  int started;
+  pthread_t thread;
+} HostInput;
+
+struct Uart {
+  Emulator* emu;
+  /* 登録した先頭のポート番号(記録と再生のレコードに付ける) */
+  uint16_t address;
+
+  uint8_t rx_fifo[UART_FIFO_SIZE];
+  int rx_head;
+  int rx_count;
+  /* ホストの入力が終わり、最後まで受信FIFOへ移した */
+  int eof;
+  /* 最後にホストの入力を調べた仮想時刻 */
+  uint64_t sampled;
+
+  uint8_t ier;
+  uint8_t lcr;
+  uint8_t mcr;
+  uint8_t scr;
+  uint8_t dll;
+  uint8_t dlm;
+  uint8_t fcr;
+
+  /* 割り込み要求を出している状態か。出ていない状態から出た状態になったときにUART_IRQを出す */
+  int irq_line;
+  TimerEvent poll_event;
+  int poll_scheduled;
+
+  HostInput input;
+};
+
+/* 待っている相手がいれば起こす */
+static void wake(HostInput* input, atomic_int* waiting) {
+  if(atomic_load(waiting)) {
+    pthread_mutex_lock(&input->lock);
+    pthread_cond_broadcast(&input->cond);
+    pthread_mutex_unlock(&input->lock);
+  }
+}
+
+/* 読み込んだバイト列をリングバッファに積む。バッファが一杯なら空くまで待つ */
+static int push_input(HostInput* input, const uint8_t* data, size_t n) {
+  size_t i = 0;
+
+  while(i < n) {
+    uint32_t tail = atomic_load_explicit(&input->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&input->head, memory_order_acquire);
+
+    if(tail - head == UART_HOST_BUFFER_SIZE) {
+      /* 1バイト空くたびに起こされないよう、半分まで空くのを待つ */
+      pthread_mutex_lock(&input->lock);
+      atomic_store(&input->producer_waiting, 1);
+      while(atomic_load(&input->tail) - atomic_load(&input->head) > UART_HOST_BUFFER_SIZE / 2
+            && !atomic_load(&input->stop)) {
+        pthread_cond_wait(&input->cond, &input->lock);
+      }
+      atomic_store(&input->producer_waiting, 0);
+      pthread_mutex_unlock(&input->lock);
+      if(atomic_load(&input->stop)) {
+        return -1;
+      }
+      continue;
+    }
+    while(i < n && tail - head < UART_HOST_BUFFER_SIZE) {
+      input->buffer[tail & (UART_HOST_BUFFER_SIZE - 1)] = data[i++];
+      tail++;
+    }
+    atomic_store_explicit(&input->tail, tail, memory_order_release);
+    wake(input, &input->consumer_waiting);
+  }
+  return 0;
+}
+
+/* ホストの入力を読み込むスレッド */
+static void* input_thread(void* arg) {
+  HostInput* input = arg;
+  uint8_t buf[512];
+  int epfd = epoll_create1(0);
+  int use_epoll = 0;
+  struct epoll_event ev = { .events = EPOLLIN };
+
+  /* 通常のファイルはepollに登録できないので、その場合は常に読めるものとして扱う */
+  if(epfd >= 0) {
+    ev.data.fd = input->fd;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, input->fd, &ev) == 0) {
+      ev.data.fd = input->stop_fd;
+      epoll_ctl(epfd, EPOLL_CTL_ADD, input->stop_fd, &ev);
+      use_epoll = 1;
+    }
+  }
+
+  while(!atomic_load(&input->stop)) {
+    ssize_t n;
+
+    if(use_epoll) {
+      struct epoll_event events[2];
+      int i, count, readable = 0;
+
+      count = epoll_wait(epfd, events, 2, -1);
+      if(count < 0 && errno == EINTR) {
+        continue;
+      }
+      for(i = 0; i < count; i++) {
+        if(events[i].data.fd == input->fd) {
+          readable = 1;
+        }
+      }
+      if(!readable) {
+        continue;
+      }
+    }
+
+    n = read(input->fd, buf, sizeof(buf));
+    if(n < 0 && (errno == EINTR || errno == EAGAIN)) {
+      continue;
+    }
+    if(n <= 0) {
+      break;
+    }
+    if(push_input(input, buf, n) < 0) {
+      break;
+    }
+  }
+
+  atomic_store(&input->eof, 1);
+  wake(input, &input->consumer_waiting);
+  if(epfd >= 0) {
+    close(epfd);
+  }
+  return NULL;
+}
+
+/* 最初に受信側が使われたときに読み込みスレッドを起動する */
+static void start_input(HostInput* input) {
+  if(!input->started) {
+    input->started = 1;
+    pthread_create(&input->thread, NULL, input_thread, input);
+  }
+}
+
+/* 入力を記録と再生のログから受け取っているか */
+static int replaying(Uart* uart) {
+  return uart->emu->replay != NULL && replay_mode(uart->emu->replay) == REPLAY_PLAY;
+}
+
+/* ホストの入力の1バイトかUART_INPUT_EOFを受け取る。入力を記録していればログにも書く */
+static void take_input(Uart* uart, uint32_t value) {
+  Emulator* emu = uart->emu;
+
+  if(emu->replay != NULL && replay_mode(emu->replay) == REPLAY_RECORD) {
+    replay_record(emu->replay, emu->vtime, uart->address, value);
+  }
+  if(value == UART_INPUT_EOF) {
+    uart->eof = 1;
+    return;
+  }
+  uart->rx_fifo[(uart->rx_head + uart->rx_count) % UART_FIFO_SIZE] = value;
+  uart->rx_count++;
+}
+
+/* ホストの入力から受信FIFOへ移す
+ *
+ * 受信データが見え始める時機がホストしだいで変わるのはここだけなので、記録中は移したバイトと
+ * 入力の終わりを仮想時刻とともにログに書き、再生中はホストの代わりにログから移す。
+ * 記録したときと同じ命令で見え始めるよう、ホストの入力を調べるのは1命令につき1回にする
+ */
+static void fill_rx_fifo(Uart* uart) {
+  Emulator* emu    = uart->emu;
+  HostInput* input = &uart->input;
+  uint32_t head, tail, value;
+  int eof;
+
+  if(uart->eof || uart->sampled == emu->vtime) {
+    return;
+  }
+  uart->sampled = emu->vtime;
+
+  if(replaying(uart)) {
+    while(uart->rx_count < UART_FIFO_SIZE && !uart->eof
+          && replay_poll(emu->replay, emu->vtime, uart->address, &value)) {
+      take_input(uart, value);
+    }
+    return;
+  }
+
+  start_input(input);
+  /* 読み込みスレッドは最後のデータを置いてからeofを立てるので、eofを先に読む */
+  eof  = atomic_load(&input->eof);
+  head = atomic_load_explicit(&input->head, memory_order_relaxed);
+  tail = atomic_load_explicit(&input->tail, memory_order_acquire);
+  if(head != tail) {
+    while(head != tail && uart->rx_count < UART_FIFO_SIZE) {
+      take_input(uart, input->buffer[head & (UART_HOST_BUFFER_SIZE - 1)]);
+      head++;
+    }
+    atomic_store_explicit(&input->head, head, memory_order_release);
+    if(tail - head <= UART_HOST_BUFFER_SIZE / 2) {
+      wake(input, &input->producer_waiting);
+    }
+  }
+  if(eof && head == tail) {
+    take_input(uart, UART_INPUT_EOF);
+  }
+}
+
+/* 受信データが届くか入力が終わるまで待つ
+ *
+ * 待った後は同じ命令の中でもホストの入力を調べ直す。
+ * 再生中は待たずに、記録したときこの時刻に届いていた入力をログから受け取る
+ */
+static void wait_input(Uart* uart) {
+  HostInput* input = &uart->input;
+
+  uart->sampled = UART_NOT_SAMPLED;
+  if(replaying(uart)) {
+    take_input(uart, replay_play(uart->emu->replay, uart->emu->vtime, uart->address));
+    return;
+  }
+
+  /* 入力を待つ前に、プロンプトなどの出力を画面に出しておく */
+  if(uart->emu->vga != NULL) {
+    vga_refresh(uart->emu->vga);
+  }
+  output_flush(&uart->emu->output);
+
+  pthread_mutex_lock(&input->lock);
+  atomic_store(&input->consumer_waiting, 1);
+  while(atomic_load(&input->head) == atomic_load(&input->tail) && !atomic_load(&input->eof)) {
+    pthread_cond_wait(&input->cond, &input->lock);
+  }
+  atomic_store(&input->consumer_waiting, 0);
+  pthread_mutex_unlock(&input->lock);
+}
+
+/* ゲストがポーリングのループに入ったときに呼ばれる */
+/* 受信側のレジスタは受信データが届くか入力が終わるまで変わらないので、それまで眠る */
+static void uart_wait(void* context, uint16_t address) {
+  Uart* uart = context;
+
+  /* 再生中の入力はホストを待たずに記録した時刻に届くので、眠らずに読み直させる */
+  if(replaying(uart)) {
+    return;
+  }
+  switch(address & 7) {
+  case UART_RBR:
+  case UART_IIR:
+  case UART_LSR:
+    if(!(uart->lcr & UART_LCR_DLAB) && !uart_input_ready(uart)) {
+      wait_input(uart);
+    }
+    break;
+  }
+}
+
+int uart_input_ready(Uart* uart) {
+  fill_rx_fifo(uart);
+  return uart->rx_count > 0 || uart->eof;
+}
+
+int uart_irq_pending(Uart* uart) {
+  if((uart->ier & UART_IER_RDI) && uart->rx_count > 0) {
+    return 1;
+  }
+  /* 送信はすぐに出力バッファへ移るので、送信保持レジスタは常に空 */
+  return (uart->ier & UART_IER_THRI) != 0;
+}
+
+/* 割り込み要求が新しく出たら、UART_IRQの割り込みを出す */
+static void update_irq(Uart* uart) {
+  int pending = uart_irq_pending(uart);
+
+  if(pending && !uart->irq_line) {
+    raise_irq(uart->emu, UART_IRQ);
+  }
+  uart->irq_line = pending;
+}
+
+static void schedule_poll(Uart* uart);
+
+static void uart_poll(void* context) {
+  Uart* uart    = context;
+  Emulator* emu = uart->emu;
+
+  uart->poll_scheduled = 0;
+  /* hltで止まっているゲストは受信の割り込みを待っているだけなので、ほかに予定がなければここで入力を待つ */
+  if(emu->halted && !uart_input_ready(uart) && sched_next_time(emu->sched) == SCHED_NEVER) {
+    wait_input(uart);
+  }
+  fill_rx_fifo(uart);
+  update_irq(uart);
+  schedule_poll(uart);
+}
+
+/* 受信の割り込みが許可されていて、まだ入力が届く見込みがあれば、しばらく後にホストの入力を調べる */
+static void schedule_poll(Uart* uart) {
+  if(!(uart->ier & UART_IER_RDI) || uart->poll_scheduled) {
+    return;
+  }
+  if(uart->rx_count == 0 && uart->eof) {
+    return;
+  }
+  uart->poll_scheduled = 1;
+  sched_add(uart->emu->sched, &uart->poll_event, uart->emu->vtime + UART_POLL_INTERVAL, uart_poll, uart);
+}
+
+static uint8_t read_lsr(Uart* uart) {
+  uint8_t lsr = UART_LSR_THRE | UART_LSR_TEMT;
+
+  fill_rx_fifo(uart);
+  if(uart->rx_count > 0) {
+    lsr |= UART_LSR_DR;
+  } else {
+    /* ゲストが入力を待ち始めたので、プロンプトなどの出力を画面に出しておく */
+    output_flush(&uart->emu->output);
+  }
+  return lsr;
+}
+
+static uint8_t read_rbr(Uart* uart) {
+  Emulator* emu = uart->emu;
+  uint8_t value;
+
+  fill_rx_fifo(uart);
+  /* LSRを見ずに読みにきたゲストには、これまでのgetcharと同じく入力を待たせる */
+  /* 入力が終わっていれば、getcharのEOFと同じく0xffを返す */
+  while(uart->rx_count == 0) {
+    if(uart->eof) {
+      return 0xff;
+    }
+    /* タイマーやデバイスの割り込みが届く見込みがあれば、ホストの入力を待って止まらず、
+       受信データなし(0)として返す。読み直すループになればdetect_busy_pollが扱う */
+    if((emu->eflags & INTERRUPT_FLAG) && sched_next_time(emu->sched) != SCHED_NEVER) {
+      return 0;
+    }
+    wait_input(uart);
+    fill_rx_fifo(uart);
+  }
+  value = uart->rx_fifo[uart->rx_head];
+  uart->rx_head = (uart->rx_head + 1) % UART_FIFO_SIZE;
+  uart->rx_count--;
+  /* 割り込み要求をいったん下げ、まだ受信データが残っていればもう一度割り込みを出す */
+  uart->irq_line = 0;
+  return value;
+}
+
+static uint8_t read_register(Uart* uart, uint16_t address) {
+  int dlab = uart->lcr & UART_LCR_DLAB;
+
+  switch(address & 7) {
+  case UART_RBR:
+    return dlab ? uart->dll : read_rbr(uart);
+  case UART_IER:
+    return dlab ? uart->dlm : uart->ier;
+  case UART_IIR:
+    /* 受信データあり(0x04)、送信保持レジスタが空(0x02)、要求なし(0x01)。FIFO有効なら上位2ビットが立つ */
+    fill_rx_fifo(uart);
+    if((uart->ier & UART_IER_RDI) && uart->rx_count > 0) {
+      return 0x04 | ((uart->fcr & 1) ? 0xc0 : 0);
+    } else if(uart->ier & UART_IER_THRI) {
+      return 0x02 | ((uart->fcr & 1) ? 0xc0 : 0);
+    }
+    return 0x01 | ((uart->fcr & 1) ? 0xc0 : 0);
+  case UART_LCR:
+    return uart->lcr;
+  case UART_MCR:
+    return uart->mcr;
+  case UART_LSR:
+    return read_lsr(uart);
+  case UART_MSR:
+    /* CTS, DSR, DCDを常にオンにしておく */
+    return 0xb0;
+  default:
+    return uart->scr;
+  }
+}
+
+static uint32_t uart_read(void* context, uint16_t address) {
+  Uart* uart    = context;
+  uint8_t value = read_register(uart, address);
+
+  /* 受信データが届いたか、読み出して受信FIFOが空になったかで割り込み要求が変わる */
+  update_irq(uart);
+  schedule_poll(uart);
+  return value;
+}
+
+static void uart_write(void* context, uint16_t address, uint32_t value) {
+  Uart* uart    = context;
+  Emulator* emu = uart->emu;
+  int dlab      = uart->lcr & UART_LCR_DLAB;
+
+  switch(address & 7) {
+  case UART_RBR:
+    if(dlab) {
+      uart->dll = value;
+      break;
+    }
+    /* BIOSのテレタイプ出力で付けた色が残っていたら元に戻す */
+    if(emu->output.color >= 0) {
+      output_reset_color(&emu->output);
+    }
+    output_put8(&emu->output, value);
+    /* 送信はすぐに終わるので、送信保持レジスタが空になった割り込みをもう一度出す */
+    if(uart->ier & UART_IER_THRI) {
+      raise_irq(emu, UART_IRQ);
+    }
+    break;
+  case UART_IER:
+    if(dlab) {
+      uart->dlm = value;
+    } else {
+      uart->ier = value & 0x0f;
+    }
+    break;
+  case UART_IIR:
+    uart->fcr = value;
+    /* 受信FIFOのクリア */
+    if(value & 0x02) {
+      uart->rx_head  = 0;
+      uart->rx_count = 0;
+    }
+    break;
+  case UART_LCR:
+    uart->lcr = value;
+    break;
+  case UART_MCR:
+    uart->mcr = value;
+    break;
+  case UART_SCR:
+    uart->scr = value;
+    break;
+  }
+  update_irq(uart);
+  schedule_poll(uart);
+}
+
+/* レジスタと割り込み要求を初期状態に戻す
+ *
+ * 読み込みスレッドと、ホストから読んだがゲストがまだ読んでいない入力は残し、
+ * 次にプールから取り出したエミュレータが続きから読めるようにする
+ */
+static void uart_reset(void* context) {
+  Uart* uart = context;
+
+  if(uart->poll_scheduled) {
+    sched_cancel(uart->emu->sched, &uart->poll_event);
+    uart->poll_scheduled = 0;
+  }
+  /* 再生中にログから受け取った入力は、ホストの入力ではないので捨てる */
+  if(replaying(uart)) {
+    uart->rx_head  = 0;
+    uart->rx_count = 0;
+    uart->eof      = 0;
+  }
+  uart->ier = 0;
+  uart->lcr = 0;
+  uart->mcr = 0;
+  uart->scr = 0;
+  uart->dll = 0;
+  uart->dlm = 0;
+  uart->fcr = 0;
+  uart->irq_line = 0;
+  /* 仮想時間が0から数え直しになる */
+  uart->sampled  = UART_NOT_SAMPLED;
+}
+
+Uart* create_uart(Emulator* emu, uint16_t address, int fd) {
+  Uart* uart = calloc(1, sizeof(Uart));
+  IoDevice device = {
+    .read8   = uart_read,
+    .write8  = uart_write,
+    .wait    = uart_wait,
+    .reset   = uart_reset,
+    .context = uart,
+  };
+
+  uart->emu      = emu;
+  uart->address  = address;
+  uart->sampled  = UART_NOT_SAMPLED;
+  uart->input.fd = fd;
+  uart->input.stop_fd = eventfd(0, EFD_CLOEXEC);
+  pthread_mutex_init(&uart->input.lock, NULL);
+  pthread_cond_init(&uart->input.cond, NULL);
+
+  io_register(emu, address, 8, &device);
+  return uart;
+}
+
+void destroy_uart(Uart* uart) {
+  HostInput* input = &uart->input;
+
+  if(uart->poll_scheduled) {
+    sched_cancel(uart->emu->sched, &uart->poll_event);
+  }
+  if(input->started) {
+    uint64_t one = 1;
+    atomic_store(&input->stop, 1);
+    if(write(input->stop_fd, &one, sizeof(one)) < 0) {
+      /* eventfdへの書き込みは失敗しない */
+    }
+    pthread_mutex_lock(&input->lock);
+    pthread_cond_broadcast(&input->cond);
+    pthread_mutex_unlock(&input->lock);
+    /* 通常のファイルからのread中でもすぐに戻ってくる */
+    pthread_join(input->thread, NULL);
+  }
+  close(input->stop_fd);
+  pthread_mutex_destroy(&input->lock);
+  pthread_cond_destroy(&input->cond);
+  free(uart);
+}
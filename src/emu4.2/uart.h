@@ -0,0 +1,51 @@
+#ifndef UART_H_
+#define UART_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* COM1のI/Oポート */
+#define UART_COM1_PORT 0x03f8
+
+/* COM1が出す割り込み要求 */
+#define UART_IRQ 4
+
+/* 受信FIFOの段数 */
+#define UART_FIFO_SIZE 16
+
+/* ホストからの入力を受け取るリングバッファのバイト数(2のべき乗) */
+#define UART_HOST_BUFFER_SIZE 65536
+
+/* LSR(ラインステータスレジスタ)のビット */
+#define UART_LSR_DR   (1)      /* 受信データあり */
+#define UART_LSR_THRE (1 << 5) /* 送信保持レジスタが空 */
+#define UART_LSR_TEMT (1 << 6) /* 送信器が空 */
+
+/* IER(割り込み許可レジスタ)のビット */
+#define UART_IER_RDI  (1)      /* 受信データあり */
+#define UART_IER_THRI (1 << 1) /* 送信保持レジスタが空 */
+
+typedef struct Uart Uart;
+
+/* 16550互換のUARTを作成し、addressから8ポートに登録する
+ *
+ * 送信したデータはemu->outputに書き込む。
+ * 受信データはfdから読み込む。読み込みは最初に受信側のレジスタが読まれたときに
+ * バックグラウンドのスレッドで始まり、エミュレータのスレッドを止めることはない。
+ * -Rで入力を記録しているときは受信データが届いた仮想時刻をログに書き、
+ * -Pで再生しているときはfdから読まずにログから同じ時刻に受け取る。
+ * IERで割り込みを許可すると、割り込み要求が出るたびにUART_IRQの割り込みを出す
+ */
+Uart* create_uart(Emulator* emu, uint16_t address, int fd);
+
+/* 読み込みスレッドを止めてUARTを破棄する */
+void destroy_uart(Uart* uart);
+
+/* 受信データがあるか、ホストの入力が終わっていれば1を返す(ブロックしない) */
+int uart_input_ready(Uart* uart);
+
+/* 割り込み要求が出ていれば1を返す */
+int uart_irq_pending(Uart* uart);
+
+#endif
@@ -0,0 +1,302 @@
+#include "vga.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "emulator_function.h"
+#include "io.h"
+#include "sched.h"
+
+/* CRTコントローラのカーソル位置のレジスタ */
+#define CRTC_CURSOR_HIGH 0x0e
+#define CRTC_CURSOR_LOW  0x0f
+
+/* VGAの色番号(青が最下位ビット)を端末の色番号(赤が最下位ビット)に変換するテーブル */
+static const int vga_to_terminal[8] = {0, 4, 2, 6, 1, 5, 3, 7};
+
+struct Vga {
+  Emulator* emu;
+
+  /* 書き込みのあったセル */
+  uint32_t dirty[(VGA_CELLS + 31) / 32];
+  int dirty_count;
+
+  /* 端末に表示済みの内容(文字コードとアトリビュート) */
+  uint16_t shown[VGA_CELLS];
+  /* 端末のカーソルのセル番号と、最後に設定したアトリビュート。不明なら-1 */
+  int terminal_cursor;
+  int terminal_attribute;
+  /* 端末に最後に表示したハードウェアカーソルの位置 */
+  int shown_cursor;
+
+  /* CRTコントローラ */
+  uint8_t crtc_index;
+  uint16_t cursor;
+
+  /* 描画の予定 */
+  TimerEvent event;
+  int scheduled;
+  struct timespec last_frame;
+};
+
+static uint16_t cell_at(Vga* vga, int cell) {
+  uint8_t* p = vga->emu->memory + VGA_TEXT_BASE + cell * 2;
+  return p[0] | (p[1] << 8);
+}
+
+static int64_t elapsed_ns(const struct timespec* from, const struct timespec* to) {
+  return (int64_t)(to->tv_sec - from->tv_sec) * 1000000000 + (to->tv_nsec - from->tv_nsec);
+}
+
+/* 1セル分のエスケープシーケンスと文字を組み立てて出力バッファへ書く */
+static void draw_cell(Vga* vga, OutputBuffer* out, int cell, uint16_t value) {
+  char buf[48];
+  int len = 0;
+  uint8_t ch        = value & 0xff;
+  uint8_t attribute = value >> 8;
+
+  /* 直前に書いたセルの次でなければ、カーソルを移動する */
+  if(vga->terminal_cursor != cell) {
+    len += sprintf(buf + len, "\x1b[%d;%dH", cell / VGA_COLUMNS + 1, cell % VGA_COLUMNS + 1);
+  }
+  if(vga->terminal_attribute != attribute && !out->colorless) {
+    /* 下位4ビットが文字色(3ビット目は輝度)、4〜6ビットが背景色 */
+    len += sprintf(buf + len, "\x1b[0;%s%d;%dm", (attribute & 0x08) ? "1;" : "",
+                   30 + vga_to_terminal[attribute & 0x07],
+                   40 + vga_to_terminal[(attribute >> 4) & 0x07]);
+    vga->terminal_attribute = attribute;
+  }
+  /* 端末で表示できない文字は空白や?にする */
+  if(ch < 0x20) {
+    ch = ' ';
+  } else if(ch >= 0x7f) {
+    ch = '?';
+  }
+  buf[len++] = ch;
+  output_write(out, buf, len);
+
+  /* 行末のセルを書いた後の端末のカーソル位置は端末によって違うので、不明にする */
+  vga->terminal_cursor = (cell % VGA_COLUMNS == VGA_COLUMNS - 1) ? -1 : cell + 1;
+}
+
+void vga_refresh(Vga* vga) {
+  OutputBuffer* out = &vga->emu->output;
+  int word;
+  int drawn = 0;
+
+  for(word = 0; word < (VGA_CELLS + 31) / 32 && vga->dirty_count > 0; word++) {
+    uint32_t bits = vga->dirty[word];
+    vga->dirty[word] = 0;
+    while(bits != 0) {
+      int cell       = word * 32 + __builtin_ctz(bits);
+      uint16_t value = cell_at(vga, cell);
+      bits &= bits - 1;
+      /* 同じ値を書き直しただけのセルは描画しない */
+      if(value != vga->shown[cell]) {
+        draw_cell(vga, out, cell, value);
+        vga->shown[cell] = value;
+        drawn = 1;
+      }
+    }
+  }
+  vga->dirty_count = 0;
+
+  /* ハードウェアカーソルの位置に端末のカーソルを置く */
+  if(drawn || vga->shown_cursor != vga->cursor) {
+    char buf[32];
+    int cursor = vga->cursor < VGA_CELLS ? vga->cursor : VGA_CELLS - 1;
+    int len    = sprintf(buf, "\x1b[%d;%dH", cursor / VGA_COLUMNS + 1, cursor % VGA_COLUMNS + 1);
+    output_write(out, buf, len);
+    vga->terminal_cursor = cursor;
+    vga->shown_cursor    = vga->cursor;
+  }
+  /* 描画は書き出し用のスレッドに任せ、端末への書き込みを待たない */
+  output_kick(out, 0);
+  clock_gettime(CLOCK_MONOTONIC, &vga->last_frame);
+}
+
+/* 描画の予定の時刻になったときのイベント */
+/* 前回の描画からVGA_FRAME_NS経っていなければ、もう少し後に延ばす */
+static void vga_frame(void* context) {
+  Vga* vga = context;
+  struct timespec now, rest;
+  int64_t elapsed;
+
+  vga->scheduled = 0;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = elapsed_ns(&vga->last_frame, &now);
+  if(elapsed < VGA_FRAME_NS) {
+    if(!vga->emu->halted) {
+      vga->scheduled = 1;
+      sched_add(vga->emu->sched, &vga->event, vga->emu->vtime + VGA_CHECK_INTERVAL, vga_frame, vga);
+      return;
+    }
+    /* hltで止まっている間は仮想時間がすぐ次のイベントまで飛ぶので、延ばしても空回りするだけになる */
+    /* 残りの時間だけ眠ってから描画する */
+    rest.tv_sec  = 0;
+    rest.tv_nsec = VGA_FRAME_NS - elapsed;
+    nanosleep(&rest, NULL);
+  }
+  vga_refresh(vga);
+}
+
+/* 最初の変更で描画を予定する */
+/* 画面が変わらない間はイベントを入れないので、hltで止まったゲストを起こし続けることはない */
+static void schedule_frame(Vga* vga) {
+  if(!vga->scheduled) {
+    vga->scheduled = 1;
+    sched_add(vga->emu->sched, &vga->event, vga->emu->vtime + VGA_CHECK_INTERVAL, vga_frame, vga);
+  }
+}
+
+void vga_mark(Vga* vga, uint32_t address) {
+  int cell = (address - VGA_TEXT_BASE) >> 1;
+  uint32_t bit = 1u << (cell & 31);
+
+  if(!(vga->dirty[cell >> 5] & bit)) {
+    vga->dirty[cell >> 5] |= bit;
+    vga->dirty_count++;
+    schedule_frame(vga);
+  }
+}
+
+void vga_mark_range(Vga* vga, uint32_t address, uint32_t size) {
+  uint32_t start = address > VGA_TEXT_BASE ? address : VGA_TEXT_BASE;
+  uint32_t end   = address + size < VGA_TEXT_BASE + VGA_TEXT_SIZE ? address + size : VGA_TEXT_BASE + VGA_TEXT_SIZE;
+
+  for(; start < end; start += 2) {
+    vga_mark(vga, start);
+  }
+}
+
+/* 画面を1行上へスクロールし、最下行を空白にする */
+static void scroll_up(Vga* vga) {
+  Emulator* emu = vga->emu;
+  int i;
+
+  memmove(emu->memory + VGA_TEXT_BASE, emu->memory + VGA_TEXT_BASE + VGA_COLUMNS * 2,
+          (VGA_CELLS - VGA_COLUMNS) * 2);
+  for(i = VGA_CELLS - VGA_COLUMNS; i < VGA_CELLS; i++) {
+    emu->memory[VGA_TEXT_BASE + i * 2]     = ' ';
+    emu->memory[VGA_TEXT_BASE + i * 2 + 1] = 0x07;
+  }
+  mark_memory_dirty(emu, VGA_TEXT_BASE, VGA_TEXT_SIZE);
+  emu->memory_writes++;
+}
+
+void vga_teletype(Vga* vga, uint8_t ch, uint8_t attribute) {
+  int cursor = vga->cursor < VGA_CELLS ? vga->cursor : VGA_CELLS - 1;
+
+  switch(ch) {
+  case '\r':
+    cursor -= cursor % VGA_COLUMNS;
+    break;
+  case '\n':
+    cursor += VGA_COLUMNS;
+    break;
+  case '\b':
+    if(cursor % VGA_COLUMNS != 0) {
+      cursor--;
+    }
+    break;
+  default:
+    set_memory8(vga->emu, VGA_TEXT_BASE + cursor * 2, ch);
+    set_memory8(vga->emu, VGA_TEXT_BASE + cursor * 2 + 1, attribute);
+    cursor++;
+  }
+  if(cursor >= VGA_CELLS) {
+    scroll_up(vga);
+    cursor -= VGA_COLUMNS;
+  }
+  vga->cursor = cursor;
+  schedule_frame(vga);
+}
+
+uint16_t vga_get_cursor(Vga* vga) {
+  return vga->cursor;
+}
+
+void vga_set_cursor(Vga* vga, uint16_t cursor) {
+  vga->cursor = cursor;
+  schedule_frame(vga);
+}
+
+static uint32_t crtc_read(void* context, uint16_t address) {
+  Vga* vga = context;
+
+  if(address == VGA_CRTC_PORT) {
+    return vga->crtc_index;
+  }
+  switch(vga->crtc_index) {
+  case CRTC_CURSOR_HIGH:
+    return vga->cursor >> 8;
+  case CRTC_CURSOR_LOW:
+    return vga->cursor & 0xff;
+  default:
+    return 0;
+  }
+}
+
+static void crtc_write(void* context, uint16_t address, uint32_t value) {
+  Vga* vga = context;
+
+  if(address == VGA_CRTC_PORT) {
+    vga->crtc_index = value;
+    return;
+  }
+  switch(vga->crtc_index) {
+  case CRTC_CURSOR_HIGH:
+    vga->cursor = (vga->cursor & 0x00ff) | ((value & 0xff) << 8);
+    schedule_frame(vga);
+    break;
+  case CRTC_CURSOR_LOW:
+    vga->cursor = (vga->cursor & 0xff00) | (value & 0xff);
+    schedule_frame(vga);
+    break;
+  }
+}
+
+Vga* create_vga(Emulator* emu) {
+  Vga* vga = calloc(1, sizeof(Vga));
+  IoDevice device = {
+    .read8   = crtc_read,
+    .write8  = crtc_write,
+    .context = vga,
+  };
+  int i;
+
+  vga->emu                = emu;
+  vga->terminal_cursor    = -1;
+  vga->terminal_attribute = -1;
+  vga->shown_cursor       = -1;
+  io_register(emu, VGA_CRTC_PORT, 2, &device);
+
+  /* 端末の画面を消去する。消去した画面は空白が並んでいるのと同じなので、
+     表示済みの内容を空白(アトリビュート0)として、それ以外のセルを描画対象にする */
+  output_write(&emu->output, "\x1b[0m\x1b[2J", 8);
+  for(i = 0; i < VGA_CELLS; i++) {
+    vga->shown[i] = 0x0000;
+    if(cell_at(vga, i) != 0x0000) {
+      vga_mark(vga, VGA_TEXT_BASE + i * 2);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &vga->last_frame);
+  return vga;
+}
+
+void destroy_vga(Vga* vga) {
+  char buf[32];
+  int len;
+
+  vga_refresh(vga);
+  if(vga->scheduled) {
+    sched_cancel(vga->emu->sched, &vga->event);
+  }
+  /* エミュレータのメッセージが画面を壊さないよう、画面の下へカーソルを移す */
+  len = sprintf(buf, "\x1b[0m\x1b[%d;1H", VGA_ROWS + 1);
+  output_write(&vga->emu->output, buf, len);
+  output_drain(&vga->emu->output);
+  free(vga);
+}
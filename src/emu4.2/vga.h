@@ -0,0 +1,60 @@
+#ifndef VGA_H_
+#define VGA_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* VGAのテキストモード(80x25)
+ *
+ * 0xB8000番地からの文字とアトリビュートの組を画面として、ホストの端末に描画する。
+ * 書き込みのあったセルをビットマップに記録しておき、描画のときは前回描画した内容と
+ * 違うセルだけを、カーソル移動のエスケープシーケンスを付けて出力する
+ */
+#define VGA_TEXT_BASE 0xB8000
+#define VGA_COLUMNS   80
+#define VGA_ROWS      25
+#define VGA_CELLS     (VGA_COLUMNS * VGA_ROWS)
+/* 1セルは文字コードとアトリビュートの2バイト */
+#define VGA_TEXT_SIZE (VGA_CELLS * 2)
+
+/* CRTコントローラのインデックスとデータのI/Oポート(カーソル位置のレジスタだけ対応) */
+#define VGA_CRTC_PORT 0x03d4
+
+/* 描画するかを調べる間隔(仮想時間) */
+#define VGA_CHECK_INTERVAL 100000
+/* 描画の最短間隔(ナノ秒)。毎秒60フレームを上限にする */
+#define VGA_FRAME_NS (1000000000 / 60)
+
+typedef struct Vga Vga;
+
+/* テキスト画面を作成し、CRTコントローラのポートを登録する
+ *
+ * 描画はemu->outputに書き込む。画面を消去して、ゲストのメモリの現在の内容を描画対象にする
+ */
+Vga* create_vga(Emulator* emu);
+
+/* 残っている変更を描画し、カーソルを画面の下へ移してから破棄する */
+void destroy_vga(Vga* vga);
+
+/* ゲストがテキスト画面のaddressに書き込んだことを記録する */
+/* set_memory8から呼ばれるので、ビットを立てるだけにしておく */
+void vga_mark(Vga* vga, uint32_t address);
+
+/* addressからsizeバイトのうちテキスト画面に重なる部分を記録する */
+void vga_mark_range(Vga* vga, uint32_t address, uint32_t size);
+
+/* 変更のあったセルを今すぐ描画する */
+void vga_refresh(Vga* vga);
+
+/* カーソル位置(セル番号)を取得・設定する */
+uint16_t vga_get_cursor(Vga* vga);
+void vga_set_cursor(Vga* vga, uint16_t cursor);
+
+/* BIOSのテレタイプ出力のように、カーソル位置に1文字書いてカーソルを進める
+ *
+ * CR, LF, BSを解釈し、最下行を越えたら画面をスクロールする
+ */
+void vga_teletype(Vga* vga, uint8_t ch, uint8_t attribute);
+
+#endif
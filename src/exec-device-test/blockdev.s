@@ -0,0 +1,92 @@
+.intel_syntax noprefix
+.code32
+
+# ブロックデバイス(-b)へ読み込み、書き込み、フラッシュ、書いたセクタの読み直しを
+# 1つのリングで要求し、IRQ 5の割り込みで完了を待つ
+#
+# EAX = 0x10000に読んだ1セクタ目("SEC0")
+# EBX = 0x10200に読んだ2セクタ目("SEC1")
+# ECX = lba 3に書いて読み直した"MARK"
+# EDX = 4つの記述子の先頭4バイトの和(すべて成功ならステータスが0で0x00040003)
+# EBP = 完了した記述子の数
+
+.set BLK_RING_ADDR,     0x600
+.set BLK_RING_SIZE,     0x604
+.set BLK_DOORBELL,      0x608
+.set BLK_STATUS,        0x60c
+.set BLK_CONTROL,       0x610
+.set BLK_COMPLETED,     0x614
+
+.set RING,              0x1000
+.set IRQ5_VECTOR,       (8 + 5) * 4
+
+start:
+    mov dword ptr [IRQ5_VECTOR], offset irq5
+    mov dword ptr [0x20000], 0x4b52414d     # "MARK"
+
+    # 記述子は16バイト: op(0読み込み、1書き込み、2フラッシュ)、status(0xffで未完了)、
+    # セクタ数(16ビット)、バッファの番地、lba(64ビット)
+    mov dword ptr [RING + 0x00], 0x0002ff00 # lba 0から2セクタを0x10000へ
+    mov dword ptr [RING + 0x04], 0x10000
+    mov dword ptr [RING + 0x08], 0
+    mov dword ptr [RING + 0x0c], 0
+    mov dword ptr [RING + 0x10], 0x0001ff01 # 0x20000の1セクタをlba 3へ
+    mov dword ptr [RING + 0x14], 0x20000
+    mov dword ptr [RING + 0x18], 3
+    mov dword ptr [RING + 0x1c], 0
+    mov dword ptr [RING + 0x20], 0x0000ff02 # フラッシュ
+    mov dword ptr [RING + 0x24], 0
+    mov dword ptr [RING + 0x28], 0
+    mov dword ptr [RING + 0x2c], 0
+    mov dword ptr [RING + 0x30], 0x0001ff00 # lba 3を0x30000へ読み直す
+    mov dword ptr [RING + 0x34], 0x30000
+    mov dword ptr [RING + 0x38], 3
+    mov dword ptr [RING + 0x3c], 0
+
+    mov edx, BLK_RING_ADDR
+    mov eax, RING
+    out dx, eax
+    mov edx, BLK_RING_SIZE
+    mov eax, 4
+    out dx, eax
+    mov edx, BLK_CONTROL        # 完了を割り込みで知らせてもらう
+    mov eax, 1
+    out dx, eax
+    mov edx, BLK_DOORBELL
+    mov eax, 4
+    out dx, eax
+
+    # stiとhltの間に割り込みが入ると眠ったままになるので、
+    # 最後の完了はハンドラの中で見つけてそのまま結果の確認へ進む
+    sti
+idle:
+    hlt
+    jmp idle
+
+irq5:
+    mov edx, BLK_STATUS         # 割り込みの要因を消す
+    mov eax, 1
+    out dx, eax
+    mov edx, BLK_COMPLETED
+    in eax, dx
+    cmp eax, 4
+    je finish
+    iret
+
+finish:
+    add esp, 8                  # 割り込みの戻り先とEFLAGSを捨てる
+    mov ebp, eax
+    mov esi, RING
+    mov edx, [esi]
+    mov eax, [esi + 0x10]
+    add edx, eax
+    mov eax, [esi + 0x20]
+    add edx, eax
+    mov eax, [esi + 0x30]
+    add edx, eax
+    mov esi, 0x10000
+    mov eax, [esi]
+    mov ebx, [esi + 0x200]
+    mov esi, 0x30000
+    mov ecx, [esi]
+    jmp 0
@@ -0,0 +1,6 @@
+# ブロックデバイスとINT 13h(-d)のテストで読むディスクイメージ
+# 4セクタで、各セクタの先頭に"SEC0"から"SEC3"を置く
+.irpc i, 0123
+    .ascii "SEC\i"
+    .fill 512 - 4, 1, 0
+.endr
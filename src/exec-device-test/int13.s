@@ -0,0 +1,50 @@
+.intel_syntax noprefix
+.code32
+
+# INT 13hでディスクイメージ(-d)をCHSとLBAで読み、不正なセクタでエラーになることを確かめる
+# DLには起動したドライブが入っている
+#
+# EAX = 不正な読み込みの戻り値(AH=04)
+# EBX = CHSで読んだセクタ2(LBA 1)の先頭("SEC1")
+# ECX = LBAで読んだLBA 2の先頭("SEC2")
+# EDX = LBAで読んだLBA 3の先頭("SEC3")
+# EBP = LBAの読み込みの戻り値(AH=00)に、不正な読み込みでCFが立てば1を足したもの
+# ESI = 読み込み後のパケットの先頭(サイズ0x10、セクタ数2)
+# EDI = CHSの読み込みの戻り値(AH=00、AL=1)
+
+.set PACKET,            0x500
+
+start:
+    # CHS: シリンダ0、ヘッド0、セクタ2を0x10000へ
+    mov eax, 0x0201
+    mov ecx, 0x0002
+    mov dh, 0
+    mov ebx, 0x10000
+    int 0x13
+    mov edi, eax
+
+    # LBA: 2から2セクタを0x2000:0000へ
+    mov dword ptr [PACKET + 0], 0x00020010
+    mov dword ptr [PACKET + 4], 0x20000000
+    mov dword ptr [PACKET + 8], 2
+    mov dword ptr [PACKET + 12], 0
+    mov esi, PACKET
+    mov eax, 0x4200
+    int 0x13
+    mov ebp, eax
+
+    # セクタ0は存在しないので、AH=04でCFが立つ
+    mov eax, 0x0201
+    mov ecx, 0
+    int 0x13
+    jnc ok
+    inc ebp
+ok:
+    mov esi, 0x10000
+    mov ebx, [esi]
+    mov esi, 0x20000
+    mov ecx, [esi]
+    mov edx, [esi + 0x200]
+    mov esi, PACKET
+    mov esi, [esi]
+    jmp 0
@@ -0,0 +1,69 @@
+.intel_syntax noprefix
+.code32
+
+# 2つのエミュレータを同じリンク(-N shm:path)につなぎ、お互いに"PING"を送る
+# 受信の記述子は長さ0(不正)と64バイトを置く
+#
+# EAX = 受け取ったフレームの先頭("PING")
+# EBX = 長さ0の受信の記述子の2つ目の4バイト(ステータス2=不正な要求、長さ0)
+# ECX = 64バイトの受信の記述子の2つ目の4バイト(ステータス0、長さ4)
+# EDX = 送信の記述子の2つ目の4バイト(ステータス0、長さ4)
+
+.set NIC_TX_RING_ADDR,  0x700
+.set NIC_TX_RING_SIZE,  0x704
+.set NIC_TX_DOORBELL,   0x708
+.set NIC_RX_RING_ADDR,  0x70c
+.set NIC_RX_RING_SIZE,  0x710
+.set NIC_RX_DOORBELL,   0x714
+
+.set TX_RING,           0x1000
+.set RX_RING,           0x1100
+.set TX_BUFFER,         0x2000
+.set RX_BUFFER,         0x3000
+
+start:
+    # 記述子は8バイト: バッファの番地、長さ(16ビット)、status(0xffで未完了)、予約
+    mov dword ptr [TX_RING + 0], TX_BUFFER
+    mov dword ptr [TX_RING + 4], 0x00ff0004
+    mov dword ptr [TX_BUFFER], 0x474e4950   # "PING"
+    mov dword ptr [RX_RING + 0], RX_BUFFER
+    mov dword ptr [RX_RING + 4], 0x00ff0000
+    mov dword ptr [RX_RING + 8], RX_BUFFER
+    mov dword ptr [RX_RING + 12], 0x00ff0040
+
+    mov edx, NIC_TX_RING_ADDR
+    mov eax, TX_RING
+    out dx, eax
+    mov edx, NIC_TX_RING_SIZE
+    mov eax, 1
+    out dx, eax
+    mov edx, NIC_RX_RING_ADDR
+    mov eax, RX_RING
+    out dx, eax
+    mov edx, NIC_RX_RING_SIZE
+    mov eax, 2
+    out dx, eax
+    mov edx, NIC_RX_DOORBELL
+    out dx, eax
+    mov edx, NIC_TX_DOORBELL
+    mov eax, 1
+    out dx, eax
+
+    # ドアベルのレジスタは処理の終わった記述子の数を返す
+txwait:
+    in eax, dx
+    cmp eax, 1
+    jne txwait
+    mov edx, NIC_RX_DOORBELL
+rxwait:
+    in eax, dx
+    cmp eax, 2
+    jne rxwait
+
+    mov esi, RX_BUFFER
+    mov eax, [esi]
+    mov esi, TX_RING
+    mov ebx, [esi + 0x104]
+    mov ecx, [esi + 0x10c]
+    mov edx, [esi + 4]
+    jmp 0
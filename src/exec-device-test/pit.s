@@ -0,0 +1,41 @@
+.intel_syntax noprefix
+.code32
+
+# PITのチャンネル0を0x1000命令ごとのレートジェネレータにし、
+# hltで眠りながらIRQ 0の割り込みを5回数える
+#
+# EBX = 割り込みの数(5)
+# ECX = hltから起きて戻ってきた数(最後の割り込みはハンドラで終わるので4)
+
+.set PIT_COUNTER0,      0x40
+.set PIT_MODE,          0x43
+
+.set IRQ0_VECTOR,       (8 + 0) * 4
+
+start:
+    mov dword ptr [IRQ0_VECTOR], offset irq0
+    mov ebx, 0
+    mov ecx, 0
+    mov edx, PIT_MODE           # チャンネル0、下位と上位、モード2
+    mov al, 0x34
+    out dx, al
+    mov edx, PIT_COUNTER0
+    mov al, 0x00
+    out dx, al
+    mov al, 0x10
+    out dx, al
+    sti
+idle:
+    hlt
+    inc ecx
+    jmp idle
+
+irq0:
+    inc ebx
+    cmp ebx, 5
+    je finish
+    iret
+
+finish:
+    add esp, 8                  # 割り込みの戻り先とEFLAGSを捨てる
+    jmp 0
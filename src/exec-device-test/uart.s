@@ -0,0 +1,42 @@
+.intel_syntax noprefix
+.code32
+
+# COM1の受信の割り込み(IRQ 4)で3文字を受け取る。入力が終わった後のRBRは0xffになる
+#
+# EAX = 受け取った3文字("abc"なら0x00636261)
+# EBX = 受け取った文字の数
+# EDI = 入力が終わった後に読んだRBR
+
+.set UART_RBR,          0x3f8
+.set UART_IER,          0x3f9
+
+.set BUFFER,            0x500
+.set IRQ4_VECTOR,       (8 + 4) * 4
+
+start:
+    mov dword ptr [IRQ4_VECTOR], offset irq4
+    mov ebx, 0
+    mov edx, UART_IER           # 受信の割り込みを許可する
+    mov al, 1
+    out dx, al
+    sti
+idle:
+    hlt
+    jmp idle
+
+irq4:
+    mov edx, UART_RBR
+    in al, dx
+    mov [ebx + BUFFER], al
+    inc ebx
+    cmp ebx, 3
+    je finish
+    iret
+
+finish:
+    add esp, 8                  # 割り込みの戻り先とEFLAGSを捨てる
+    in al, dx
+    mov edi, eax
+    mov esi, BUFFER
+    mov eax, [esi]
+    jmp 0
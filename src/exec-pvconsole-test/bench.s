@@ -0,0 +1,42 @@
+.intel_syntax noprefix
+.code32
+# 64文字の行をCOUNT回表示する
+# --defsym USE_PVCONSOLE=1を付けてアセンブルすると準仮想化コンソールで、
+# 付けなければexec-io-testと同じ1文字ずつのout dx, alで表示する
+.set COUNT, 200000
+
+start:
+    mov ebx, COUNT
+repeat:
+    mov esi, offset msg
+.ifdef USE_PVCONSOLE
+    mov ecx, offset msglen
+    call pvcon_write
+.else
+    call puts
+.endif
+    sub ebx, 1
+    jnz repeat
+    jmp 0
+
+.ifdef USE_PVCONSOLE
+.include "pvconsole.inc"
+.else
+# esiに設定された文字列を1文字ずつ表示するサブルーチン
+puts:
+    mov edx, 0x03f8
+puts_loop:
+    mov al, [esi]
+    inc esi
+    cmp al, 0
+    je putsend
+    out dx, al
+    jmp puts_loop
+putsend:
+    ret
+.endif
+
+msg:
+    .ascii "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ\n"
+.set msglen, . - msg
+    .byte 0
@@ -0,0 +1,36 @@
+.intel_syntax noprefix
+.code32
+# exec-io-testのselect.asmの文字列の表示を、準仮想化コンソールのpvcon_putsに置き換えたもの
+start:
+    mov edx, 0x03f8
+mainloop:
+    mov al, '>'     # プロンプトを表示
+    out dx, al
+input:
+    in al, dx       # 1文字入力
+    cmp al, 'h'
+    je puthello     # hならhelloを表示
+    cmp al, 'w'
+    je putworld     # wならworldを表示
+    cmp al, 'q'
+    je fin          # qなら終了
+    jmp input       # それ以外なら再入力
+puthello:
+    mov esi, offset msghello
+    call pvcon_puts
+    mov edx, 0x03f8 # pvcon_putsがedxを書き換えるので戻す
+    jmp mainloop
+putworld:
+    mov esi, offset msgworld
+    call pvcon_puts
+    mov edx, 0x03f8
+    jmp mainloop
+fin:
+    jmp 0
+
+.include "pvconsole.inc"
+
+msghello:
+    .ascii "hello\r\n\0"
+msgworld:
+    .ascii "world\r\n\0"